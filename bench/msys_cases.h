@@ -0,0 +1,70 @@
+	{ "map:naive:ddr3",
+	  { { 0x0, 0x100000000 } } },
+	{ "map:naive:ddr4",
+	  { { 0x0, 0x200000000 } } },
+	{ "map:intel:sandy",
+	  { { 0x0, 0x100000000 } } },
+	{ "map:intel:sandy:2rank",
+	  { { 0x0, 0x200000000 } } },
+	{ "map:intel:sandy:2dimm",
+	  { { 0x0, 0x200000000 } } },
+	{ "map:intel:sandy:2chan",
+	  { { 0x0, 0x200000000 } } },
+	{ "map:intel:sandy:2dimm:2rank",
+	  { { 0x0, 0x400000000 } } },
+	{ "map:intel:sandy:2chan:2rank",
+	  { { 0x0, 0x400000000 } } },
+	{ "map:intel:sandy:2chan:2dimm",
+	  { { 0x0, 0x400000000 } } },
+	{ "map:intel:sandy:2chan:2dimm:2rank",
+	  { { 0x0, 0x800000000 } } },
+	{ "map:intel:ivyhaswell",
+	  { { 0x0, 0x100000000 } } },
+	{ "map:intel:ivyhaswell:2rank",
+	  { { 0x0, 0x200000000 } } },
+	{ "map:intel:ivyhaswell:2dimm",
+	  { { 0x0, 0x200000000 } } },
+	{ "map:intel:ivyhaswell:2chan",
+	  { { 0x0, 0x200000000 } } },
+	{ "map:intel:ivyhaswell:2dimm:2rank",
+	  { { 0x0, 0x400000000 } } },
+	{ "map:intel:ivyhaswell:2chan:2rank",
+	  { { 0x0, 0x400000000 } } },
+	{ "map:intel:ivyhaswell:2chan:2dimm",
+	  { { 0x0, 0x400000000 } } },
+	{ "map:intel:ivyhaswell:2chan:2dimm:2rank",
+	  { { 0x0, 0x800000000 } } },
+	{ "map:intel:sandy:pcibase=0x7f800000:tom=0x100000000",
+	  { { 0x0, 0x7f800000 }, { 0x100000000, 0x180800000 } } },
+	{ "map:intel:sandy:2rank:pcibase=0x7f800000:tom=0x200000000",
+	  { { 0x0, 0x7f800000 }, { 0x100000000, 0x280800000 } } },
+	{ "map:intel:sandy:2dimm:pcibase=0x7f800000:tom=0x200000000",
+	  { { 0x0, 0x7f800000 }, { 0x100000000, 0x280800000 } } },
+	{ "map:intel:sandy:2chan:pcibase=0x7f800000:tom=0x200000000",
+	  { { 0x0, 0x7f800000 }, { 0x100000000, 0x280800000 } } },
+	{ "map:intel:ivyhaswell:pcibase=0x7f800000:tom=0x100000000",
+	  { { 0x0, 0x7f800000 }, { 0x100000000, 0x180800000 } } },
+	{ "map:intel:ivyhaswell:2rank:pcibase=0x7f800000:tom=0x200000000",
+	  { { 0x0, 0x7f800000 }, { 0x100000000, 0x280800000 } } },
+	{ "map:intel:ivyhaswell:2dimm:pcibase=0x7f800000:tom=0x200000000",
+	  { { 0x0, 0x7f800000 }, { 0x100000000, 0x280800000 } } },
+	{ "map:intel:ivyhaswell:2chan:pcibase=0x7f800000:tom=0x200000000",
+	  { { 0x0, 0x7f800000 }, { 0x100000000, 0x280800000 } } },
+	{ "map:naive:ddr3;remap:rasxor:bit=3:mask=6",
+	  { { 0x0, 0x100000000 } } },
+	{ "map:intel:sandy:2chan;remap:rasxor:bit=3:mask=6",
+	  { { 0x0, 0x200000000 } } },
+	{ "map:intel:ivyhaswell:2chan;remap:rasxor:bit=3:mask=6",
+	  { { 0x0, 0x200000000 } } },
+	{ "map:intel:sandy:2rank;remap:rankmirror:ddr3",
+	  { { 0x0, 0x200000000 } } },
+	{ "map:intel:sandy:2chan:2rank;remap:rankmirror:ddr3",
+	  { { 0x0, 0x400000000 } } },
+	{ "map:intel:ivyhaswell:2rank;remap:rankmirror:ddr3",
+	  { { 0x0, 0x200000000 } } },
+	{ "map:intel:ivyhaswell:2chan:2rank;remap:rankmirror:ddr3",
+	  { { 0x0, 0x400000000 } } },
+	{ "map:xor:bank=0x12000,0x24000,0x48000:row=0x10000,0x20000,0x40000,0x80000,0x100000,0x200000,0x400000,0x800000,0x1000000,0x2000000,0x4000000,0x8000000,0x10000000,0x20000000,0x40000000,0x80000000:col=0x8,0x10,0x20,0x40,0x80,0x100,0x200,0x400,0x800,0x1000",
+	  { { 0x0, 0x100000000 } } },
+	{ "map:xor:chan=0xc3380:rank=0x110000:bank=0x44000,0x88000,0x220000:row=0x40000,0x80000,0x100000,0x200000,0x400000,0x800000,0x1000000,0x2000000,0x4000000,0x8000000,0x10000000,0x20000000,0x40000000,0x80000000,0x100000000,0x200000000:col=0x8,0x10,0x20,0x40,0x100,0x200,0x400,0x800,0x1000,0x2000;remap:rankmirror:ddr3",
+	  { { 0x0, 0x400000000 } } },
@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Microbenchmarks of address resolution and BufferMap queries.
+ * Results are written to stdout as JSON.
+ *
+ * Usage: ramses_bench [-t MIN_MS] [-f FILTER]
+ *   -t  Minimum time to spend on each measurement, in milliseconds
+ *   -f  Only benchmark memory systems whose string contains FILTER
+ */
+#define _XOPEN_SOURCE 700
+
+#include <ramses/msys.h>
+#include <ramses/bufmap.h>
+#include <ramses/translate.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_VERSION 1
+
+#define NADDRS 4096 /* Inputs cycled through by each measurement */
+#define BM_PAGES (1 << 15) /* Pages in each synthetic BufferMap */
+#define BM_PAGESHIFT 12
+#define BM_VABASE 0x100000000000ULL
+#define ENTRIES_BATCH 64
+
+/* Memory systems and the physical ranges they cover, from test/msys_cases.txt */
+static const struct {
+	const char *msys;
+	struct { physaddr_t start, end; } ranges[2];
+} CASES[] = {
+#include "msys_cases.h"
+};
+static const size_t NCASES = sizeof(CASES) / sizeof(*CASES);
+
+static const struct {
+	const char *name;
+	int flags;
+} MSYS_VARIANTS[] = {
+	{ "plain", 0 },
+	{ "fuse", MSYS_FUSE },
+	{ "jit", MSYS_JIT }
+};
+
+static const struct {
+	const char *name;
+	int flags;
+} BUFMAP_VARIANTS[] = {
+	{ "plain", BUFMAP_NOCLOBBER },
+	{ "indexed", BUFMAP_NOCLOBBER | BUFMAP_SEARCHIDX | BUFMAP_ROWIDX }
+};
+
+static uint64_t min_ns = 20000000;
+static volatile uint64_t sink;
+static bool first_result = true;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static uint64_t rng(void)
+{
+	static uint64_t x = 0x9e3779b97f4a7c15ULL;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static void report(const char *bench, const char *config, const char *variant,
+                   double ns_per_op)
+{
+	printf("%s\n    {\"bench\": \"%s\", \"config\": \"%s\", \"variant\": \"%s\", "
+	       "\"ns_per_op\": %.3f, \"ops_per_sec\": %.0f}",
+	       first_result ? "" : ",", bench, config, variant, ns_per_op,
+	       1e9 / ns_per_op);
+	first_result = false;
+	fflush(stdout);
+}
+
+/*
+ * Run `fn' until at least `min_ns' have passed.
+ * `fn' returns the number of operations it performed.
+ */
+static double measure(size_t (*fn)(void *), void *arg)
+{
+	const uint64_t t0 = now_ns();
+	uint64_t t;
+	size_t ops = 0;
+	do {
+		ops += fn(arg);
+	} while ((t = now_ns()) - t0 < min_ns);
+	return (double)(t - t0) / ops;
+}
+
+/* Address resolution */
+
+struct ResolveBench {
+	struct MemorySystem *m;
+	physaddr_t pa[NADDRS];
+	struct DRAMAddr da[NADDRS];
+};
+
+static size_t run_resolve(void *arg)
+{
+	struct ResolveBench *b = (struct ResolveBench *)arg;
+	uint64_t acc = 0;
+	for (size_t i = 0; i < NADDRS; i++) {
+		acc += ramses_resolve(b->m, b->pa[i]).row;
+	}
+	sink = acc;
+	return NADDRS;
+}
+
+static size_t run_resolve_reverse(void *arg)
+{
+	struct ResolveBench *b = (struct ResolveBench *)arg;
+	uint64_t acc = 0;
+	for (size_t i = 0; i < NADDRS; i++) {
+		acc += ramses_resolve_reverse(b->m, b->da[i]);
+	}
+	sink = acc;
+	return NADDRS;
+}
+
+/* Uniformly random physical address within the ranges of case `c' */
+static physaddr_t case_addr(size_t c)
+{
+	physaddr_t total = 0, off;
+	for (int r = 0; r < 2; r++) {
+		total += CASES[c].ranges[r].end - CASES[c].ranges[r].start;
+	}
+	off = rng() % total;
+	for (int r = 0; r < 2; r++) {
+		const physaddr_t len = CASES[c].ranges[r].end - CASES[c].ranges[r].start;
+		if (off < len) {
+			return CASES[c].ranges[r].start + off;
+		}
+		off -= len;
+	}
+	return 0;
+}
+
+static void bench_resolve(size_t c)
+{
+	static struct ResolveBench b;
+	for (size_t v = 0; v < sizeof(MSYS_VARIANTS) / sizeof(*MSYS_VARIANTS); v++) {
+		struct MemorySystem m;
+		if (ramses_msys_load_flags(CASES[c].msys, &m, NULL, MSYS_VARIANTS[v].flags)) {
+			fprintf(stderr, "Cannot load %s\n", CASES[c].msys);
+			return;
+		}
+		/* Skip compiled variants that fell back to plain resolution */
+		if ((MSYS_VARIANTS[v].flags & MSYS_FUSE && m.fused == NULL) ||
+		    (MSYS_VARIANTS[v].flags & MSYS_JIT && m.jit == NULL))
+		{
+			ramses_msys_free(&m);
+			continue;
+		}
+		b.m = &m;
+		for (size_t i = 0; i < NADDRS; i++) {
+			b.pa[i] = case_addr(c);
+			b.da[i] = ramses_resolve(&m, b.pa[i]);
+		}
+		report("resolve", CASES[c].msys, MSYS_VARIANTS[v].name,
+		       measure(run_resolve, &b));
+		report("resolve_reverse", CASES[c].msys, MSYS_VARIANTS[v].name,
+		       measure(run_resolve_reverse, &b));
+		ramses_msys_free(&m);
+	}
+}
+
+/* BufferMap queries, on buffers made up of scattered physical pages */
+
+struct FakeMem {
+	physaddr_t *pages; /* Physical page of each virtual page from BM_VABASE */
+	size_t npages;
+};
+
+static physaddr_t fake_trans(uintptr_t addr, int page_shift, union TranslateArg arg)
+{
+	const struct FakeMem *f = (const struct FakeMem *)arg.p;
+	const size_t i = (addr - BM_VABASE) >> page_shift;
+	if (addr < BM_VABASE || i >= f->npages) {
+		errno = ENODATA;
+		return RAMSES_BADADDR;
+	}
+	return f->pages[i] + (addr & ((1ULL << page_shift) - 1));
+}
+
+static size_t fake_range(uintptr_t addr, size_t npages, physaddr_t *out,
+                         int page_shift, union TranslateArg arg)
+{
+	for (size_t i = 0; i < npages; i++) {
+		out[i] = fake_trans(addr + (i << page_shift), page_shift, arg);
+		if (out[i] == RAMSES_BADADDR) {
+			return i;
+		}
+	}
+	return npages;
+}
+
+/*
+ * Give `f' BM_PAGES distinct pages, drawn from a region twice that size in
+ * the first range of case `c', in random order.
+ */
+static int fake_setup(struct FakeMem *f, size_t c)
+{
+	const size_t pool = 2 * BM_PAGES;
+	const physaddr_t span = CASES[c].ranges[0].end - CASES[c].ranges[0].start;
+	physaddr_t base;
+	size_t *perm = malloc(pool * sizeof(*perm));
+
+	f->pages = malloc(BM_PAGES * sizeof(*f->pages));
+	f->npages = BM_PAGES;
+	if (perm == NULL || f->pages == NULL || span < ((physaddr_t)pool << BM_PAGESHIFT)) {
+		free(perm);
+		free(f->pages);
+		return 1;
+	}
+	base = CASES[c].ranges[0].start +
+	       ((rng() % ((span >> BM_PAGESHIFT) - pool + 1)) << BM_PAGESHIFT);
+	for (size_t i = 0; i < pool; i++) {
+		perm[i] = i;
+	}
+	for (size_t i = pool - 1; i > 0; i--) {
+		size_t j = rng() % (i + 1);
+		size_t t = perm[i];
+		perm[i] = perm[j];
+		perm[j] = t;
+	}
+	for (size_t i = 0; i < BM_PAGES; i++) {
+		f->pages[i] = base + ((physaddr_t)perm[i] << BM_PAGESHIFT);
+	}
+	free(perm);
+	return 0;
+}
+
+struct QueryBench {
+	struct BufferMap *bm;
+	struct BMPos pos[NADDRS];
+	struct DRAMAddr da[NADDRS];
+	struct AddrEntry ents[ENTRIES_BATCH];
+};
+
+static size_t run_find(void *arg)
+{
+	struct QueryBench *b = (struct QueryBench *)arg;
+	struct BMPos p;
+	uint64_t acc = 0;
+	for (size_t i = 0; i < NADDRS; i++) {
+		acc += ramses_bufmap_find(b->bm, b->da[i], &p) + p.ei;
+	}
+	sink = acc;
+	return NADDRS;
+}
+
+static size_t run_find_same(void *arg)
+{
+	struct QueryBench *b = (struct QueryBench *)arg;
+	struct BMPos p;
+	uint64_t acc = 0;
+	for (size_t i = 0; i < NADDRS; i++) {
+		acc += ramses_bufmap_find_same(b->bm, b->da[i], DRAM_ROW, &p) + p.ei;
+	}
+	sink = acc;
+	return NADDRS;
+}
+
+static size_t run_next(void *arg)
+{
+	struct QueryBench *b = (struct QueryBench *)arg;
+	uint64_t acc = 0;
+	for (size_t i = 0; i < NADDRS; i++) {
+		acc += ramses_bufmap_next(b->bm, b->pos[i], DRAM_ROW).ri;
+	}
+	sink = acc;
+	return NADDRS;
+}
+
+static size_t run_get_entries(void *arg)
+{
+	struct QueryBench *b = (struct QueryBench *)arg;
+	const struct BMPos end = { .ri = b->bm->range_cnt, .ei = 0 };
+	size_t n = 0;
+	for (size_t i = 0; i < NADDRS; i += 16) {
+		n += ramses_bufmap_get_entries(b->bm, b->pos[i], end, b->ents,
+		                               ENTRIES_BATCH);
+	}
+	sink = n;
+	return n;
+}
+
+static void bench_bufmap(size_t c)
+{
+	static struct QueryBench b;
+	struct FakeMem f;
+	struct MemorySystem m;
+	struct Translation t = {
+		.translate = fake_trans,
+		.translate_range = fake_range,
+		.page_shift = BM_PAGESHIFT,
+		.arg.p = &f
+	};
+
+	if (fake_setup(&f, c)) {
+		return;
+	}
+	if (ramses_msys_load(CASES[c].msys, &m, NULL)) {
+		free(f.pages);
+		return;
+	}
+	for (size_t v = 0; v < sizeof(BUFMAP_VARIANTS) / sizeof(*BUFMAP_VARIANTS); v++) {
+		struct BufferMap bm;
+		const uint64_t t0 = now_ns();
+		if (ramses_bufmap(&bm, (void *)(uintptr_t)BM_VABASE,
+		                  (size_t)BM_PAGES << BM_PAGESHIFT, &t, &m,
+		                  BUFMAP_VARIANTS[v].flags))
+		{
+			fprintf(stderr, "Cannot map buffer for %s\n", CASES[c].msys);
+			break;
+		}
+		report("bufmap", CASES[c].msys, BUFMAP_VARIANTS[v].name,
+		       (double)(now_ns() - t0) / BM_PAGES);
+		b.bm = &bm;
+		for (size_t i = 0; i < NADDRS; i++) {
+			const size_t ri = rng() % bm.range_cnt;
+			b.pos[i] = (struct BMPos){
+				.ri = ri,
+				.ei = rng() % bm.ranges[ri].entry_cnt
+			};
+			b.da[i] = ramses_bufmap_addr(&bm, b.pos[i].ri, b.pos[i].ei);
+		}
+		report("bufmap_find", CASES[c].msys, BUFMAP_VARIANTS[v].name,
+		       measure(run_find, &b));
+		report("bufmap_find_same", CASES[c].msys, BUFMAP_VARIANTS[v].name,
+		       measure(run_find_same, &b));
+		report("bufmap_next", CASES[c].msys, BUFMAP_VARIANTS[v].name,
+		       measure(run_next, &b));
+		report("bufmap_get_entries", CASES[c].msys, BUFMAP_VARIANTS[v].name,
+		       measure(run_get_entries, &b));
+		ramses_bufmap_free(&bm);
+	}
+	ramses_msys_free(&m);
+	free(f.pages);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *filter = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:f:")) != -1) {
+		switch (opt) {
+		case 't':
+			min_ns = strtoull(optarg, NULL, 0) * 1000000;
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t MIN_MS] [-f FILTER]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	printf("{\n  \"version\": %d,\n  \"min_ns\": %llu,\n  \"results\": [",
+	       BENCH_VERSION, (unsigned long long)min_ns);
+	for (size_t c = 0; c < NCASES; c++) {
+		if (filter == NULL || strstr(CASES[c].msys, filter) != NULL) {
+			bench_resolve(c);
+		}
+	}
+	for (size_t c = 0; c < NCASES; c++) {
+		if (filter == NULL || strstr(CASES[c].msys, filter) != NULL) {
+			bench_bufmap(c);
+		}
+	}
+	printf("\n  ]\n}\n");
+	return 0;
+}
@@ -15,15 +15,26 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  *
  */
+#define _XOPEN_SOURCE 700
 
 #include <ramses/bufmap.h>
 
 #include <ramses/binsearch.h>
 
+#include "msys_int.h"
+#include "sort.h"
+#include "par.h"
+#include "eytz.h"
+#include "fuse.h"
+
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define align_down(a,n) (((a) / (n)) * (n))
 
@@ -35,200 +46,1891 @@ static int pte_pa_cmp(const void *a, const void *b)
 	return (aa == ba) ? 0 : (aa < ba) ? -1 : 1;
 }
 
-static int bmsetup_ptes(struct PTE *ptes, size_t ptelen,
-                        struct Translation *trans,
-                        uintptr_t buf, void *tmpbuf)
+/* Bytes mapped by PTE extent `e' */
+static inline size_t pte_len(const struct PTE *e, size_t pagesz)
+{
+	return e->npages * pagesz;
+}
+
+/* Append extent `e' to the `*n' extents in `out', merging it if contiguous */
+static inline void pte_push(struct PTE *out, size_t *n, struct PTE e,
+                            size_t pagesz)
+{
+	if (*n) {
+		struct PTE *last = &out[*n - 1];
+		if (last->pa + pte_len(last, pagesz) == e.pa &&
+		    last->va + pte_len(last, pagesz) == e.va)
+		{
+			last->npages += e.npages;
+			return;
+		}
+	}
+	out[(*n)++] = e;
+}
+
+/* Prepend extent `e' to those from out[*w] up to out[end], merging it if contiguous */
+static inline void pte_push_front(struct PTE *out, size_t *w, size_t end,
+                                  struct PTE e, size_t pagesz)
+{
+	if (*w < end && e.pa + pte_len(&e, pagesz) == out[*w].pa &&
+	    e.va + pte_len(&e, pagesz) == out[*w].va)
+	{
+		out[*w].pa = e.pa;
+		out[*w].va = e.va;
+		out[*w].npages += e.npages;
+		return;
+	}
+	out[--(*w)] = e;
+}
+
+static int pte_va_cmp(const void *a, const void *b)
+{
+	uintptr_t aa = ((struct PTE *)a)->va;
+	uintptr_t ba = ((struct PTE *)b)->va;
+	return (aa == ba) ? 0 : (aa < ba) ? -1 : 1;
+}
+
+/* Number of the `n' extents at `a', sorted by `cmp', that sort at or before `e' */
+static size_t pte_upper(const struct PTE *a, size_t n, const struct PTE *e,
+                        int (*cmp)(const void *, const void *))
+{
+	size_t lo = 0;
+	while (n) {
+		size_t half = n / 2;
+		if (cmp(&a[lo + half], e) <= 0) {
+			lo += half + 1;
+			n -= half + 1;
+		} else {
+			n = half;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Merge the `nb' extents `b' into the `na' ones at `a', which has room for
+ * both, in place from the back. Both are sorted by `cmp' and disjoint.
+ * Returns the number of extents left at `a'.
+ */
+static size_t pte_merge(struct PTE *a, size_t na, const struct PTE *b,
+                        size_t nb, size_t pagesz,
+                        int (*cmp)(const void *, const void *))
+{
+	const size_t end = na + nb;
+	size_t i = na, w = end, n;
+	for (size_t j = nb; j--;) {
+		/* Extents from a[lo] up to a[i] go after b[j] as they are */
+		const size_t lo = pte_upper(a, i, &b[j], cmp);
+		if (lo < i) {
+			pte_push_front(a, &w, end, a[--i], pagesz);
+			w -= i - lo;
+			memmove(&a[w], &a[lo], (i - lo) * sizeof(*a));
+			i = lo;
+		}
+		pte_push_front(a, &w, end, b[j], pagesz);
+	}
+	/* a[0] up to a[i] is untouched; close the gap, joining across it */
+	n = i;
+	if (w < end) {
+		pte_push(a, &n, a[w], pagesz);
+		memmove(&a[n], &a[w + 1], (end - w - 1) * sizeof(*a));
+		n += end - w - 1;
+	}
+	return n;
+}
+
+/*
+ * Cut the `nc' extents `cut', sorted by PA and each within a different one
+ * of the `n' extents at `a', out of those in place. `a' needs room for
+ * n + nc extents. Returns the number of extents left.
+ */
+static size_t pte_cut(struct PTE *a, size_t n, const struct PTE *cut, size_t nc,
+                      size_t pagesz)
+{
+	size_t i = n, w = n + nc;
+	for (size_t j = nc; j--;) {
+		const struct PTE *c = &cut[j];
+		/* Extents after the one holding the cut stay whole */
+		const size_t k = pte_upper(a, i, c, pte_pa_cmp) - 1;
+		const struct PTE e = a[k];
+		const size_t off = c->pa - e.pa;
+		w -= i - k - 1;
+		memmove(&a[w], &a[k + 1], (i - k - 1) * sizeof(*a));
+		i = k;
+		if (off + pte_len(c, pagesz) < pte_len(&e, pagesz)) {
+			a[--w] = (struct PTE){
+				.pa = c->pa + pte_len(c, pagesz),
+				.va = c->va + pte_len(c, pagesz),
+				.npages = e.npages - off / pagesz - c->npages
+			};
+		}
+		if (off) {
+			a[--w] = (struct PTE){ .pa = e.pa, .va = e.va, .npages = off / pagesz };
+		}
+	}
+	memmove(&a[i], &a[w], (n + nc - w) * sizeof(*a));
+	return i + n + nc - w;
+}
+
+/* State shared by the threads setting up a BufferMap */
+struct BMSetup {
+	struct PTE *ptes;
+	size_t ptelen;
+	size_t pagesz;
+	size_t elen;
+	uintptr_t buf;
+	struct Translation *trans;
+	struct MemorySystem *msys;
+	physaddr_t *tb; /* Translated addresses, for fast translation */
+	struct DRAMRange *tmp;
+	struct DRAMRange *scratch;
+	size_t *bounds; /* Per-thread PTE chunks, split on physical runs */
+	size_t *cnt; /* Per-thread results */
+	size_t *off; /* Per-thread offsets into `tmp' */
+};
+
+static void bmsetup_translate(void *arg, int t, int nthreads)
+{
+	struct BMSetup *s = (struct BMSetup *)arg;
+	const size_t lo = par_chunk(s->ptelen, t, nthreads);
+	const size_t hi = par_chunk(s->ptelen, t + 1, nthreads);
+
+	s->cnt[t] = 0;
+	s->off[t] = 0;
+	if (s->tb != NULL && hi > lo) {
+		if (ramses_translate_range(s->trans, s->buf + lo * s->pagesz,
+		                           hi - lo, &s->tb[lo]) != hi - lo)
+		{
+			s->off[t] = 1;
+			return;
+		}
+	}
+	/* Compress the chunk into extents in place, at its start */
+	for (size_t i = lo; i < hi; i++) {
+		uintptr_t va = s->buf + i * s->pagesz;
+		struct PTE e = {
+			.pa = (s->tb != NULL) ? s->tb[i] : ramses_translate(s->trans, va),
+			.va = va,
+			.npages = 1
+		};
+		size_t n = s->cnt[t];
+		pte_push(&s->ptes[lo], &n, e, s->pagesz);
+		s->cnt[t] = n;
+	}
+}
+
+/* Sort PTEs by physical address, with `scratch' possibly NULL */
+static void sort_ptes(struct PTE *ptes, size_t n, void *scratch, int nthreads)
+{
+	void *tmp = scratch;
+	if (n < RADIX_MIN ||
+	    (tmp == NULL && (tmp = malloc(n * sizeof(*ptes))) == NULL))
+	{
+		qsort(ptes, n, sizeof(*ptes), pte_pa_cmp);
+	} else {
+		radix_sort64_par(ptes, tmp, n, sizeof(*ptes), nthreads);
+	}
+	if (tmp != scratch) {
+		free(tmp);
+	}
+}
+
+/* Translate the pages of the buffer into PTE extents sorted by PA */
+static int bmsetup_ptes(struct BMSetup *s, void *tmpbuf, int nthreads)
+{
+	size_t n = 0;
+	assert(s->buf % s->pagesz == 0);
+	s->tb = (physaddr_t *)tmpbuf;
+	par_run(nthreads, bmsetup_translate, s);
+	for (int t = 0; t < nthreads; t++) {
+		const size_t lo = par_chunk(s->ptelen, t, nthreads);
+		if (s->off[t]) {
+			return 1;
+		}
+		/* Stitch the chunks together, merging across their boundaries */
+		for (size_t i = lo; i < lo + s->cnt[t]; i++) {
+			pte_push(s->ptes, &n, s->ptes[i], s->pagesz);
+		}
+	}
+	s->ptelen = n;
+	/* Translated addresses are used up; sort in their place */
+	sort_ptes(s->ptes, s->ptelen, tmpbuf, nthreads);
+	return 0;
+}
+
+/*
+ * Number of physically contiguous extents starting at ptes[i], setting
+ * `*len' to the bytes they span
+ */
+static size_t pte_run(struct PTE *ptes, size_t ptelen, size_t i, size_t pagesz,
+                      size_t *len)
+{
+	size_t run = 1;
+	physaddr_t end = ptes[i].pa + pte_len(&ptes[i], pagesz);
+	while (i + run < ptelen && ptes[i + run].pa == end) {
+		end += pte_len(&ptes[i + run], pagesz);
+		run++;
+	}
+	*len = end - ptes[i].pa;
+	return run;
+}
+
+/*
+ * Resolve each run of physically contiguous pages in chunk `t' at once.
+ * Only counts the ranges needed if there is no output buffer yet.
+ */
+static void bmsetup_resolve(void *arg, int t, int nthreads)
+{
+	struct BMSetup *s = (struct BMSetup *)arg;
+	const size_t hi = s->bounds[t + 1];
+	size_t n = 0;
+
+	for (size_t i = s->bounds[t], run, len; i < hi; i += run) {
+		run = pte_run(s->ptes, s->ptelen, i, s->pagesz, &len);
+		if (s->tmp == NULL) {
+			n += ramses_resolve_range(s->msys, s->ptes[i].pa, len, s->elen,
+			                          NULL);
+		} else {
+			n += msys_resolve_range(s->msys, s->ptes[i].pa, len,
+			                        s->elen, &s->tmp[s->off[t] + n],
+			                        s->scratch ? &s->scratch[s->off[t]] : NULL);
+		}
+	}
+	s->cnt[t] = n;
+}
+
+static size_t bmsetup_ranges(struct BMSetup *s, struct DRAMRange **dram_ranges,
+                             void *tmpbuf, size_t tmplen, int nthreads)
+{
+	size_t cnt = 0;
+	size_t rangelen = 0;
+
+	/* Chunk boundaries must not split runs */
+	s->bounds[0] = 0;
+	for (int t = 1; t <= nthreads; t++) {
+		size_t b = par_chunk(s->ptelen, t, nthreads);
+		if (b < s->bounds[t - 1]) {
+			b = s->bounds[t - 1];
+		}
+		while (b > 0 && b < s->ptelen &&
+		       s->ptes[b].pa == s->ptes[b - 1].pa +
+		                        pte_len(&s->ptes[b - 1], s->pagesz))
+		{
+			b++;
+		}
+		s->bounds[t] = b;
+	}
+
+	s->tmp = NULL;
+	par_run(nthreads, bmsetup_resolve, s);
+	for (int t = 0; t < nthreads; t++) {
+		s->off[t] = cnt;
+		cnt += s->cnt[t];
+	}
+	/* Ranges and their sorting scratch space both fit in the buffer */
+	if (tmpbuf != NULL && 2 * cnt * sizeof(*s->tmp) < tmplen) {
+		s->tmp = (struct DRAMRange *)tmpbuf;
+		s->scratch = s->tmp + cnt;
+	} else {
+		s->tmp = malloc(cnt * sizeof(*s->tmp));
+		s->scratch = NULL;
+	}
+
+	if (s->tmp != NULL) {
+		par_run(nthreads, bmsetup_resolve, s);
+		for (int t = 0; t < nthreads; t++) {
+			assert(s->cnt[t] <= ((t + 1 < nthreads) ? s->off[t + 1] : cnt) - s->off[t]);
+			memmove(&s->tmp[rangelen], &s->tmp[s->off[t]],
+			        s->cnt[t] * sizeof(*s->tmp));
+			rangelen += s->cnt[t];
+		}
+		rangelen = msys_dramrange_coalesce(s->msys, s->tmp, rangelen, s->elen,
+		                                   s->scratch, nthreads);
+
+		struct DRAMRange *ranges = malloc(rangelen * sizeof(*ranges));
+		if (ranges != NULL) {
+			memcpy(ranges, s->tmp, rangelen * sizeof(*ranges));
+			*dram_ranges = ranges;
+		} else {
+			rangelen = 0;
+		}
+
+		if ((void *)s->tmp != tmpbuf) {
+			free(s->tmp);
+		}
+		return rangelen;
+	} else {
+		return 0;
+	}
+}
+
+static inline size_t ceildiv(size_t a, size_t b)
+{
+	return (a / b) + !!(a % b);
+}
+
+/* DRAM address of entry `ei' of range `r' */
+static inline struct DRAMAddr
+range_addr(struct BufferMap *bm, const struct DRAMRange *r, size_t ei)
+{
+	const size_t cell_off = (ei * bm->entry_len) / bm->msys->mapping.props.cell_size;
+	struct DRAMAddr da = r->start;
+	da.row += (da.col + cell_off) / bm->msys->mapping.props.col_cnt;
+	da.col = (da.col + cell_off) % bm->msys->mapping.props.col_cnt;
+	return da;
+}
+
+#define BANKDIR_LUT_MAX (1 << 16)
+
+static const unsigned int bankdir_shift[4] = { 24, 16, 8, 0 };
+
+/* Bank key of `a': its chan, dimm, rank and bank, most significant first */
+static inline uint32_t bank_key(struct DRAMAddr a)
+{
+	return ramses_dramaddr_key(a) >> 32;
+}
+
+/*
+ * Mixed-radix index of bank key `k' in a lookup table of extents `dim'.
+ * Keys with a field beyond its extent map to the index of the next key
+ * that is in range.
+ */
+static size_t bankdir_slot(const unsigned int *dim, uint32_t k)
+{
+	size_t s = 0;
+	for (int f = 0; f < 4; f++) {
+		unsigned int v = (k >> bankdir_shift[f]) & 0xff;
+		if (v >= dim[f]) {
+			for (s++; f < 4; f++) {
+				s *= dim[f];
+			}
+			break;
+		}
+		s = s * dim[f] + v;
+	}
+	return s;
+}
+
+/* Widen lookup table extents `dim' to take in bank key `k' */
+static inline void bankdir_dim(unsigned int *dim, uint32_t k)
+{
+	for (int f = 0; f < 4; f++) {
+		unsigned int v = ((k >> bankdir_shift[f]) & 0xff) + 1;
+		dim[f] = (v > dim[f]) ? v : dim[f];
+	}
+}
+
+/* Slots in a lookup table of extents `dim' */
+static inline size_t bankdir_slots(const unsigned int *dim)
+{
+	return (size_t)dim[0] * dim[1] * dim[2] * dim[3];
+}
+
+/* Index of the first bank in `d' with key at or above `k' */
+static size_t bankdir_lower(const struct BankDir *d, uint32_t k)
+{
+	size_t lo = 0;
+	if (d->lut != NULL) {
+		return d->lut[bankdir_slot(d->dim, k)];
+	}
+	for (size_t n = d->bank_cnt; n;) {
+		size_t half = n / 2;
+		if (d->banks[lo + half].key < k) {
+			lo += half + 1;
+			n -= half + 1;
+		} else {
+			n = half;
+		}
+	}
+	return lo;
+}
+
+/* Fill the lookup table of `d', if it has one, from its banks */
+static void bankdir_lut(struct BankDir *d)
+{
+	if (d->lut == NULL) {
+		return;
+	}
+	for (size_t s = 0, b = 0; s <= bankdir_slots(d->dim); s++) {
+		while (b < d->bank_cnt && bankdir_slot(d->dim, d->banks[b].key) < s) {
+			b++;
+		}
+		d->lut[s] = b;
+	}
+}
+
+/* Bank of `bm' holding ranges `first' through `last' */
+static struct BankSpan bank_span(struct BufferMap *bm, size_t first, size_t last)
+{
+	const struct DRAMRange *r = &bm->ranges[last];
+	return (struct BankSpan){
+		.key = bank_key(bm->ranges[first].start),
+		.row_min = bm->ranges[first].start.row,
+		.row_max = range_addr(bm, r, r->entry_cnt - 1).row,
+		.first = first,
+		.last = last
+	};
+}
+
+/* First range of `bm' from `lo' on that lies in a bank past `key' */
+static size_t bank_end(struct BufferMap *bm, size_t lo, uint32_t key)
+{
+	for (size_t n = bm->range_cnt - lo; n;) {
+		size_t half = n / 2;
+		if (bank_key(bm->ranges[lo + half].start) <= key) {
+			lo += half + 1;
+			n -= half + 1;
+		} else {
+			n = half;
+		}
+	}
+	return lo;
+}
+
+/* Build bank directory `d' over the ranges of `bm' */
+static int bankdir_build(struct BankDir *d, struct BufferMap *bm)
+{
+	const struct DRAMRange *r = bm->ranges;
+	struct BankSpan *banks;
+	size_t cnt = 0;
+
+	for (size_t i = 0; i < bm->range_cnt; i++) {
+		cnt += (!i || bank_key(r[i].start) != bank_key(r[i - 1].start));
+	}
+	errno = 0;
+	banks = malloc(cnt * sizeof(*banks));
+	if (banks == NULL && cnt) {
+		return 1;
+	}
+	*d = (struct BankDir){ .banks = banks, .lut = NULL };
+	for (size_t i = 0, end; i < bm->range_cnt; i = end) {
+		end = bank_end(bm, i, bank_key(r[i].start));
+		banks[d->bank_cnt] = bank_span(bm, i, end - 1);
+		bankdir_dim(d->dim, banks[d->bank_cnt++].key);
+	}
+
+	if (bankdir_slots(d->dim) <= BANKDIR_LUT_MAX) {
+		d->lut = malloc((bankdir_slots(d->dim) + 1) * sizeof(*d->lut));
+		if (d->lut == NULL) {
+			free(banks);
+			return 1;
+		}
+		bankdir_lut(d);
+	}
+	return 0;
+}
+
+static void bankdir_free(struct BankDir *d)
+{
+	free(d->banks);
+	free(d->lut);
+}
+
+static void rindex_free(struct RangeIndex *ri)
+{
+	free(ri->keys);
+	free(ri->ranks);
+	*ri = (struct RangeIndex){ .keys = NULL, .ranks = NULL };
+}
+
+/* Allocate search index `ri' for `n' ranges in `banks' banks */
+static int rindex_alloc(struct RangeIndex *ri, size_t n, size_t banks)
+{
+	errno = 0;
+	ri->keys = malloc((n + banks) * sizeof(*ri->keys));
+	ri->ranks = malloc((n + banks) * sizeof(*ri->ranks));
+	if (ri->keys == NULL || ri->ranks == NULL) {
+		rindex_free(ri);
+		return 1;
+	}
+	return 0;
+}
+
+/* Lay out the range start keys of bank `b' of `bm', spanning `s', in `ri' */
+static void rindex_bank(struct RangeIndex *ri, struct BufferMap *bm,
+                        const struct BankSpan *s, size_t b)
+{
+	const size_t base = s->first + b;
+	const size_t n = s->last - s->first + 1;
+	eytz_ranks(n, &ri->ranks[base]);
+	ri->keys[base] = 0;
+	ri->ranks[base] = 0;
+	for (size_t i = 1; i <= n; i++) {
+		const size_t r = s->first + ri->ranks[base + i];
+		ri->keys[base + i] = ramses_dramaddr_key(bm->ranges[r].start);
+	}
+}
+
+/* Build search index `ri' over the ranges of `bm', using its bank directory */
+static int rindex_build(struct RangeIndex *ri, struct BufferMap *bm)
+{
+	const struct BankDir *d = &bm->bankdir;
+	if (rindex_alloc(ri, bm->range_cnt, d->bank_cnt)) {
+		return 1;
+	}
+	for (size_t b = 0; b < d->bank_cnt; b++) {
+		rindex_bank(ri, bm, &d->banks[b], b);
+	}
+	return 0;
+}
+
+/* VA index entries per PTE above which the index switches to binary search */
+#define VAINDEX_MAX_SPREAD 2
+
+struct VARecord {
+	uint64_t va; /* Sort key */
+	size_t pte;
+};
+
+/* Whether a VA index over `n' extents spanning `span' pages is dense */
+static inline bool vaindex_dense(size_t span, size_t n)
+{
+	return span <= VAINDEX_MAX_SPREAD * n;
+}
+
+/* Build VA index `v' over the `n' PTEs `ptes' of pages of size `pagesz' */
+static int vaindex_build(struct VAIndex *v, const struct PTE *ptes, size_t n,
+                         size_t pagesz)
+{
+	uintptr_t lo = UINTPTR_MAX;
+	uintptr_t hi = 0;
+	size_t span;
+
+	for (size_t i = 0; i < n; i++) {
+		uintptr_t end = ptes[i].va + pte_len(&ptes[i], pagesz);
+		lo = (ptes[i].va < lo) ? ptes[i].va : lo;
+		hi = (end > hi) ? end : hi;
+	}
+	span = n ? (hi - lo) / pagesz : 0;
+	*v = (struct VAIndex){
+		.base = lo,
+		.pa = NULL,
+		.ext = NULL,
+		.dense = vaindex_dense(span, n)
+	};
+
+	errno = 0;
+	if (v->dense) {
+		v->pa = malloc(span * sizeof(*v->pa));
+		if (v->pa == NULL && span) {
+			return 1;
+		}
+		for (size_t i = 0; i < span; i++) {
+			v->pa[i] = RAMSES_BADADDR;
+		}
+		for (size_t i = 0; i < n; i++) {
+			for (size_t p = 0; p < ptes[i].npages; p++) {
+				v->pa[(ptes[i].va - lo) / pagesz + p] = ptes[i].pa + p * pagesz;
+			}
+		}
+		v->len = span;
+	} else {
+		struct VARecord *recs = malloc(2 * n * sizeof(*recs));
+		v->ext = malloc(n * sizeof(*v->ext));
+		if (recs == NULL || v->ext == NULL) {
+			free(recs);
+			free(v->ext);
+			v->ext = NULL;
+			return 1;
+		}
+		for (size_t i = 0; i < n; i++) {
+			recs[i] = (struct VARecord){ .va = ptes[i].va, .pte = i };
+		}
+		radix_sort64(recs, recs + n, n, sizeof(*recs));
+		for (size_t i = 0; i < n; i++) {
+			v->ext[i] = ptes[recs[i].pte];
+		}
+		v->len = n;
+		free(recs);
+	}
+	return 0;
+}
+
+static void vaindex_free(struct VAIndex *v)
+{
+	free(v->pa);
+	free(v->ext);
+}
+
+/* Number of extents in sparse VA index `v' starting at or below `va' */
+static size_t vaindex_upper(const struct VAIndex *v, uintptr_t va)
+{
+	size_t lo = 0;
+	for (size_t n = v->len; n;) {
+		size_t half = n / 2;
+		if (v->ext[lo + half].va <= va) {
+			lo += half + 1;
+			n -= half + 1;
+		} else {
+			n = half;
+		}
+	}
+	return lo;
+}
+
+/* Physical address of `va' in `bm', or RAMSES_BADADDR if it is not mapped */
+static physaddr_t vaindex_pa(struct BufferMap *bm, uintptr_t va)
+{
+	const struct VAIndex *v = &bm->vaindex;
+	const uintptr_t page = align_down(va, bm->page_size);
+	const struct PTE *e;
+	size_t i;
+
+	if (page < v->base) {
+		return RAMSES_BADADDR;
+	} else if (v->dense) {
+		i = (page - v->base) / bm->page_size;
+		if (i >= v->len || v->pa[i] == RAMSES_BADADDR) {
+			return RAMSES_BADADDR;
+		}
+		return v->pa[i] + (va - page);
+	}
+	i = vaindex_upper(v, page);
+	if (!i) {
+		return RAMSES_BADADDR;
+	}
+	e = &v->ext[i - 1];
+	return (va - e->va < pte_len(e, bm->page_size)) ? e->pa + (va - e->va) :
+	                                                  RAMSES_BADADDR;
+}
+
+/*
+ * First mapped page of `bm' from page `va' up to `end', with its PA in
+ * `*pa', or `end' if there is none
+ */
+static uintptr_t vaindex_next(struct BufferMap *bm, uintptr_t va, uintptr_t end,
+                              physaddr_t *pa)
+{
+	const struct VAIndex *v = &bm->vaindex;
+	size_t i;
+
+	va = (va < v->base) ? v->base : va;
+	if (v->dense) {
+		for (i = (va - v->base) / bm->page_size; i < v->len && va < end;
+		     i++, va += bm->page_size)
+		{
+			if (v->pa[i] != RAMSES_BADADDR) {
+				*pa = v->pa[i];
+				return va;
+			}
+		}
+		return end;
+	}
+	i = vaindex_upper(v, va);
+	if (i && va - v->ext[i - 1].va < pte_len(&v->ext[i - 1], bm->page_size)) {
+		*pa = v->ext[i - 1].pa + (va - v->ext[i - 1].va);
+		return va;
+	} else if (i < v->len && v->ext[i].va < end) {
+		*pa = v->ext[i].pa;
+		return v->ext[i].va;
+	}
+	return end;
+}
+
+/* Widen dense VA index `v', which has room for it, to `len' pages from `base' */
+static void vaindex_widen(struct VAIndex *v, uintptr_t base, size_t len,
+                          size_t pagesz)
+{
+	const size_t shift = (v->base - base) / pagesz;
+	memmove(&v->pa[shift], v->pa, v->len * sizeof(*v->pa));
+	for (size_t i = 0; i < shift; i++) {
+		v->pa[i] = RAMSES_BADADDR;
+	}
+	for (size_t i = shift + v->len; i < len; i++) {
+		v->pa[i] = RAMSES_BADADDR;
+	}
+	v->base = base;
+	v->len = len;
+}
+
+/*
+ * Cut the pages from `lo' up to `hi' out of sparse VA index `v', which needs
+ * room for one more extent
+ */
+static void vaindex_cut(struct VAIndex *v, uintptr_t lo, uintptr_t hi,
+                        size_t pagesz)
+{
+	size_t i = vaindex_upper(v, lo);
+	const size_t j = vaindex_upper(v, hi - 1);
+	struct PTE keep[2];
+	size_t n = 0;
+
+	/* Extents i up to j overlap the cut */
+	i -= (i && lo - v->ext[i - 1].va < pte_len(&v->ext[i - 1], pagesz));
+	if (i >= j) {
+		return;
+	}
+	if (v->ext[i].va < lo) {
+		keep[n++] = (struct PTE){
+			.pa = v->ext[i].pa, .va = v->ext[i].va,
+			.npages = (lo - v->ext[i].va) / pagesz
+		};
+	}
+	if (v->ext[j - 1].va + pte_len(&v->ext[j - 1], pagesz) > hi) {
+		const struct PTE *e = &v->ext[j - 1];
+		keep[n++] = (struct PTE){
+			.pa = e->pa + (hi - e->va), .va = hi,
+			.npages = e->npages - (hi - e->va) / pagesz
+		};
+	}
+	memmove(&v->ext[i + n], &v->ext[j], (v->len - j) * sizeof(*v->ext));
+	memcpy(&v->ext[i], keep, n * sizeof(*keep));
+	v->len = v->len - (j - i) + n;
+}
+
+/* Byte offset of `a' from the start of its bank */
+static inline uint64_t bank_offset(struct BufferMap *bm, struct DRAMAddr a)
+{
+	return ((uint64_t)a.row * bm->msys->mapping.props.col_cnt + a.col) *
+	       bm->msys->mapping.props.cell_size;
+}
+
+/* Words of the row bitset of bank `s' */
+static inline size_t bank_words(const struct BankSpan *s)
+{
+	return (s->row_max - s->row_min) / 64 + 1;
+}
+
+static void rowidx_free(struct RowIndex *x)
+{
+	free(x->bits);
+	free(x->rank);
+	free(x->bank_word);
+	free(x->bank_row);
+	free(x->rowpos);
+	*x = (struct RowIndex){ .bits = NULL };
+}
+
+/* Allocate row index `x' for `banks' banks of `words' words and `rows' rows */
+static int rowidx_alloc(struct RowIndex *x, size_t banks, size_t words,
+                        size_t rows)
+{
+	errno = 0;
+	*x = (struct RowIndex){
+		.bits = malloc(words * sizeof(*x->bits)),
+		.rank = malloc(words * sizeof(*x->rank)),
+		.bank_word = malloc((banks + 1) * sizeof(*x->bank_word)),
+		.bank_row = malloc((banks + 1) * sizeof(*x->bank_row)),
+		.rowpos = malloc(rows * sizeof(*x->rowpos))
+	};
+	if (x->bits == NULL || x->rank == NULL || x->bank_word == NULL ||
+	    x->bank_row == NULL || (x->rowpos == NULL && rows))
+	{
+		rowidx_free(x);
+		return 1;
+	}
+	x->bank_word[0] = 0;
+	x->bank_row[0] = 0;
+	return 0;
+}
+
+/*
+ * Fill the row bitset and ranks of bank `b' of `bm', spanning `s', in `x'.
+ * Returns the number of rows present in the bank.
+ */
+static size_t rowidx_bits(struct RowIndex *x, struct BufferMap *bm,
+                          const struct BankSpan *s, size_t b)
+{
+	const size_t w0 = x->bank_word[b];
+	uint64_t *bits = &x->bits[w0];
+	size_t rows = 0;
+
+	memset(bits, 0, (x->bank_word[b + 1] - w0) * sizeof(*bits));
+	for (size_t ri = s->first; ri <= s->last; ri++) {
+		const struct DRAMRange *r = &bm->ranges[ri];
+		const unsigned int hi = range_addr(bm, r, r->entry_cnt - 1).row;
+		for (unsigned int row = r->start.row; row <= hi; row++) {
+			const unsigned int bit = row - s->row_min;
+			bits[bit / 64] |= 1ULL << (bit % 64);
+		}
+	}
+	for (size_t w = w0; w < x->bank_word[b + 1]; w++) {
+		x->rank[w] = rows;
+		rows += __builtin_popcountll(x->bits[w]);
+	}
+	return rows;
+}
+
+/* Fill the row positions of bank `b' of `bm', spanning `s', in `x' */
+static void rowidx_rows(struct RowIndex *x, struct BufferMap *bm,
+                        const struct BankSpan *s, size_t b)
+{
+	const uint64_t rowlen = ramses_bufmap_rowlen(bm);
+	struct BMPos *pos = &x->rowpos[x->bank_row[b]];
+	bool seen = false;
+	unsigned int last = 0;
+
+	/* Ranges are in DRAM order, so the first to reach a row holds its start */
+	for (size_t ri = s->first; ri <= s->last; ri++) {
+		const struct DRAMRange *r = &bm->ranges[ri];
+		const uint64_t start = bank_offset(bm, r->start);
+		const unsigned int hi = range_addr(bm, r, r->entry_cnt - 1).row;
+		for (unsigned int row = r->start.row; row <= hi; row++) {
+			if (seen && row == last) {
+				continue;
+			}
+			*pos++ = (struct BMPos){
+				.ri = ri - s->first,
+				.ei = (row == r->start.row) ? 0 : (row * rowlen - start) / bm->entry_len
+			};
+			seen = true;
+			last = row;
+		}
+	}
+}
+
+/* Build row index `x' over the ranges of `bm', using its bank directory */
+static int rowidx_build(struct RowIndex *x, struct BufferMap *bm)
+{
+	const struct BankDir *d = &bm->bankdir;
+	struct BMPos *rowpos;
+	size_t words = 0;
+
+	for (size_t b = 0; b < d->bank_cnt; b++) {
+		words += bank_words(&d->banks[b]);
+	}
+	if (rowidx_alloc(x, d->bank_cnt, words, 0)) {
+		return 1;
+	}
+	for (size_t b = 0; b < d->bank_cnt; b++) {
+		x->bank_word[b + 1] = x->bank_word[b] + bank_words(&d->banks[b]);
+		x->bank_row[b + 1] = x->bank_row[b] + rowidx_bits(x, bm, &d->banks[b], b);
+	}
+	rowpos = realloc(x->rowpos, x->bank_row[d->bank_cnt] * sizeof(*rowpos));
+	if (rowpos == NULL) {
+		rowidx_free(x);
+		return 1;
+	}
+	x->rowpos = rowpos;
+	for (size_t b = 0; b < d->bank_cnt; b++) {
+		rowidx_rows(x, bm, &d->banks[b], b);
+	}
+	return 0;
+}
+
+/* Bank directory index of the bank of `a', or SIZE_MAX if not in `bm' */
+static size_t bankdir_find(const struct BankDir *d, struct DRAMAddr a)
+{
+	const uint32_t k = bank_key(a);
+	const size_t b = bankdir_lower(d, k);
+	return (b < d->bank_cnt && d->banks[b].key == k) ? b : SIZE_MAX;
+}
+
+/* Index in `rowpos' of row `row' of bank `b', or SIZE_MAX if not present */
+static size_t rowidx_rank(const struct BufferMap *bm, size_t b, unsigned int row)
+{
+	const struct RowIndex *x = &bm->rowidx;
+	const struct BankSpan *s = &bm->bankdir.banks[b];
+	unsigned int bit;
+	size_t w;
+	uint64_t m;
+
+	if (row < s->row_min || row > s->row_max) {
+		return SIZE_MAX;
+	}
+	bit = row - s->row_min;
+	w = x->bank_word[b] + bit / 64;
+	m = 1ULL << (bit % 64);
+	if (!(x->bits[w] & m)) {
+		return SIZE_MAX;
+	}
+	return x->bank_row[b] + x->rank[w] + __builtin_popcountll(x->bits[w] & (m - 1));
+}
+
+/* Build the lookup indices over the PTEs and ranges of `bm' */
+static int bufmap_index(struct BufferMap *bm, int flags)
+{
+	if (vaindex_build(&bm->vaindex, bm->ptes, bm->pte_cnt, bm->page_size)) {
+		return 1;
+	}
+	if (bankdir_build(&bm->bankdir, bm)) {
+		goto err_free_vaindex;
+	}
+	bm->rindex = (struct RangeIndex){ .keys = NULL, .ranks = NULL };
+	if ((flags & BUFMAP_SEARCHIDX) && rindex_build(&bm->rindex, bm)) {
+		goto err_free_bankdir;
+	}
+	bm->rowidx = (struct RowIndex){ .bits = NULL };
+	if ((flags & BUFMAP_ROWIDX) && rowidx_build(&bm->rowidx, bm)) {
+		goto err_free_rindex;
+	}
+	return 0;
+
+	err_free_rindex:
+		rindex_free(&bm->rindex);
+	err_free_bankdir:
+		bankdir_free(&bm->bankdir);
+	err_free_vaindex:
+		vaindex_free(&bm->vaindex);
+		return 1;
+}
+
+static void bufmap_index_free(struct BufferMap *bm)
+{
+	vaindex_free(&bm->vaindex);
+	bankdir_free(&bm->bankdir);
+	rindex_free(&bm->rindex);
+	rowidx_free(&bm->rowidx);
+}
+
+/* Release the PTEs and ranges of `bm', wherever they live */
+static void bufmap_data_free(struct BufferMap *bm)
+{
+	if (bm->snapshot != NULL) {
+		munmap(bm->snapshot, bm->snapshot_len);
+	} else {
+		free(bm->ptes);
+		free(bm->ranges);
+	}
+}
+
+/* Sorted and coalesced DRAM ranges of `n' PTEs of `bm', sorted by PA */
+static size_t ptes_ranges(struct BufferMap *bm, struct PTE *ptes, size_t n,
+                          struct DRAMRange **ranges)
+{
+	size_t thrdata[4];
+	struct BMSetup s = {
+		.ptes = ptes,
+		.ptelen = n,
+		.pagesz = bm->page_size,
+		.elen = bm->entry_len,
+		.msys = bm->msys,
+		.cnt = thrdata,
+		.off = thrdata + 1,
+		.bounds = thrdata + 2
+	};
+	return bmsetup_ranges(&s, ranges, NULL, 0, 1);
+}
+
+static int bufmap_build(struct BufferMap *bmap, void *buf, size_t len,
+                        struct Translation *trans, struct MemorySystem *msys,
+                        int flags, int nthreads)
+{
+	const size_t pagesz = ramses_translate_granularity(trans);
+	const size_t ptelen = ceildiv(len, pagesz);
+	struct BMSetup setup;
+	struct PTE *ptes;
+	struct DRAMRange *ranges = NULL;
+	size_t *thrdata;
+	size_t rangelen;
+	size_t elen;
+	void *tmpbuf;
+
+	elen = ramses_msys_granularity(msys, pagesz);
+	if (flags & BUFMAP_NOCLOBBER) {
+		tmpbuf = NULL;
+	} else {
+		tmpbuf = buf;
+	}
+
+	errno = 0;
+	ptes = malloc(ptelen * sizeof(*ptes));
+	if (ptes == NULL) {
+		return 1;
+	}
+	thrdata = malloc((3 * nthreads + 1) * sizeof(*thrdata));
+	if (thrdata == NULL) {
+		goto err_free_ptes;
+	}
+	setup = (struct BMSetup){
+		.ptes = ptes,
+		.ptelen = ptelen,
+		.pagesz = pagesz,
+		.elen = elen,
+		.buf = align_down((uintptr_t)buf, pagesz),
+		.trans = trans,
+		.msys = msys,
+		.cnt = thrdata,
+		.off = thrdata + nthreads,
+		.bounds = thrdata + 2 * nthreads
+	};
+
+	if (ptelen * sizeof(struct PTE) >= len) {
+		tmpbuf = NULL;
+	}
+	if (bmsetup_ptes(&setup, tmpbuf, nthreads)) {
+		goto err_free_thrdata;
+	}
+	ptes = realloc(setup.ptes, setup.ptelen * sizeof(*ptes));
+	setup.ptes = ptes = (ptes != NULL) ? ptes : setup.ptes;
+
+	rangelen = bmsetup_ranges(&setup, &ranges, tmpbuf, len, nthreads);
+	if (!rangelen) {
+		goto err_free;
+	}
+	bmap->msys = msys;
+	bmap->entry_len = elen;
+	bmap->ranges = ranges;
+	bmap->range_cnt = rangelen;
+	bmap->ptes = ptes;
+	bmap->pte_cnt = setup.ptelen;
+	bmap->page_size = pagesz;
+	if (bufmap_index(bmap, flags)) {
+		goto err_free;
+	}
+	free(thrdata);
+
+	if ((flags & BUFMAP_ZEROFILL) && !(flags & BUFMAP_NOCLOBBER)) {
+		memset(buf, 0, len);
+	}
+
+	bmap->bufbase = buf;
+	bmap->trans = *trans;
+	bmap->snapshot = NULL;
+	bmap->snapshot_len = 0;
+	return 0;
+
+	err_free:
+		free(ranges);
+	err_free_thrdata:
+		free(thrdata);
+	err_free_ptes:
+		free(ptes);
+		return 1;
+}
+
+int ramses_bufmap(struct BufferMap *bmap, void *buf, size_t len,
+                  struct Translation *trans, struct MemorySystem *msys,
+                  int flags)
+{
+	return bufmap_build(bmap, buf, len, trans, msys, flags, 1);
+}
+
+int ramses_bufmap_parallel(struct BufferMap *bm, void *buf, size_t len,
+                           struct Translation *trans, struct MemorySystem *msys,
+                           int flags, int nthreads)
+{
+	return bufmap_build(bm, buf, len, trans, msys, flags,
+	                    (nthreads > 1) ? nthreads : 1);
+}
+
+void ramses_bufmap_free(struct BufferMap *bm)
+{
+	bufmap_data_free(bm);
+	bufmap_index_free(bm);
+}
+
+struct DRAMAddr ramses_bufmap_addr(struct BufferMap *bm, size_t ri, size_t ei)
+{
+	if (ri >= bm->range_cnt || ei >= bm->ranges[ri].entry_cnt) {
+		return RAMSES_BADDRAMADDR;
+	}
+	return range_addr(bm, &bm->ranges[ri], ei);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-variable"
+static void bm_ptepos(struct BufferMap *bm, physaddr_t pa, size_t *pos)
+{
+	int r = ramses_bufmap_find_pte(bm, pa, pos);
+	assert(!r);
+}
+#pragma GCC diagnostic pop
+
+/* Append `r' to the `*n' ranges in `out', merging it if adjacent */
+static inline void range_push(struct BufferMap *bm, struct DRAMRange *out,
+                              size_t *n, struct DRAMRange r)
+{
+	if (*n && msys_dramrange_adjacent(bm->msys, &out[*n - 1], &r, bm->entry_len)) {
+		out[*n - 1].entry_cnt += r.entry_cnt;
+	} else {
+		out[(*n)++] = r;
+	}
+}
+
+/* Prepend `r' to the ranges from out[*w] up to out[end], merging it if adjacent */
+static inline void range_push_front(struct BufferMap *bm, struct DRAMRange *out,
+                                    size_t *w, size_t end, struct DRAMRange r)
+{
+	if (*w < end && msys_dramrange_adjacent(bm->msys, &r, &out[*w], bm->entry_len)) {
+		out[*w].start = r.start;
+		out[*w].entry_cnt += r.entry_cnt;
+	} else {
+		out[--(*w)] = r;
+	}
+}
+
+/* Number of the `n' sorted ranges at `a' starting at or before key `k' */
+static size_t range_upper(const struct DRAMRange *a, size_t n, uint64_t k)
+{
+	size_t lo = 0;
+	while (n) {
+		size_t half = n / 2;
+		if (ramses_dramaddr_key(a[lo + half].start) <= k) {
+			lo += half + 1;
+			n -= half + 1;
+		} else {
+			n = half;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Merge the `nb' sorted ranges `b' into those of `bm' in place from the
+ * back. bm->ranges needs room for all of them.
+ */
+static void range_merge(struct BufferMap *bm, const struct DRAMRange *b,
+                        size_t nb)
+{
+	struct DRAMRange *a = bm->ranges;
+	const size_t end = bm->range_cnt + nb;
+	size_t i = bm->range_cnt, w = end, n;
+	for (size_t j = nb; j--;) {
+		/* Ranges from a[lo] up to a[i] go after b[j] as they are */
+		const size_t lo = range_upper(a, i, ramses_dramaddr_key(b[j].start));
+		if (lo < i) {
+			range_push_front(bm, a, &w, end, a[--i]);
+			w -= i - lo;
+			memmove(&a[w], &a[lo], (i - lo) * sizeof(*a));
+			i = lo;
+		}
+		range_push_front(bm, a, &w, end, b[j]);
+	}
+	n = i;
+	if (w < end) {
+		range_push(bm, a, &n, a[w]);
+		memmove(&a[n], &a[w + 1], (end - w - 1) * sizeof(*a));
+		n += end - w - 1;
+	}
+	bm->range_cnt = n;
+}
+
+/*
+ * Cut the `nc' sorted ranges `cut', each within a single range of `bm', out
+ * of its ranges in place. bm->ranges needs room for nc more.
+ */
+static void range_cut(struct BufferMap *bm, const struct DRAMRange *cut,
+                      size_t nc)
+{
+	struct DRAMRange *a = bm->ranges;
+	const size_t end = bm->range_cnt + nc;
+	size_t i = bm->range_cnt, j = nc, w = end;
+	while (j) {
+		/* Ranges after the one holding cut[j - 1] stay whole */
+		const size_t k = range_upper(a, i, ramses_dramaddr_key(cut[j - 1].start)) - 1;
+		const struct DRAMRange r = a[k];
+		const uint64_t rk = ramses_dramaddr_key(r.start);
+		size_t ei = r.entry_cnt; /* Entries up to here still to be written */
+		w -= i - k - 1;
+		memmove(&a[w], &a[k + 1], (i - k - 1) * sizeof(*a));
+		i = k;
+		while (j && ramses_dramaddr_key(cut[j - 1].start) >= rk) {
+			const struct DRAMRange *c = &cut[--j];
+			const size_t off = msys_dramaddr_rcdiff(c->start, r.start, bm->msys) /
+			                   bm->entry_len;
+			assert(off + c->entry_cnt <= ei);
+			if (off + c->entry_cnt < ei) {
+				a[--w] = (struct DRAMRange){
+					.start = range_addr(bm, &r, off + c->entry_cnt),
+					.entry_cnt = ei - off - c->entry_cnt
+				};
+			}
+			ei = off;
+		}
+		if (ei) {
+			a[--w] = (struct DRAMRange){ .start = r.start, .entry_cnt = ei };
+		}
+	}
+	memmove(&a[i], &a[w], (end - w) * sizeof(*a));
+	bm->range_cnt = i + end - w;
+}
+
+/*
+ * Grow the array at `*(T **)pp' to `n' elements of `size' bytes. Leaves it
+ * as it is on failure.
+ */
+static int grow(void *pp, size_t n, size_t size)
+{
+	void *p;
+	memcpy(&p, pp, sizeof(p));
+	p = realloc(p, n ? n * size : 1);
+	if (p == NULL) {
+		return 1;
+	}
+	memcpy(pp, &p, sizeof(p));
+	return 0;
+}
+
+/*
+ * Make room in `bm' for `np' more PTEs and `nr' more ranges, moving them out
+ * of its snapshot if it has one
+ */
+static int bufmap_reserve(struct BufferMap *bm, size_t np, size_t nr)
+{
+	struct PTE *ptes;
+	struct DRAMRange *ranges;
+
+	errno = 0;
+	if (bm->snapshot == NULL) {
+		return grow(&bm->ptes, bm->pte_cnt + np, sizeof(*bm->ptes)) ||
+		       grow(&bm->ranges, bm->range_cnt + nr, sizeof(*bm->ranges));
+	}
+	ptes = malloc((bm->pte_cnt + np) * sizeof(*ptes));
+	ranges = malloc((bm->range_cnt + nr) * sizeof(*ranges));
+	if (ptes == NULL || ranges == NULL) {
+		free(ptes);
+		free(ranges);
+		return 1;
+	}
+	memcpy(ptes, bm->ptes, bm->pte_cnt * sizeof(*ptes));
+	memcpy(ranges, bm->ranges, bm->range_cnt * sizeof(*ranges));
+	bufmap_data_free(bm);
+	bm->ptes = ptes;
+	bm->ranges = ranges;
+	bm->snapshot = NULL;
+	bm->snapshot_len = 0;
+	return 0;
+}
+
+/* Run of index entries of a bank that carry over an edit, from one place to another */
+struct BlockMove {
+	size_t from;
+	size_t to;
+	size_t len;
+};
+
+/*
+ * Move the `n' blocks `mv' of elements of `size' bytes within `base'. Blocks
+ * keep their order, so moving those going down lowest first and those going
+ * up highest first never overwrites one that still has to move.
+ */
+static void blocks_move(void *base, size_t size, const struct BlockMove *mv,
+                        size_t n)
+{
+	unsigned char *b = base;
+	for (size_t i = 0; i < n; i++) {
+		if (mv[i].to < mv[i].from) {
+			memmove(b + mv[i].to * size, b + mv[i].from * size, mv[i].len * size);
+		}
+	}
+	for (size_t i = n; i--;) {
+		if (mv[i].to > mv[i].from) {
+			memmove(b + mv[i].to * size, b + mv[i].from * size, mv[i].len * size);
+		}
+	}
+}
+
+/* State for patching the bank indices of a BufferMap around an edit */
+struct BMPatch {
+	uint32_t *keys; /* Banks the edit touches, ascending */
+	size_t key_cnt;
+	struct BankSpan *old; /* Banks before the edit */
+	size_t old_cnt;
+	size_t *old_word; /* Row index `bank_word' and `bank_row' before the edit */
+	size_t *old_row;
+	size_t *src; /* Bank before the edit each one after it is a copy of, or SIZE_MAX */
+	struct BlockMove *mv;
+	size_t *lut; /* Lookup table for the widened `dim', if it changes */
+	unsigned int dim[4];
+};
+
+static void bmpatch_free(struct BMPatch *p)
+{
+	free(p->keys);
+	free(p->old);
+	free(p->old_word);
+	free(p->old_row);
+	free(p->src);
+	free(p->mv);
+	free(p->lut);
+}
+
+/*
+ * Prepare `p' for adding (if `add') or cutting the `n' sorted ranges `delta'
+ * to or from `bm', growing its bank indices to the most room the edit may
+ * need. Leaves `bm' as it is, bar spare room, on failure.
+ */
+static int bmpatch_init(struct BMPatch *p, struct BufferMap *bm,
+                        const struct DRAMRange *delta, size_t n, bool add)
+{
+	struct BankDir *d = &bm->bankdir;
+	struct RangeIndex *ri = &bm->rindex;
+	struct RowIndex *x = &bm->rowidx;
+	const size_t cnt = d->bank_cnt;
+	size_t banks = cnt;
+	size_t words = (x->bits != NULL) ? x->bank_word[cnt] : 0;
+	size_t rows = (x->bits != NULL) ? x->bank_row[cnt] : 0;
+
+	errno = 0;
+	*p = (struct BMPatch){
+		.keys = malloc(n * sizeof(*p->keys)),
+		.old = malloc(cnt * sizeof(*p->old)),
+		.old_cnt = cnt
+	};
+	if (p->keys == NULL || p->old == NULL) {
+		goto err_free;
+	}
+	memcpy(p->old, d->banks, cnt * sizeof(*p->old));
+	memcpy(p->dim, d->dim, sizeof(p->dim));
+	for (size_t i = 0, j; i < n; i = j) {
+		const uint32_t k = bank_key(delta[i].start);
+		const size_t b = bankdir_find(d, delta[i].start);
+		unsigned int lo = (b != SIZE_MAX) ? d->banks[b].row_min : UINT_MAX;
+		unsigned int hi = (b != SIZE_MAX) ? d->banks[b].row_max : 0;
+		for (j = i; j < n && bank_key(delta[j].start) == k; j++) {
+			const unsigned int rlo = delta[j].start.row;
+			const unsigned int rhi = range_addr(bm, &delta[j], delta[j].entry_cnt - 1).row;
+			lo = (rlo < lo) ? rlo : lo;
+			hi = (rhi > hi) ? rhi : hi;
+			rows += add ? rhi - rlo + 1 : 0;
+		}
+		p->keys[p->key_cnt++] = k;
+		/* Cutting ranges only ever shrinks banks */
+		if (add) {
+			words += (hi - lo) / 64 + 1;
+			if (b != SIZE_MAX) {
+				words -= bank_words(&d->banks[b]);
+			} else {
+				banks++;
+				bankdir_dim(p->dim, k);
+			}
+		}
+	}
+
+	p->src = malloc(banks * sizeof(*p->src));
+	p->mv = malloc(banks * sizeof(*p->mv));
+	if (p->src == NULL || p->mv == NULL ||
+	    grow(&d->banks, banks, sizeof(*d->banks)))
+	{
+		goto err_free;
+	}
+	if (memcmp(p->dim, d->dim, sizeof(p->dim)) &&
+	    bankdir_slots(p->dim) <= BANKDIR_LUT_MAX)
+	{
+		p->lut = malloc((bankdir_slots(p->dim) + 1) * sizeof(*p->lut));
+		if (p->lut == NULL) {
+			goto err_free;
+		}
+	}
+	if (ri->keys != NULL &&
+	    (grow(&ri->keys, bm->range_cnt + n + banks, sizeof(*ri->keys)) ||
+	     grow(&ri->ranks, bm->range_cnt + n + banks, sizeof(*ri->ranks))))
+	{
+		goto err_free;
+	}
+	if (x->bits != NULL) {
+		p->old_word = malloc((cnt + 1) * sizeof(*p->old_word));
+		p->old_row = malloc((cnt + 1) * sizeof(*p->old_row));
+		if (p->old_word == NULL || p->old_row == NULL ||
+		    grow(&x->bits, words, sizeof(*x->bits)) ||
+		    grow(&x->rank, words, sizeof(*x->rank)) ||
+		    grow(&x->bank_word, banks + 1, sizeof(*x->bank_word)) ||
+		    grow(&x->bank_row, banks + 1, sizeof(*x->bank_row)) ||
+		    grow(&x->rowpos, rows, sizeof(*x->rowpos)))
+		{
+			goto err_free;
+		}
+		memcpy(p->old_word, x->bank_word, (cnt + 1) * sizeof(*p->old_word));
+		memcpy(p->old_row, x->bank_row, (cnt + 1) * sizeof(*p->old_row));
+	}
+	return 0;
+
+	err_free:
+		bmpatch_free(p);
+		return 1;
+}
+
+/*
+ * Bring the bank indices of `bm' in line with its ranges, just edited as
+ * prepared in `p'. Banks the edit touched are indexed anew; the entries of
+ * all others only move.
+ */
+static void bmpatch_apply(struct BMPatch *p, struct BufferMap *bm)
+{
+	struct BankDir *d = &bm->bankdir;
+	struct RangeIndex *ri = &bm->rindex;
+	struct RowIndex *x = &bm->rowidx;
+	size_t pos = 0;
+	size_t nmv;
+
+	d->bank_cnt = 0;
+	for (size_t b = 0, k = 0; b < p->old_cnt || k < p->key_cnt;) {
+		size_t src = SIZE_MAX;
+		struct BankSpan s;
+		if (k == p->key_cnt ||
+		    (b < p->old_cnt && p->old[b].key < p->keys[k]))
+		{
+			src = b++;
+			s = p->old[src];
+			s.last = pos + (s.last - s.first);
+			s.first = pos;
+		} else {
+			const uint32_t key = p->keys[k++];
+			const size_t end = bank_end(bm, pos, key);
+			b += (b < p->old_cnt && p->old[b].key == key);
+			if (end == pos) {
+				continue;
+			}
+			s = bank_span(bm, pos, end - 1);
+		}
+		p->src[d->bank_cnt] = src;
+		d->banks[d->bank_cnt++] = s;
+		pos = s.last + 1;
+	}
+	assert(pos == bm->range_cnt);
+	if (memcmp(p->dim, d->dim, sizeof(p->dim))) {
+		free(d->lut);
+		d->lut = p->lut;
+		p->lut = NULL;
+		memcpy(d->dim, p->dim, sizeof(d->dim));
+		bankdir_lut(d);
+	} else if (d->bank_cnt != p->old_cnt) {
+		bankdir_lut(d);
+	}
+
+	if (ri->keys != NULL) {
+		nmv = 0;
+		for (size_t b = 0; b < d->bank_cnt; b++) {
+			if (p->src[b] != SIZE_MAX) {
+				const struct BankSpan *o = &p->old[p->src[b]];
+				p->mv[nmv++] = (struct BlockMove){
+					.from = o->first + p->src[b],
+					.to = d->banks[b].first + b,
+					.len = o->last - o->first + 2
+				};
+			}
+		}
+		blocks_move(ri->keys, sizeof(*ri->keys), p->mv, nmv);
+		blocks_move(ri->ranks, sizeof(*ri->ranks), p->mv, nmv);
+		for (size_t b = 0; b < d->bank_cnt; b++) {
+			if (p->src[b] == SIZE_MAX) {
+				rindex_bank(ri, bm, &d->banks[b], b);
+			}
+		}
+	}
+
+	if (x->bits != NULL) {
+		nmv = 0;
+		for (size_t b = 0; b < d->bank_cnt; b++) {
+			const size_t src = p->src[b];
+			x->bank_word[b + 1] = x->bank_word[b] + bank_words(&d->banks[b]);
+			if (src != SIZE_MAX) {
+				p->mv[nmv++] = (struct BlockMove){
+					.from = p->old_word[src],
+					.to = x->bank_word[b],
+					.len = p->old_word[src + 1] - p->old_word[src]
+				};
+			}
+		}
+		blocks_move(x->bits, sizeof(*x->bits), p->mv, nmv);
+		blocks_move(x->rank, sizeof(*x->rank), p->mv, nmv);
+		nmv = 0;
+		for (size_t b = 0; b < d->bank_cnt; b++) {
+			const size_t src = p->src[b];
+			if (src != SIZE_MAX) {
+				p->mv[nmv++] = (struct BlockMove){
+					.from = p->old_row[src],
+					.to = x->bank_row[b],
+					.len = p->old_row[src + 1] - p->old_row[src]
+				};
+				x->bank_row[b + 1] = x->bank_row[b] + p->mv[nmv - 1].len;
+			} else {
+				x->bank_row[b + 1] = x->bank_row[b] + rowidx_bits(x, bm, &d->banks[b], b);
+			}
+		}
+		blocks_move(x->rowpos, sizeof(*x->rowpos), p->mv, nmv);
+		for (size_t b = 0; b < d->bank_cnt; b++) {
+			if (p->src[b] == SIZE_MAX) {
+				rowidx_rows(x, bm, &d->banks[b], b);
+			}
+		}
+	}
+	bmpatch_free(p);
+}
+
+int ramses_bufmap_extend(struct BufferMap *bm, void *buf, size_t len)
+{
+	const size_t pagesz = bm->page_size;
+	const uintptr_t va = align_down((uintptr_t)buf, pagesz);
+	struct VAIndex *v = &bm->vaindex;
+	struct VAIndex nv = { .pa = NULL, .ext = NULL };
+	struct PTE *byva;
+	struct PTE *newptes;
+	struct DRAMRange *newranges = NULL;
+	struct BMPatch p;
+	physaddr_t *pas;
+	uintptr_t lo = 0;
+	size_t n, nr, ne = 0, span = 0;
+
+	if (!len) {
+		return 0;
+	}
+	n = ceildiv((uintptr_t)buf + len - va, pagesz);
+	/* Mapping a page twice would leave overlapping ranges behind */
+	for (size_t i = 0; i < n; i++) {
+		if (vaindex_pa(bm, va + i * pagesz) != RAMSES_BADADDR) {
+			errno = EINVAL;
+			return 1;
+		}
+	}
+	errno = 0;
+	/* The new extents in VA order, followed by a copy sorted by PA */
+	byva = malloc(2 * n * sizeof(*byva));
+	pas = malloc(n * sizeof(*pas));
+	if (byva == NULL || pas == NULL ||
+	    ramses_translate_range(&bm->trans, va, n, pas) != n)
+	{
+		goto err_free_ptes;
+	}
+	for (size_t i = 0; i < n; i++) {
+		struct PTE e = { .pa = pas[i], .va = va + i * pagesz, .npages = 1 };
+		pte_push(byva, &ne, e, pagesz);
+	}
+	newptes = byva + ne;
+	memcpy(newptes, byva, ne * sizeof(*newptes));
+	sort_ptes(newptes, ne, NULL, 1);
+	nr = ptes_ranges(bm, newptes, ne, &newranges);
+	if (!nr) {
+		goto err_free_ptes;
+	}
+
+	/* Claim all the memory needed up front, so that `bm' stays whole on failure */
+	if (bufmap_reserve(bm, ne, nr)) {
+		goto err_free_ranges;
+	}
+	if (v->dense) {
+		const uintptr_t end = v->base + v->len * pagesz;
+		lo = (va < v->base) ? va : v->base;
+		span = (((va + n * pagesz > end) ? va + n * pagesz : end) - lo) / pagesz;
+	}
+	if (v->dense && vaindex_dense(span, bm->pte_cnt + ne)) {
+		physaddr_t *pa = realloc(v->pa, span * sizeof(*pa));
+		if (pa == NULL) {
+			goto err_free_ranges;
+		}
+		v->pa = pa;
+	} else if (v->dense) {
+		/* Too spread out now; index everything anew, via the spare room */
+		memcpy(&bm->ptes[bm->pte_cnt], newptes, ne * sizeof(*newptes));
+		if (vaindex_build(&nv, bm->ptes, bm->pte_cnt + ne, pagesz)) {
+			goto err_free_ranges;
+		}
+	} else {
+		struct PTE *ext = realloc(v->ext, (v->len + ne) * sizeof(*ext));
+		if (ext == NULL) {
+			goto err_free_ranges;
+		}
+		v->ext = ext;
+	}
+	if (bmpatch_init(&p, bm, newranges, nr, true)) {
+		goto err_free_vaindex;
+	}
+
+	bm->pte_cnt = pte_merge(bm->ptes, bm->pte_cnt, newptes, ne, pagesz,
+	                        pte_pa_cmp);
+	range_merge(bm, newranges, nr);
+	if (nv.pa != NULL || nv.ext != NULL) {
+		vaindex_free(v);
+		*v = nv;
+	} else if (v->dense) {
+		vaindex_widen(v, lo, span, pagesz);
+		memcpy(&v->pa[(va - v->base) / pagesz], pas, n * sizeof(*pas));
+	} else {
+		v->base = (va < v->base) ? va : v->base;
+		v->len = pte_merge(v->ext, v->len, byva, ne, pagesz, pte_va_cmp);
+	}
+	bmpatch_apply(&p, bm);
+	free(newranges);
+	free(byva);
+	free(pas);
+	return 0;
+
+	err_free_vaindex:
+		vaindex_free(&nv);
+	err_free_ranges:
+		free(newranges);
+	err_free_ptes:
+		free(byva);
+		free(pas);
+		return 1;
+}
+
+int ramses_bufmap_remove(struct BufferMap *bm, void *addr, size_t len)
 {
-	const bool fast_translate = tmpbuf != NULL;
-	const size_t pagesz = ramses_translate_granularity(trans);
-	physaddr_t *tb = (physaddr_t *)tmpbuf;
+	const size_t pagesz = bm->page_size;
+	const uintptr_t lo = align_down((uintptr_t)addr, pagesz);
+	struct VAIndex *v = &bm->vaindex;
+	struct PTE *cut;
+	struct DRAMRange *remranges = NULL;
+	struct BMPatch p;
+	uintptr_t hi;
+	physaddr_t pa;
+	size_t n, k = 0, whole = 0, nr;
 
-	assert(buf % pagesz == 0);
-	if (fast_translate) {
-		if (ramses_translate_range(trans, buf, ptelen, tb) != ptelen) {
-			return 1;
+	if (!len) {
+		return 0;
+	}
+	hi = lo + ceildiv((uintptr_t)addr + len - lo, pagesz) * pagesz;
+	/* At most one piece comes out of each extent */
+	n = (hi - lo) / pagesz;
+	n = (n < bm->pte_cnt) ? n : bm->pte_cnt;
+	errno = 0;
+	cut = malloc(n * sizeof(*cut));
+	if (cut == NULL) {
+		return 1;
+	}
+	for (uintptr_t va = lo; (va = vaindex_next(bm, va, hi, &pa)) < hi;) {
+		const struct PTE *e;
+		uintptr_t end;
+		size_t i;
+		bm_ptepos(bm, pa, &i);
+		e = &bm->ptes[i];
+		end = e->va + pte_len(e, pagesz);
+		whole += (va == e->va && end <= hi);
+		end = (end < hi) ? end : hi;
+		cut[k++] = (struct PTE){ .pa = pa, .va = va, .npages = (end - va) / pagesz };
+		va = end;
+	}
+	if (!k) {
+		free(cut);
+		return 0;
+	} else if (whole == bm->pte_cnt) {
+		/* Queries assume at least one range */
+		errno = EINVAL;
+		goto err_free;
+	}
+	sort_ptes(cut, k, NULL, 1);
+	nr = ptes_ranges(bm, cut, k, &remranges);
+	if (!nr) {
+		goto err_free;
+	}
+
+	/* Claim all the memory needed up front, so that `bm' stays whole on failure */
+	if (bufmap_reserve(bm, k, nr)) {
+		goto err_free_ranges;
+	}
+	if (!v->dense) {
+		struct PTE *ext = realloc(v->ext, (v->len + 1) * sizeof(*ext));
+		if (ext == NULL) {
+			goto err_free_ranges;
 		}
+		v->ext = ext;
 	}
-	for (size_t i = 0; i < ptelen; i++) {
-		uintptr_t va = buf + i * pagesz;
-		ptes[i].va = va;
-		if (fast_translate) {
-			ptes[i].pa = tb[i];
-		} else {
-			ptes[i].pa = ramses_translate(trans, va);
+	if (bmpatch_init(&p, bm, remranges, nr, false)) {
+		goto err_free_ranges;
+	}
+
+	bm->pte_cnt = pte_cut(bm->ptes, bm->pte_cnt, cut, k, pagesz);
+	range_cut(bm, remranges, nr);
+	if (v->dense) {
+		for (size_t i = 0; i < k; i++) {
+			const size_t first = (cut[i].va - v->base) / pagesz;
+			for (size_t pg = 0; pg < cut[i].npages; pg++) {
+				v->pa[first + pg] = RAMSES_BADADDR;
+			}
 		}
+	} else {
+		vaindex_cut(v, lo, hi, pagesz);
 	}
-	qsort(ptes, ptelen, sizeof(*ptes), pte_pa_cmp);
+	bmpatch_apply(&p, bm);
+	free(remranges);
+	free(cut);
 	return 0;
-}
 
-static int dramaddr_cmp(const void *a, const void *b)
-{
-	return ramses_dramaddr_cmp(*((struct DRAMAddr *)a), *((struct DRAMAddr *)b));
-}
-
-static inline size_t
-dramaddr_rcdiff(struct DRAMAddr a, struct DRAMAddr b, struct MemorySystem *msys)
-{
-	return ((a.row - b.row) * msys->mapping.props.col_cnt + (a.col - b.col)) *
-	       msys->mapping.props.cell_size;
+	err_free_ranges:
+		free(remranges);
+	err_free:
+		free(cut);
+		return 1;
 }
 
-static size_t bmsetup_ranges(struct DRAMRange **dram_ranges,
-                             struct PTE *ptes, size_t ptelen, size_t pagesz,
-                             size_t elen, struct MemorySystem *msys,
-                             void *tmpbuf)
-{
-	const size_t ecnt = ptelen * (pagesz / elen);
 
-	struct DRAMAddr *tmp = NULL;
-	if (tmpbuf != NULL) {
-		tmp = (struct DRAMAddr *)tmpbuf;
-	} else {
-		tmp = malloc(ecnt * sizeof(*tmp));
-	}
+/* Snapshot file header, followed by the PTEs, ranges and msys string */
+struct BMSnapHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint32_t pte_size;
+	uint32_t range_size;
+	uint64_t bufbase;
+	uint64_t page_size;
+	uint64_t entry_len;
+	uint64_t pte_cnt;
+	uint64_t range_cnt;
+	uint64_t ptes_off;
+	uint64_t ranges_off;
+	uint64_t msys_off;
+	uint64_t msys_len; /* Not counting the terminating NUL */
+};
 
-	if (tmp != NULL) {
-		size_t ei = 0;
-		for (size_t page = 0; page < ptelen; page++) {
-			for (size_t off = 0; off < pagesz; off += elen) {
-				tmp[ei++] = ramses_resolve(msys, ptes[page].pa + off);
-			}
-		}
-		assert(ei == ecnt);
-		qsort(tmp, ecnt, sizeof(*tmp), dramaddr_cmp);
+#define BMSNAP_MAGIC "RAMSESBM"
+#define BMSNAP_BYTEORDER 0x01020304
+#define BMSNAP_ALIGN 64
 
-		size_t rangelen = 1;
-		struct DRAMAddr last = tmp[0];
-		for (size_t i = 1; i < ecnt; i++) {
-			struct DRAMAddr cur = tmp[i];
-			if (!ramses_dramaddr_same(DRAM_BANK, last, cur) ||
-			    dramaddr_rcdiff(cur, last, msys) != elen)
-			{
-				rangelen++;
+static int write_all(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p = (const char *)buf;
+	while (len) {
+		ssize_t r = pwrite(fd, p, len, off);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r <= 0) {
+			if (!r) {
+				errno = EIO;
 			}
-			last = cur;
+			return 1;
 		}
+		p += r;
+		len -= r;
+		off += r;
+	}
+	return 0;
+}
 
-		struct DRAMRange *ranges = malloc(rangelen * sizeof(*ranges));
-		if (ranges != NULL) {
-			size_t ri = 0;
-			ranges[0].start = tmp[0];
-			ranges[0].entry_cnt = 1;
-			last = tmp[0];
-			for (size_t i = 1; i < ecnt; i++) {
-				struct DRAMAddr cur = tmp[i];
-				if (!ramses_dramaddr_same(DRAM_BANK, last, cur) ||
-				    dramaddr_rcdiff(cur, last, msys) != elen)
-				{
-					ri++;
-					ranges[ri].start = cur;
-					ranges[ri].entry_cnt = 1;
-				} else {
-					ranges[ri].entry_cnt++;
-				}
-				last = cur;
-			}
-			assert(ri == rangelen - 1);
-			*dram_ranges = ranges;
-		} else {
-			rangelen = 0;
-		}
+int ramses_bufmap_save(struct BufferMap *bm, const char *msys_str, int fd)
+{
+	const char *mstr = (msys_str != NULL) ? msys_str : "";
+	struct BMSnapHeader h = {
+		.version = BUFMAP_SNAP_VERSION,
+		.byteorder = BMSNAP_BYTEORDER,
+		.pte_size = sizeof(*bm->ptes),
+		.range_size = sizeof(*bm->ranges),
+		.bufbase = (uintptr_t)bm->bufbase,
+		.page_size = bm->page_size,
+		.entry_len = bm->entry_len,
+		.pte_cnt = bm->pte_cnt,
+		.range_cnt = bm->range_cnt,
+		.msys_len = strlen(mstr)
+	};
 
-		if (tmp != tmpbuf) {
-			free(tmp);
-		}
-		return rangelen;
-	} else {
-		return 0;
+	memcpy(h.magic, BMSNAP_MAGIC, sizeof(h.magic));
+	h.ptes_off = align_down(sizeof(h) + BMSNAP_ALIGN - 1, BMSNAP_ALIGN);
+	h.ranges_off = align_down(h.ptes_off + h.pte_cnt * h.pte_size +
+	                          BMSNAP_ALIGN - 1, BMSNAP_ALIGN);
+	h.msys_off = h.ranges_off + h.range_cnt * h.range_size;
+	errno = 0;
+	/* Header last, so that an interrupted save is not mistaken for valid */
+	if (write_all(fd, bm->ptes, h.pte_cnt * h.pte_size, h.ptes_off) ||
+	    write_all(fd, bm->ranges, h.range_cnt * h.range_size, h.ranges_off) ||
+	    write_all(fd, mstr, h.msys_len + 1, h.msys_off) ||
+	    ftruncate(fd, h.msys_off + h.msys_len + 1) ||
+	    write_all(fd, &h, sizeof(h), 0))
+	{
+		return 1;
 	}
+	return 0;
 }
 
-static inline size_t ceildiv(size_t a, size_t b)
+/* Whether header `h' describes a well-formed snapshot of `size' bytes at `map' */
+static bool snap_valid(const struct BMSnapHeader *h, const char *map,
+                       size_t size)
 {
-	return (a / b) + !!(a % b);
+	return !memcmp(h->magic, BMSNAP_MAGIC, sizeof(h->magic)) &&
+	       h->version == BUFMAP_SNAP_VERSION &&
+	       h->byteorder == BMSNAP_BYTEORDER &&
+	       h->pte_size == sizeof(struct PTE) &&
+	       h->range_size == sizeof(struct DRAMRange) &&
+	       h->pte_cnt && h->range_cnt && h->page_size &&
+	       h->ptes_off % BMSNAP_ALIGN == 0 && h->ranges_off % BMSNAP_ALIGN == 0 &&
+	       h->ptes_off <= size &&
+	       h->pte_cnt <= (size - h->ptes_off) / h->pte_size &&
+	       h->ranges_off <= size &&
+	       h->range_cnt <= (size - h->ranges_off) / h->range_size &&
+	       h->msys_off <= size && h->msys_len < size - h->msys_off &&
+	       map[h->msys_off + h->msys_len] == '\0';
 }
 
-int ramses_bufmap(struct BufferMap *bmap, void *buf, size_t len,
-                  struct Translation *trans, struct MemorySystem *msys,
-                  int flags)
+/* Check an evenly spread sample of the PTEs of `bm' against its translator */
+static bool snap_sample_ok(struct BufferMap *bm)
 {
-	const size_t pagesz = ramses_translate_granularity(trans);
-	const size_t ptelen = ceildiv(len, pagesz);
-	struct PTE *ptes;
-	struct DRAMRange *ranges = NULL;
-	size_t rangelen;
-	size_t elen;
-	void *tmpbuf;
-
-	elen = ramses_msys_granularity(msys, pagesz);
-	if (flags & BUFMAP_NOCLOBBER) {
-		tmpbuf = NULL;
-	} else {
-		tmpbuf = buf;
+	const size_t n = (bm->pte_cnt < BUFMAP_SNAP_SAMPLES) ?
+	                 bm->pte_cnt : BUFMAP_SNAP_SAMPLES;
+	for (size_t k = 0; k < n; k++) {
+		const size_t i = (n > 1) ? k * (bm->pte_cnt - 1) / (n - 1) : 0;
+		const struct PTE *e = &bm->ptes[i];
+		const size_t last = pte_len(e, bm->page_size) - bm->page_size;
+		if (ramses_translate(&bm->trans, e->va) != e->pa ||
+		    ramses_translate(&bm->trans, e->va + last) != e->pa + last)
+		{
+			return false;
+		}
 	}
+	return true;
+}
+
+int ramses_bufmap_load_mmap(struct BufferMap *bm, int fd,
+                            struct Translation *trans, struct MemorySystem *msys,
+                            const char *msys_str, int flags)
+{
+	const size_t pagesz = ramses_translate_granularity(trans);
+	struct BMSnapHeader h;
+	struct BufferMap nbm;
+	struct stat st;
+	char *map;
+	int err;
 
 	errno = 0;
-	ptes = malloc(ptelen * sizeof(*ptes));
-	if (ptes == NULL) {
+	if (fstat(fd, &st)) {
 		return 1;
 	}
-
-	if (ptelen * sizeof(physaddr_t) >= len) {
-		tmpbuf = NULL;
+	if ((size_t)st.st_size < sizeof(h)) {
+		errno = EINVAL;
+		return 1;
 	}
-	if (bmsetup_ptes(ptes, ptelen, trans,
-	                 align_down((uintptr_t)buf, pagesz), tmpbuf))
-	{
-		goto err_free_ptes;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		return 1;
 	}
-
-	if (ptelen * (pagesz / elen) * sizeof(struct DRAMAddr) >= len) {
-		tmpbuf = NULL;
+	memcpy(&h, map, sizeof(h));
+	if (!snap_valid(&h, map, st.st_size) || h.page_size != pagesz ||
+	    h.entry_len != ramses_msys_granularity(msys, pagesz) ||
+	    (msys_str != NULL && strcmp(msys_str, map + h.msys_off)))
+	{
+		err = EINVAL;
+		goto err_unmap;
 	}
-	rangelen = bmsetup_ranges(&ranges, ptes, ptelen, pagesz, elen, msys, tmpbuf);
-	if (!rangelen) {
-		goto err_free;
+	nbm = (struct BufferMap){
+		.bufbase = (void *)(uintptr_t)h.bufbase,
+		.ptes = (struct PTE *)(map + h.ptes_off),
+		.pte_cnt = h.pte_cnt,
+		.page_size = h.page_size,
+		.ranges = (struct DRAMRange *)(map + h.ranges_off),
+		.range_cnt = h.range_cnt,
+		.entry_len = h.entry_len,
+		.msys = msys,
+		.trans = *trans,
+		.snapshot = map,
+		.snapshot_len = st.st_size
+	};
+	if (!snap_sample_ok(&nbm)) {
+		err = ESTALE;
+		goto err_unmap;
 	}
-
-	if ((flags & BUFMAP_ZEROFILL) && !(flags & BUFMAP_NOCLOBBER)) {
-		memset(buf, 0, len);
+	if (bufmap_index(&nbm, flags)) {
+		err = errno;
+		goto err_unmap;
 	}
-
-	bmap->bufbase = buf;
-	bmap->ptes = ptes;
-	bmap->pte_cnt = ptelen;
-	bmap->page_size = pagesz;
-	bmap->ranges = ranges;
-	bmap->range_cnt = rangelen;
-	bmap->entry_len = elen;
-	bmap->msys = msys;
+	*bm = nbm;
 	return 0;
 
-	err_free:
-		free(ranges);
-	err_free_ptes:
-		free(ptes);
+	err_unmap:
+		munmap(map, st.st_size);
+		errno = err;
 		return 1;
 }
 
-void ramses_bufmap_free(struct BufferMap *bm)
+int ramses_bufmap_find_va(struct BufferMap *bm, uintptr_t va, struct BMPos *pos,
+                          struct DRAMAddr *dramaddr)
 {
-	free(bm->ptes);
-	free(bm->ranges);
-}
+	const physaddr_t pa = vaindex_pa(bm, va);
+	struct DRAMAddr da;
 
-struct DRAMAddr ramses_bufmap_addr(struct BufferMap *bm, size_t ri, size_t ei)
-{
-	if (ri >= bm->range_cnt || ei >= bm->ranges[ri].entry_cnt) {
-		return RAMSES_BADDRAMADDR;
+	if (pa == RAMSES_BADADDR) {
+		return 1;
 	}
-	const size_t cell_off = (ei * bm->entry_len) / bm->msys->mapping.props.cell_size;
-	struct DRAMAddr da = bm->ranges[ri].start;
-	da.row += (da.col + cell_off) / bm->msys->mapping.props.col_cnt;
-	da.col = (da.col + cell_off) % bm->msys->mapping.props.col_cnt;
-
-	return da;
+	da = ramses_resolve(bm->msys, pa);
+	if (pos != NULL &&
+	    ramses_bufmap_find(bm, ramses_resolve(bm->msys,
+	                                          align_down(pa, bm->entry_len)),
+	                       pos))
+	{
+		return 1;
+	}
+	if (dramaddr != NULL) {
+		*dramaddr = da;
+	}
+	return 0;
 }
 
 struct BMPos ramses_bufmap_next(struct BufferMap *bm, struct BMPos p,
@@ -238,8 +1940,25 @@ struct BMPos ramses_bufmap_next(struct BufferMap *bm, struct BMPos p,
 	size_t ri = p.ri;
 	size_t ei = p.ei;
 	struct DRAMAddr da = ida;
-	size_t colents = ((bm->msys->mapping.props.col_cnt - da.col) *
-	                   bm->msys->mapping.props.cell_size) / bm->entry_len;
+	size_t colents;
+
+	if (lvl >= DRAM_BANK) {
+		/* Jump to the first bank past the current one on level `lvl' */
+		const struct BankDir *d = &bm->bankdir;
+		const uint32_t k = bank_key(ida) |
+		                   ~(uint32_t)(ramses_dramlevel_keymask(lvl) >> 32);
+		size_t b;
+		if (ramses_dramaddr_cmp(ida, RAMSES_BADDRAMADDR) == 0) {
+			return p;
+		}
+		b = (k == UINT32_MAX) ? d->bank_cnt : bankdir_lower(d, k + 1);
+		return (struct BMPos){
+			.ri = (b < d->bank_cnt) ? d->banks[b].first : bm->range_cnt,
+			.ei = 0
+		};
+	}
+	colents = ((bm->msys->mapping.props.col_cnt - da.col) *
+	           bm->msys->mapping.props.cell_size) / bm->entry_len;
 	while (ramses_dramaddr_cmp(da, RAMSES_BADDRAMADDR) != 0 &&
 	       ramses_dramaddr_same(lvl, ida, da))
 	{
@@ -279,9 +1998,33 @@ size_t ramses_bufmap_entrycnt(struct BufferMap *bm,
 	return ret;
 }
 
-static int dramrange_start_cmp(const void *a, const void *b)
+/*
+ * Index of the last range starting at or before key `k' (0 if none), and
+ * whether it starts exactly at `k'.
+ */
+static size_t range_search(struct BufferMap *bm, uint64_t k, bool *exact)
 {
-	return ramses_dramaddr_cmp(((struct DRAMRange *)a)->start, ((struct DRAMRange *)b)->start);
+	const struct DRAMRange *r = bm->ranges;
+	size_t lo = 0;
+	if (bm->rindex.keys != NULL) {
+		/* Search only the ranges of the first bank at or above that of `k' */
+		const struct BankDir *d = &bm->bankdir;
+		const size_t b = bankdir_lower(d, k >> 32);
+		lo = (b < d->bank_cnt) ? d->banks[b].first : bm->range_cnt;
+		if (b < d->bank_cnt && d->banks[b].key == k >> 32) {
+			const size_t base = d->banks[b].first + b;
+			lo += eytz_upper(&bm->rindex.keys[base], &bm->rindex.ranks[base],
+			                 d->banks[b].last - d->banks[b].first + 1, k);
+		}
+		lo -= !!lo;
+	} else {
+		for (size_t n = bm->range_cnt; n > 1; n -= n / 2) {
+			size_t mid = lo + n / 2;
+			lo = (ramses_dramaddr_key(r[mid].start) <= k) ? mid : lo;
+		}
+	}
+	*exact = ramses_dramaddr_key(r[lo].start) == k;
+	return lo;
 }
 
 struct entryeval_arg {
@@ -295,7 +2038,7 @@ static int entry_eval(size_t ei, void *arg)
 	struct entryeval_arg *a = (struct entryeval_arg *)arg;
 	struct DRAMAddr estart = ramses_bufmap_addr(a->bm, a->ri, ei);
 	int r = ramses_dramaddr_cmp(a->addr, estart);
-	if (r > 0) {
+	if (r > 0 && a->addr.row == estart.row) {
 		size_t diff = (a->addr.col - estart.col) * a->bm->msys->mapping.props.cell_size;
 		if (diff < a->bm->entry_len) {
 			return 0;
@@ -306,21 +2049,26 @@ static int entry_eval(size_t ei, void *arg)
 
 int ramses_bufmap_find(struct BufferMap *bm, struct DRAMAddr addr, struct BMPos *pos)
 {
+	const uint64_t k = ramses_dramaddr_key(addr);
 	bool found;
 	size_t ri = 0;
 	size_t ei = 0;
-	struct DRAMRange item = { .start = addr, .entry_cnt = 0 };
-	found = binsearch(&item, bm->ranges, bm->range_cnt, sizeof(*(bm->ranges)),
-	                  dramrange_start_cmp, &ri);
+	ri = range_search(bm, k, &found);
 	assert(ri < bm->range_cnt);
 	if (!found) {
+		/* Entries are evenly spaced within a range; check the candidate */
+		const struct DRAMRange *r = &bm->ranges[ri];
 		struct entryeval_arg earg = {
 			.addr = addr,
 			.bm = bm,
 			.ri = ri
 		};
-		found = binsearch_idx(bm->ranges[ri].entry_cnt, entry_eval, &earg, &ei);
-		assert(ei < bm->ranges[ri].entry_cnt);
+		if (ramses_dramaddr_key(r->start) < k &&
+		    ramses_dramaddr_same(DRAM_BANK, addr, r->start))
+		{
+			ei = msys_dramaddr_rcdiff(addr, r->start, bm->msys) / bm->entry_len;
+			found = ei < r->entry_cnt && !entry_eval(ei, &earg);
+		}
 	}
 	if (pos != NULL && found) {
 		pos->ri = ri;
@@ -330,42 +2078,217 @@ int ramses_bufmap_find(struct BufferMap *bm, struct DRAMAddr addr, struct BMPos
 }
 
 struct samelvl_eval_arg {
-	struct DRAMAddr addr;
+	uint64_t key;
+	uint64_t mask; /* Key bits of the DRAM level */
 	struct BufferMap *bm;
 	size_t ri;
-	enum DRAMLevel lvl;
 };
 
+static inline int samelvl_eval(struct samelvl_eval_arg *a, struct DRAMAddr db)
+{
+	uint64_t kb = ramses_dramaddr_key(db);
+	return !((a->key ^ kb) & a->mask) ? 0 : (a->key > kb) - (a->key < kb);
+}
+
 static int samelvl_range_eval(size_t ri, void *arg)
 {
 	struct samelvl_eval_arg *a = (struct samelvl_eval_arg *)arg;
-	struct DRAMAddr da = a->addr;
-	struct DRAMAddr db = ramses_bufmap_addr(a->bm, ri, 0);
-	return ramses_dramaddr_same(a->lvl, da, db) ? 0 : ramses_dramaddr_cmp(da, db);
+	return samelvl_eval(a, a->bm->ranges[a->ri + ri].start);
 }
 
 static int samelvl_entry_eval(size_t ei, void *arg)
 {
 	struct samelvl_eval_arg *a = (struct samelvl_eval_arg *)arg;
-	struct DRAMAddr da = a->addr;
-	struct DRAMAddr db = ramses_bufmap_addr(a->bm, a->ri, ei);
-	return ramses_dramaddr_same(a->lvl, da, db) ? 0 : ramses_dramaddr_cmp(da, db);
+	return samelvl_eval(a, ramses_bufmap_addr(a->bm, a->ri, ei));
+}
+
+/*
+ * Account for a finished row, full or not, extending or breaking the
+ * `*streak' of full rows right before it
+ */
+static void stats_row(struct BMStats *st, bool full, size_t *bank_rows,
+                      size_t *streak)
+{
+	st->rows++;
+	st->rows_full += full;
+	st->rows_partial += !full;
+	(*bank_rows)++;
+	*streak = full ? *streak + 1 : 0;
+	st->triples += (*streak >= 3);
+}
+
+/* Fold the row count of a finished bank into `st' */
+static void stats_bank(struct BMStats *st, size_t bank_rows)
+{
+	if (!st->bank_cnt++ || bank_rows < st->bank_rows_min) {
+		st->bank_rows_min = bank_rows;
+	}
+	if (bank_rows > st->bank_rows_max) {
+		st->bank_rows_max = bank_rows;
+	}
+}
+
+void ramses_bufmap_stats(struct BufferMap *bm, struct BMStats *out)
+{
+	const struct DRAMRange *r = bm->ranges;
+	const uint64_t rowlen = ramses_bufmap_rowlen(bm);
+	struct BMStats st;
+	size_t bank_rows = 0;
+	size_t streak = 0;
+	uint32_t key = 0;
+	unsigned int row = 0;
+	uint64_t covered = 0; /* Bytes of row `row' of bank `key' seen so far */
+	bool open = false;
+
+	memset(&st, 0, sizeof(st));
+	st.pte_cnt = bm->pte_cnt;
+	st.range_cnt = bm->range_cnt;
+	for (size_t i = 0; i < bm->pte_cnt; i++) {
+		const size_t n = bm->ptes[i].npages;
+		st.pages += n;
+		st.pte_max_pages = (n > st.pte_max_pages) ? n : st.pte_max_pages;
+		st.phys_runs += (!i || bm->ptes[i - 1].pa +
+		                 pte_len(&bm->ptes[i - 1], bm->page_size) != bm->ptes[i].pa);
+	}
+
+	for (size_t i = 0; i < bm->range_cnt; i++) {
+		const uint32_t k = bank_key(r[i].start);
+		const uint64_t s = bank_offset(bm, r[i].start);
+		const uint64_t e = s + r[i].entry_cnt * bm->entry_len;
+		size_t h = 0;
+
+		st.entries += r[i].entry_cnt;
+		st.range_max = (r[i].entry_cnt > st.range_max) ? r[i].entry_cnt : st.range_max;
+		while (h + 1 < BMSTATS_HIST_LEN && (r[i].entry_cnt >> (h + 1))) {
+			h++;
+		}
+		st.range_hist[h]++;
+
+		if (open && k != key) {
+			stats_row(&st, covered == rowlen, &bank_rows, &streak);
+			stats_bank(&st, bank_rows);
+			open = false;
+		}
+		for (uint64_t ro = s / rowlen; ro * rowlen < e; ro++) {
+			const uint64_t lo = (s > ro * rowlen) ? s : ro * rowlen;
+			const uint64_t hi = (e < (ro + 1) * rowlen) ? e : (ro + 1) * rowlen;
+			if (open && ro != row) {
+				stats_row(&st, covered == rowlen, &bank_rows, &streak);
+				/* Skipping rows breaks any run of full ones */
+				streak = (ro == (uint64_t)row + 1) ? streak : 0;
+				covered = 0;
+			} else if (!open) {
+				bank_rows = 0;
+				streak = 0;
+				covered = 0;
+			}
+			open = true;
+			key = k;
+			row = ro;
+			covered += hi - lo;
+		}
+	}
+	if (open) {
+		stats_row(&st, covered == rowlen, &bank_rows, &streak);
+		stats_bank(&st, bank_rows);
+	}
+	*out = st;
+}
+
+size_t ramses_bufmap_triples(struct BufferMap *bm, ramses_triple_fn_t fn,
+                             void *arg)
+{
+	const struct DRAMRange *r = bm->ranges;
+	const uint64_t rowlen = ramses_bufmap_rowlen(bm);
+	struct BMPos win[2]; /* First entries of the last two full rows seen */
+	uint64_t winrow[2] = { 0, 0 };
+	size_t wn = 0;
+	size_t cnt = 0;
+
+	for (size_t i = 0, j; i < bm->range_cnt; i = j) {
+		/* Ranges i up to j form one run contiguous in DRAM */
+		uint64_t run_end = bank_offset(bm, r[i].start) + r[i].entry_cnt * bm->entry_len;
+		for (j = i + 1; j < bm->range_cnt &&
+		                ramses_dramaddr_same(DRAM_BANK, r[j].start, r[i].start) &&
+		                bank_offset(bm, r[j].start) == run_end; j++)
+		{
+			run_end += r[j].entry_cnt * bm->entry_len;
+		}
+		if (i && !ramses_dramaddr_same(DRAM_BANK, r[i - 1].start, r[i].start)) {
+			wn = 0;
+		}
+		/* Rows starting in range k and ending within the run are full */
+		for (size_t k = i; k < j; k++) {
+			const uint64_t s = bank_offset(bm, r[k].start);
+			const uint64_t e = s + r[k].entry_cnt * bm->entry_len;
+			for (uint64_t row = ceildiv(s, rowlen);
+			     row * rowlen < e && (row + 1) * rowlen <= run_end; row++)
+			{
+				struct BMPos p = { .ri = k, .ei = (row * rowlen - s) / bm->entry_len };
+				if (wn == 2 && winrow[0] + 2 == row && winrow[1] + 1 == row) {
+					struct RowTriple t = {
+						.victim = range_addr(bm, &r[win[1].ri], win[1].ei),
+						.lo = win[0],
+						.mid = win[1],
+						.hi = p
+					};
+					cnt++;
+					if (fn(&t, arg)) {
+						return cnt;
+					}
+				}
+				win[0] = win[1];
+				winrow[0] = winrow[1];
+				win[1] = p;
+				winrow[1] = row;
+				wn += (wn < 2);
+			}
+		}
+	}
+	return cnt;
 }
 
 int ramses_bufmap_find_same(struct BufferMap *bm, struct DRAMAddr a,
                             enum DRAMLevel lvl, struct BMPos *pos)
 {
+	const struct BankDir *d = &bm->bankdir;
+	const uint32_t m = ramses_dramlevel_keymask((lvl > DRAM_BANK) ? lvl : DRAM_BANK) >> 32;
+	const uint32_t k = bank_key(a) & m;
+	const size_t b = bankdir_lower(d, k);
 	bool found;
 	size_t ri = 0;
 	size_t ei = 0;
-	struct samelvl_eval_arg earg = { .addr = a, .bm = bm, .ri = 0, .lvl = lvl };
-	found = binsearch_idx(bm->range_cnt, samelvl_range_eval, &earg, &ri);
-	assert(ri < bm->range_cnt);
-	if (!found && lvl == DRAM_ROW) {
-		earg.ri = ri;
-		found = binsearch_idx(bm->ranges[ri].entry_cnt, samelvl_entry_eval,
-		                      &earg, &ei);
-		assert(ei < bm->ranges[ri].entry_cnt);
+
+	if (b >= d->bank_cnt || ((d->banks[b].key ^ k) & m)) {
+		return 1;
+	}
+	ri = d->banks[b].first;
+	found = (lvl >= DRAM_BANK);
+	if (!found && bm->rowidx.bits != NULL) {
+		const size_t rank = rowidx_rank(bm, b, a.row);
+		if (rank != SIZE_MAX) {
+			ri += bm->rowidx.rowpos[rank].ri;
+			ei = bm->rowidx.rowpos[rank].ei;
+			found = true;
+		}
+	} else if (!found && a.row >= d->banks[b].row_min && a.row <= d->banks[b].row_max) {
+		/* Search the ranges of this bank only */
+		struct samelvl_eval_arg earg = {
+			.key = ramses_dramaddr_key(a),
+			.mask = ramses_dramlevel_keymask(lvl),
+			.bm = bm,
+			.ri = ri
+		};
+		found = binsearch_idx(d->banks[b].last - ri + 1, samelvl_range_eval,
+		                      &earg, &ri);
+		ri += earg.ri;
+		assert(ri <= d->banks[b].last);
+		if (!found) {
+			earg.ri = ri;
+			found = binsearch_idx(bm->ranges[ri].entry_cnt, samelvl_entry_eval,
+			                      &earg, &ei);
+			assert(ei < bm->ranges[ri].entry_cnt);
+		}
 	}
 
 	if (pos != NULL && found) {
@@ -375,25 +2298,71 @@ int ramses_bufmap_find_same(struct BufferMap *bm, struct DRAMAddr a,
 	return found ? 0 : 1;
 }
 
-int ramses_bufmap_find_pte(struct BufferMap *bm, physaddr_t pa, size_t *ptepos)
+int ramses_bufmap_has_row(struct BufferMap *bm, struct DRAMAddr addr)
 {
-	bool found;
-	size_t pos;
-	struct PTE pframe = { .pa = align_down(pa, bm->page_size), .va = 0 };
-	found = binsearch(&pframe, bm->ptes, bm->pte_cnt, sizeof(*(bm->ptes)),
-	                  pte_pa_cmp, &pos);
-	if (found) *ptepos = pos;
-	return found ? 0 : 1;
+	return !ramses_bufmap_find_same(bm, addr, DRAM_ROW, NULL);
 }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-variable"
-static void bm_ptepos(struct BufferMap *bm, physaddr_t pa, size_t *pos)
+unsigned int ramses_bufmap_neighbors(struct BufferMap *bm, struct DRAMAddr addr,
+                                     unsigned int dist, struct BMPos out[2])
 {
-	int r = ramses_bufmap_find_pte(bm, pa, pos);
-	assert(!r);
+	struct DRAMAddr lo = addr;
+	struct DRAMAddr hi = addr;
+	unsigned int mask = 0;
+
+	lo.row -= dist;
+	hi.row += dist;
+	if (dist <= addr.row && !ramses_bufmap_find_same(bm, lo, DRAM_ROW, &out[0])) {
+		mask |= 1;
+	}
+	if (hi.row == addr.row + dist &&
+	    !ramses_bufmap_find_same(bm, hi, DRAM_ROW, &out[1]))
+	{
+		mask |= 2;
+	}
+	return mask;
+}
+
+size_t ramses_bufmap_bank_rows(struct BufferMap *bm, struct DRAMAddr addr)
+{
+	const size_t b = bankdir_find(&bm->bankdir, addr);
+	const struct BankSpan *s;
+	size_t rows = 0;
+
+	if (b == SIZE_MAX) {
+		return 0;
+	}
+	if (bm->rowidx.bits != NULL) {
+		return bm->rowidx.bank_row[b + 1] - bm->rowidx.bank_row[b];
+	}
+	s = &bm->bankdir.banks[b];
+	for (size_t ri = s->first, last = SIZE_MAX; ri <= s->last; ri++) {
+		const struct DRAMRange *r = &bm->ranges[ri];
+		const size_t hi = range_addr(bm, r, r->entry_cnt - 1).row;
+		rows += hi - r->start.row + (last != r->start.row);
+		last = hi;
+	}
+	return rows;
+}
+
+int ramses_bufmap_find_pte(struct BufferMap *bm, physaddr_t pa, size_t *ptepos)
+{
+	const struct PTE *p = bm->ptes;
+	size_t lo = 0;
+	if (!bm->pte_cnt || pa < p[0].pa) {
+		return 1;
+	}
+	for (size_t n = bm->pte_cnt; n > 1; n -= n / 2) {
+		size_t mid = lo + n / 2;
+		lo = (p[mid].pa <= pa) ? mid : lo;
+	}
+	if (pa - p[lo].pa >= pte_len(&p[lo], bm->page_size)) {
+		return 1;
+	}
+	*ptepos = lo;
+	return 0;
 }
-#pragma GCC diagnostic pop
+
 
 int ramses_bufmap_get_entry(struct BufferMap *bm, struct BMPos bp,
                             struct AddrEntry *entry)
@@ -407,10 +2376,98 @@ int ramses_bufmap_get_entry(struct BufferMap *bm, struct BMPos bp,
 	bm_ptepos(bm, pa, &ptepos);
 
 	entry->dramaddr = da;
-	entry->virtp = bm->ptes[ptepos].va + (pa % bm->page_size);
+	entry->virtp = bm->ptes[ptepos].va + (pa - bm->ptes[ptepos].pa);
+	#ifdef ADDR_DEBUG
+	entry->physaddr = pa;
+	#endif
+	return 0;
+}
+
+void ramses_bufmap_iter_init(struct BMIter *it, struct BufferMap *bm,
+                             struct BMPos start, struct BMPos end)
+{
+	*it = (struct BMIter){
+		.bm = bm,
+		.pos = start,
+		.end = end,
+		.da = ramses_bufmap_addr(bm, start.ri, start.ei),
+		.pa = RAMSES_BADADDR,
+		.pte = SIZE_MAX
+	};
+}
+
+/* PTE index for `pa', trying the cached PTE and the one after it first */
+static size_t iter_pte(struct BMIter *it, physaddr_t pa)
+{
+	const struct BufferMap *bm = it->bm;
+	size_t pte = it->pte;
+	if (pte < bm->pte_cnt &&
+	    pa - bm->ptes[pte].pa < pte_len(&bm->ptes[pte], bm->page_size))
+	{
+		return pte;
+	} else if (pte + 1 < bm->pte_cnt &&
+	           pa - bm->ptes[pte + 1].pa < pte_len(&bm->ptes[pte + 1], bm->page_size))
+	{
+		return pte + 1;
+	}
+	bm_ptepos(it->bm, pa, &pte);
+	return pte;
+}
+
+/*
+ * Physical address of DRAM address `to', from that of `from' at `pa' in the
+ * same bank. A fused memory system is linear within a rank, so this only
+ * takes the image of the bits that differ.
+ */
+static physaddr_t iter_step(const struct MemorySystem *m, physaddr_t pa,
+                            struct DRAMAddr from, struct DRAMAddr to)
+{
+	const struct FusedMap *f = m->fused;
+	if (f == NULL) {
+		return RAMSES_BADADDR;
+	}
+	return pa ^ gf2_apply(f->icols[to.rank & ((1 << f->rank_bits) - 1)],
+	                      dramaddr_to_lane(from) ^ dramaddr_to_lane(to));
+}
+
+int ramses_bufmap_iter_next(struct BMIter *it, struct AddrEntry *entry)
+{
+	struct BufferMap *bm = it->bm;
+	const struct MappingProps *props = &bm->msys->mapping.props;
+	physaddr_t pa;
+
+	if (it->pos.ri > it->end.ri ||
+	    (it->pos.ri == it->end.ri && it->pos.ei >= it->end.ei) ||
+	    ramses_dramaddr_cmp(it->da, RAMSES_BADDRAMADDR) == 0)
+	{
+		return 1;
+	}
+	if (it->pa == RAMSES_BADADDR) {
+		it->pa = ramses_resolve_reverse(bm->msys, it->da);
+	}
+	pa = it->pa;
+	it->pte = iter_pte(it, pa);
+
+	entry->dramaddr = it->da;
+	entry->virtp = bm->ptes[it->pte].va + (pa - bm->ptes[it->pte].pa);
 	#ifdef ADDR_DEBUG
 	entry->physaddr = pa;
 	#endif
+
+	/* Step to the next entry without recomputing it from the range start */
+	if (++it->pos.ei < bm->ranges[it->pos.ri].entry_cnt) {
+		const struct DRAMAddr prev = it->da;
+		it->da.col += bm->entry_len / props->cell_size;
+		if (it->da.col >= props->col_cnt) {
+			it->da.row += it->da.col / props->col_cnt;
+			it->da.col %= props->col_cnt;
+		}
+		it->pa = iter_step(bm->msys, pa, prev, it->da);
+	} else {
+		it->pos = (struct BMPos){ .ri = it->pos.ri + 1, .ei = 0 };
+		it->da = ramses_bufmap_addr(bm, it->pos.ri, 0);
+		it->pa = RAMSES_BADADDR;
+	}
 	return 0;
 }
 
@@ -418,27 +2475,12 @@ size_t ramses_bufmap_get_entries(struct BufferMap *bm,
                                  struct BMPos start, struct BMPos end,
                                  struct AddrEntry *entries, size_t maxents)
 {
+	struct BMIter it;
 	size_t enti = 0;
-	struct BMPos p = { .ri = start.ri, .ei = start.ei };
-	struct DRAMAddr da = ramses_bufmap_addr(bm, p.ri, p.ei);
-
-	while (enti < maxents &&
-	       ramses_dramaddr_cmp(da, RAMSES_BADDRAMADDR) != 0 &&
-	       (p.ri < end.ri || (p.ri == end.ri && p.ei < end.ei)))
-	{
-		physaddr_t pa = ramses_resolve_reverse(bm->msys, da);
-		size_t ptepos;
-		bm_ptepos(bm, pa, &ptepos);
-
-		entries[enti].dramaddr = da;
-		entries[enti].virtp = bm->ptes[ptepos].va + (pa % bm->page_size);
-		#ifdef ADDR_DEBUG
-		entries[enti].physaddr = pa;
-		#endif
 
+	ramses_bufmap_iter_init(&it, bm, start, end);
+	while (enti < maxents && !ramses_bufmap_iter_next(&it, &entries[enti])) {
 		enti++;
-		p = ramses_bufmap_nextpos(bm, p);
-		da = ramses_bufmap_addr(bm, p.ri, p.ei);
 	}
 	return enti;
 }
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "eytz.h"
+
+/* In-order walk of the implicit tree rooted at `node', filling it from `pos' */
+static size_t layout(size_t n, size_t *ranks, size_t pos, size_t node)
+{
+	if (node <= n) {
+		pos = layout(n, ranks, pos, 2 * node);
+		ranks[node] = pos++;
+		pos = layout(n, ranks, pos, 2 * node + 1);
+	}
+	return pos;
+}
+
+void eytz_ranks(size_t n, size_t *ranks)
+{
+	layout(n, ranks, 0, 1);
+}
+
+void eytz_layout(const uint64_t *sorted, size_t n, uint64_t *keys,
+                 size_t *ranks)
+{
+	eytz_ranks(n, ranks);
+	for (size_t i = 1; i <= n; i++) {
+		keys[i] = sorted[ranks[i]];
+	}
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is licensed under the GPL2+.
+ */
+
+/* Eytzinger (BFS order) layout of sorted 64-bit keys for fast searching */
+
+#ifndef RAMSES_EYTZ_H
+#define RAMSES_EYTZ_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Keys per cache line; the search prefetches this many levels down */
+#define EYTZ_LINE_KEYS 8
+
+/* Store in ranks[1..n] the sorted position of each slot of a layout of `n' keys */
+void eytz_ranks(size_t n, size_t *ranks);
+
+/*
+ * Lay out the `n' ascending keys `sorted' in Eytzinger order into
+ * keys[1..n], storing the position in `sorted' of keys[i] in ranks[i].
+ */
+void eytz_layout(const uint64_t *sorted, size_t n, uint64_t *keys,
+                 size_t *ranks);
+
+/* Number of keys at or below `k' in an Eytzinger layout of `n' keys */
+static inline size_t eytz_upper(const uint64_t *keys, const size_t *ranks,
+                                size_t n, uint64_t k)
+{
+	size_t i = 1;
+	while (i <= n) {
+		__builtin_prefetch(keys + EYTZ_LINE_KEYS * i);
+		i = 2 * i + (keys[i] <= k);
+	}
+	/* Undo the trailing right turns to get the first key above `k' */
+	i >>= __builtin_ctzll(~(unsigned long long)i) + 1;
+	return i ? ranks[i] : n;
+}
+
+#endif /* eytz.h */
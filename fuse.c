@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "fuse.h"
+#include "bitops.h"
+
+#include <stdlib.h>
+
+#define RANK_LANE_MASK DRAMADDR_LANE_PACK(0ULL, 0ULL, 0xffULL, 0ULL, 0ULL, 0ULL)
+#define SELFCHECK_SAMPLES 4096
+
+/*
+ * Columns of the linear map remapping `r' performs on packed DRAM addresses
+ * within rank `rank'.
+ */
+static int remap_matrix(struct Remapping *r, int rank, uint64_t *mat)
+{
+	const uint64_t base = DRAMADDR_LANE_PACK(0ULL, 0ULL, (uint64_t)rank,
+	                                         0ULL, 0ULL, 0ULL);
+	if (dramaddr_to_lane(ramses_remap(r, dramaddr_from_lane(base))) != base) {
+		return 1;
+	}
+	for (int k = 0; k < 64; k++) {
+		uint64_t bit = 1ULL << k;
+		if (bit & RANK_LANE_MASK) {
+			mat[k] = bit;
+		} else {
+			mat[k] = base ^ dramaddr_to_lane(
+				ramses_remap(r, dramaddr_from_lane(base ^ bit)));
+		}
+	}
+	return 0;
+}
+
+/* Compute the reverse columns of piece `p' */
+static int invert_piece(struct FusedMap *f, int p)
+{
+	uint64_t rows[64];
+	uint64_t inv[64];
+	physaddr_t used = 0;
+	uint64_t out = 0;
+	int n = 0;
+
+	for (int j = 0; j < 64; j++) {
+		if (f->cols[p][j]) {
+			used |= 1ULL << j;
+			out |= f->cols[p][j];
+		}
+	}
+	n = __builtin_popcountll(used);
+	if (n != __builtin_popcountll(out)) {
+		return 1;
+	}
+	/* rows[i]: which (compressed) PA bits feed output bit i */
+	{
+		int i = 0;
+		for (uint64_t o = out; o; o &= o - 1, i++) {
+			uint64_t row = 0;
+			int c = 0;
+			for (uint64_t u = used; u; u &= u - 1, c++) {
+				row |= ((f->cols[p][__builtin_ctzll(u)] >> __builtin_ctzll(o)) & 1)
+				       << c;
+			}
+			rows[i] = row;
+		}
+	}
+	if (gf2_invert(rows, inv, n)) {
+		return 1;
+	}
+	{
+		int c = 0;
+		for (uint64_t u = used; u; u &= u - 1, c++) {
+			int i = 0;
+			for (uint64_t o = out; o; o &= o - 1, i++) {
+				if ((inv[c] >> i) & 1) {
+					f->icols[p][__builtin_ctzll(o)] |= 1ULL << __builtin_ctzll(u);
+				}
+			}
+		}
+	}
+	for (int i = 0; i < 8; i++) {
+		if ((out >> (8 * i)) & 0xff) {
+			f->rev_bytes |= 1 << i;
+		}
+	}
+	return 0;
+}
+
+static void build_tables(struct FusedMap *f, int npieces)
+{
+	for (int p = 0; p < npieces; p++) {
+		uint64_t *fwd = &f->fwd[(size_t)p * f->nbytes * 256];
+		physaddr_t *rev = &f->rev[(size_t)p * 8 * 256];
+		for (int i = 0; i < f->nbytes; i++) {
+			for (int v = 0; v < 256; v++) {
+				fwd[i * 256 + v] = gf2_apply(f->cols[p], (uint64_t)v << (8 * i));
+			}
+		}
+		for (int i = 0; i < 8; i++) {
+			for (int v = 0; v < 256; v++) {
+				rev[i * 256 + v] = gf2_apply(f->icols[p], (uint64_t)v << (8 * i));
+			}
+		}
+	}
+}
+
+/* Compare fused against interpreted resolution on a sample of addresses */
+static int selfcheck(struct FusedMap *f, struct MemorySystem *m)
+{
+	uint64_t x = 0x9e3779b97f4a7c15ULL;
+	for (int i = 0; i < SELFCHECK_SAMPLES; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		physaddr_t pa = x & f->domain;
+		struct DRAMAddr da = ramses_remap_chain(m->remaps, m->nremaps,
+		                                        ramses_map(&m->mapping, pa));
+		struct DRAMAddr fda = fused_resolve(f, pa);
+		if (dramaddr_to_lane(da) != dramaddr_to_lane(fda) ||
+		    fused_resolve_reverse(f, da) != ramses_map_reverse(&m->mapping,
+		        ramses_remap_chain_reverse(m->remaps, m->nremaps, da)))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+struct FusedMap *fused_build(struct MemorySystem *m)
+{
+	const physaddr_t domain = m->mapping.props.linear_mask;
+	uint64_t mcols[64] = {0};
+	uint64_t rmat[64];
+	struct FusedMap *f;
+	int npieces;
+
+	if (!domain) {
+		return NULL;
+	}
+	for (size_t i = 0; i < m->nremaps; i++) {
+		if (!(m->remaps[i]->flags & REMAP_RANK_LINEAR)) {
+			return NULL;
+		}
+	}
+	for (physaddr_t d = domain; d; d &= d - 1) {
+		int j = __builtin_ctzll(d);
+		mcols[j] = dramaddr_to_lane(ramses_map(&m->mapping, 1ULL << j));
+	}
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL) {
+		return NULL;
+	}
+	f->domain = domain;
+	f->nbytes = (63 - __builtin_clzll(domain)) / 8 + 1;
+	/* Remaps may depend on the rank, so split by rank */
+	if (m->nremaps) {
+		for (int b = 0; b < 8; b++) {
+			physaddr_t rmask = 0;
+			for (int j = 0; j < 64; j++) {
+				rmask |= ((mcols[j] >> (16 + b)) & 1) << j;
+			}
+			if (!rmask) {
+				continue;
+			} else if (b >= FUSE_MAXRANKBITS) {
+				goto err_free;
+			}
+			f->rankmask[b] = rmask;
+			f->rank_bits = b + 1;
+		}
+	}
+	npieces = 1 << f->rank_bits;
+
+	for (int p = 0; p < npieces; p++) {
+		for (int j = 0; j < 64; j++) {
+			f->cols[p][j] = mcols[j];
+		}
+		for (size_t i = 0; i < m->nremaps; i++) {
+			if (remap_matrix(m->remaps[i], p, rmat)) {
+				goto err_free;
+			}
+			for (int j = 0; j < 64; j++) {
+				f->cols[p][j] = gf2_apply(rmat, f->cols[p][j]);
+			}
+		}
+		if (invert_piece(f, p)) {
+			goto err_free;
+		}
+	}
+
+	f->fwd = malloc((size_t)npieces * f->nbytes * 256 * sizeof(*f->fwd));
+	f->rev = malloc((size_t)npieces * 8 * 256 * sizeof(*f->rev));
+	if (f->fwd == NULL || f->rev == NULL) {
+		goto err_free;
+	}
+	build_tables(f, npieces);
+	if (selfcheck(f, m)) {
+		goto err_free;
+	}
+	return f;
+
+	err_free:
+		fused_free(f);
+		return NULL;
+}
+
+void fused_free(struct FusedMap *f)
+{
+	if (f != NULL) {
+		free(f->fwd);
+		free(f->rev);
+		free(f);
+	}
+}
+
+#define ISPOW2(x) ((x) && !((x) & ((x) - 1)))
+
+int fused_range_supported(const struct MappingProps *props, size_t elen)
+{
+	return ISPOW2(elen) && ISPOW2(props->cell_size) &&
+	       ISPOW2(props->col_cnt) && elen >= props->cell_size;
+}
+
+struct RangeCtx {
+	const struct FusedMap *f;
+	int g; /* log2 of entry length */
+	int cbase; /* (row, col) offset bit of one entry */
+	int colbits;
+	struct DRAMRange *out;
+	size_t n;
+};
+
+/* Packed DRAMAddr bit holding bit `p' of the (row, col) offset */
+static inline int rc_lanebit(int p, int colbits)
+{
+	return p < colbits ? 48 + p : 32 + p - colbits;
+}
+
+/*
+ * Emit the DRAM ranges of the aligned block [base, base + 2^k).
+ * Its entries form the affine space L(base) + L(span(F)), F being the PA bits
+ * within the block above the entry length. The subspace W of span(F) mapped
+ * onto consecutive (row, col) offset bits makes up contiguous DRAM runs; every
+ * vector of a complement Q of W starts one such run.
+ */
+static void range_block(struct RangeCtx *c, physaddr_t base, int k)
+{
+	const struct FusedMap *f = c->f;
+	const physaddr_t fmask = LS_BITMASK(k) & ~LS_BITMASK(c->g);
+	physaddr_t w[64];
+	physaddr_t piv[64];
+	physaddr_t pivots = 0;
+	uint64_t wimg = 0;
+	int qbits[64];
+	int nq = 0;
+	int r = 0;
+	int p;
+
+	/* Stick to a single piece */
+	for (int b = 0; b < f->rank_bits; b++) {
+		if (f->rankmask[b] & fmask) {
+			range_block(c, base, k - 1);
+			range_block(c, base | (1ULL << (k - 1)), k - 1);
+			return;
+		}
+	}
+	p = fused_piece(f, base);
+
+	for (; c->cbase + r < c->colbits + 16; r++) {
+		const int lb = rc_lanebit(c->cbase + r, c->colbits);
+		physaddr_t x = f->icols[p][lb];
+		if (!x || (x & ~fmask)) {
+			break;
+		}
+		/* Echelon form; every combination of W keeps one of the pivots */
+		for (int i = 0; i < r; i++) {
+			if (x & piv[i]) {
+				x ^= w[i];
+			}
+		}
+		w[r] = x;
+		piv[r] = x & -x;
+		pivots |= piv[r];
+		wimg |= 1ULL << lb;
+	}
+	for (physaddr_t q = fmask & ~pivots; q; q &= q - 1) {
+		qbits[nq++] = __builtin_ctzll(q);
+	}
+
+	if (c->out == NULL) {
+		c->n += (size_t)1 << nq;
+		return;
+	}
+	for (size_t t = 0, q = 0; t < (size_t)1 << nq; t++) {
+		if (t) {
+			/* Gray code order */
+			q ^= 1ULL << qbits[__builtin_ctzll(t)];
+		}
+		c->out[c->n].start = dramaddr_from_lane(
+			dramaddr_to_lane(fused_resolve(f, base ^ q)) & ~wimg);
+		c->out[c->n].entry_cnt = (size_t)1 << r;
+		c->n++;
+	}
+}
+
+size_t fused_resolve_range(const struct FusedMap *f,
+                           const struct MappingProps *props,
+                           physaddr_t start, size_t len, size_t elen,
+                           struct DRAMRange *out)
+{
+	struct RangeCtx c = {
+		.f = f,
+		.g = __builtin_ctzll(elen),
+		.cbase = __builtin_ctzll(elen / props->cell_size),
+		.colbits = __builtin_ctzll(props->col_cnt),
+		.out = out,
+		.n = 0
+	};
+	const physaddr_t end = start + len;
+
+	for (physaddr_t a = start; a < end;) {
+		int k = 63 - __builtin_clzll(end - a);
+		if (a && __builtin_ctzll(a) < k) {
+			k = __builtin_ctzll(a);
+		}
+		range_block(&c, a, k);
+		a += 1ULL << k;
+	}
+	return c.n;
+}
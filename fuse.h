@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is licensed under the GPL2+.
+ */
+
+/* Fused (map + remap chain) resolution through per-byte lookup tables */
+
+#ifndef RAMSES_FUSE_H
+#define RAMSES_FUSE_H 1
+
+#include <ramses/msys.h>
+
+#include "gf2.h"
+#include "simd.h"
+
+#include <stdint.h>
+
+#define FUSE_MAXRANKBITS 2
+#define FUSE_MAXPIECES (1 << FUSE_MAXRANKBITS)
+
+/*
+ * A memory system whose mapping is GF(2)-linear and whose remaps are linear
+ * per rank resolves as one of up to FUSE_MAXPIECES linear maps, selected by
+ * the rank an address falls in. Each piece is stored as XOR-able per-byte
+ * lookup tables, in both directions, plus its bit matrix.
+ */
+struct FusedMap {
+	physaddr_t domain; /* PA bits taken into account */
+	int nbytes; /* PA bytes spanned by domain */
+	int rank_bits; /* log2 of the number of pieces */
+	physaddr_t rankmask[FUSE_MAXRANKBITS]; /* PA masks of the rank bits */
+	uint8_t rev_bytes; /* Bytes of a packed DRAMAddr used in reverse */
+	uint64_t cols[FUSE_MAXPIECES][64]; /* Packed DRAMAddr image of each PA bit */
+	physaddr_t icols[FUSE_MAXPIECES][64]; /* PA image of each packed DRAMAddr bit */
+	uint64_t *fwd; /* [piece][nbytes][256] */
+	physaddr_t *rev; /* [piece][8][256] */
+};
+
+static inline int fused_piece(const struct FusedMap *f, physaddr_t addr)
+{
+	int p = 0;
+	for (int b = 0; b < f->rank_bits; b++) {
+		p |= gf2_parity(addr & f->rankmask[b]) << b;
+	}
+	return p;
+}
+
+static inline struct DRAMAddr
+fused_resolve(const struct FusedMap *f, physaddr_t addr)
+{
+	const uint64_t *t = &f->fwd[(size_t)fused_piece(f, addr) * f->nbytes * 256];
+	uint64_t d = 0;
+	for (int i = 0; i < f->nbytes; i++, t += 256) {
+		d ^= t[(addr >> (8 * i)) & 0xff];
+	}
+	return dramaddr_from_lane(d);
+}
+
+static inline physaddr_t
+fused_resolve_reverse(const struct FusedMap *f, struct DRAMAddr addr)
+{
+	const int piece = addr.rank & ((1 << f->rank_bits) - 1);
+	const physaddr_t *t = &f->rev[(size_t)piece * 8 * 256];
+	const uint64_t d = dramaddr_to_lane(addr);
+	physaddr_t ret = 0;
+	for (int i = 0; i < 8; i++, t += 256) {
+		if ((f->rev_bytes >> i) & 1) {
+			ret ^= t[(d >> (8 * i)) & 0xff];
+		}
+	}
+	return ret;
+}
+
+/*
+ * Compile the mapping and remaps of `m' into a FusedMap.
+ * Returns NULL if `m' cannot be fused or memory could not be allocated.
+ */
+struct FusedMap *fused_build(struct MemorySystem *m);
+void fused_free(struct FusedMap *f);
+
+/* Whether fused_resolve_range can split ranges into entries of size `elen' */
+int fused_range_supported(const struct MappingProps *props, size_t elen);
+/* Analytic counterpart of ramses_resolve_range; ranges are left unsorted */
+size_t fused_resolve_range(const struct FusedMap *f,
+                           const struct MappingProps *props,
+                           physaddr_t start, size_t len, size_t elen,
+                           struct DRAMRange *out);
+
+#endif /* fuse.h */
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "gf2.h"
+
+int gf2_invert(const uint64_t *m, uint64_t *inv, int n)
+{
+	uint64_t a[64];
+	if (n < 0 || n > 64) {
+		return 1;
+	}
+	for (int i = 0; i < n; i++) {
+		a[i] = m[i];
+		inv[i] = 1ULL << i;
+	}
+	/* Gauss-Jordan elimination on [a | inv] */
+	for (int c = 0; c < n; c++) {
+		int p = c;
+		while (p < n && !((a[p] >> c) & 1)) {
+			p++;
+		}
+		if (p == n) {
+			return 1;
+		}
+		if (p != c) {
+			uint64_t t = a[p]; a[p] = a[c]; a[c] = t;
+			t = inv[p]; inv[p] = inv[c]; inv[c] = t;
+		}
+		for (int r = 0; r < n; r++) {
+			if (r != c && ((a[r] >> c) & 1)) {
+				a[r] ^= a[c];
+				inv[r] ^= inv[c];
+			}
+		}
+	}
+	return 0;
+}
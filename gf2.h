@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is licensed under the GPL2+.
+ */
+
+/* Linear algebra over GF(2) on bit matrices of up to 64x64 */
+
+#ifndef RAMSES_GF2_H
+#define RAMSES_GF2_H 1
+
+#include <stdint.h>
+
+static inline int gf2_parity(uint64_t v)
+{
+	return __builtin_parityll(v);
+}
+
+/*
+ * Gather the bits of `v' selected by `mask' into the low bits of the result,
+ * preserving their order.
+ */
+static inline uint64_t gf2_compress(uint64_t v, uint64_t mask)
+{
+	uint64_t ret = 0;
+	int k = 0;
+	for (; mask; mask &= mask - 1, k++) {
+		ret |= ((v >> __builtin_ctzll(mask)) & 1) << k;
+	}
+	return ret;
+}
+
+/* Multiply vector `v' by the matrix stored as columns `cols' */
+static inline uint64_t gf2_apply(const uint64_t *cols, uint64_t v)
+{
+	uint64_t ret = 0;
+	for (; v; v &= v - 1) {
+		ret ^= cols[__builtin_ctzll(v)];
+	}
+	return ret;
+}
+
+/*
+ * Invert the `n'x`n' matrix `m', stored as one row per element with column j
+ * in bit j, into `inv'.
+ * Returns 0 on success, nonzero if the matrix is singular.
+ */
+int gf2_invert(const uint64_t *m, uint64_t *inv, int n);
+
+#endif /* gf2.h */
@@ -27,15 +27,51 @@
 #include <stddef.h>
 #include <stdint.h>
 
-/* Page Table Entry */
+/* Page Table Entry, for a run of pages contiguous in both address spaces */
 struct PTE {
 	physaddr_t pa;
 	uintptr_t va;
+	size_t npages;
 };
-/* Range of contiguous DRAM area */
-struct DRAMRange {
-	struct DRAMAddr start;
-	size_t entry_cnt;
+/* DRAM ranges of a BufferMap falling in one bank */
+struct BankSpan {
+	uint32_t key; /* Top half of the ramses_dramaddr_key of the bank */
+	uint16_t row_min;
+	uint16_t row_max;
+	size_t first; /* First and last (inclusive) range index */
+	size_t last;
+};
+/* Per-bank directory of a BufferMap, for constant-time bank lookups */
+struct BankDir {
+	struct BankSpan *banks; /* In range order */
+	size_t bank_cnt;
+	size_t *lut; /* Dense (chan, dimm, rank, bank) -> first bank at or above; may be NULL */
+	unsigned int dim[4]; /* Extent of chan, dimm, rank and bank in `lut' */
+};
+/* Search index over the start addresses of the DRAM ranges of a BufferMap */
+struct RangeIndex {
+	uint64_t *keys; /* Range start keys of each bank in Eytzinger order, those of
+	                   bank b from keys[banks[b].first + b + 1]; NULL if not built */
+	size_t *ranks; /* Index of each key among the ranges of its bank */
+};
+/* Rows of each bank present in a BufferMap, as bitsets with rank support */
+struct RowIndex {
+	uint64_t *bits; /* One bit per row from each bank's row_min on; NULL if not built */
+	size_t *rank; /* Rows of its bank present before each word of `bits' */
+	size_t *bank_word; /* First word of each bank in `bits', and the total */
+	size_t *bank_row; /* Rows present before each bank, and the total */
+	struct BMPos *rowpos; /* First entry of each present row, in DRAM order, with
+	                         `ri' counted from the first range of its bank */
+};
+/* Virtual address index of the PTEs of a BufferMap */
+struct VAIndex {
+	uintptr_t base; /* Lowest page VA */
+	physaddr_t *pa; /* Dense: PA of each page from `base' on, RAMSES_BADADDR for
+	                   holes. Only while the buffer is so fragmented that this
+	                   costs little extra; else NULL */
+	struct PTE *ext; /* Sparse: the extents of the buffer in VA order, or NULL */
+	size_t len;
+	int dense;
 };
 /*
  * Structure maintaining a mapping between a buffer in virtual memory and the
@@ -43,13 +79,20 @@ struct DRAMRange {
  */
 struct BufferMap {
 	void *bufbase; /* Pointer to VM buffer */
-	struct PTE *ptes; /* virt<->phys mapping of the buffer */
-	size_t pte_cnt;
+	struct PTE *ptes; /* virt<->phys mapping of the buffer, sorted by PA */
+	size_t pte_cnt; /* Number of extents in `ptes' */
 	size_t page_size;
 	struct DRAMRange *ranges; /* DRAM ranges spanned by the buffer, in order */
 	size_t range_cnt;
 	size_t entry_len; /* Max memory size contiguous in both phys and DRAM address spaces */
 	struct MemorySystem *msys;
+	struct Translation trans; /* For pages added with ramses_bufmap_extend */
+	struct BankDir bankdir;
+	struct RangeIndex rindex;
+	struct VAIndex vaindex;
+	struct RowIndex rowidx;
+	void *snapshot; /* Read-only mapping holding `ptes' and `ranges', or NULL */
+	size_t snapshot_len;
 };
 /* virt<->DRAM address mapping for a particular entry */
 struct AddrEntry {
@@ -65,20 +108,120 @@ struct BMPos {
 	size_t ei; /* entry index */
 };
 
+/* Cursor walking the entries of a BufferMap in DRAM order */
+struct BMIter {
+	struct BufferMap *bm;
+	struct BMPos pos; /* Next entry to produce */
+	struct BMPos end;
+	struct DRAMAddr da; /* DRAM address of `pos' */
+	physaddr_t pa; /* Physical address of `pos', or RAMSES_BADADDR if not known */
+	size_t pte; /* PTE index of the last entry produced */
+};
+
+#define BMSTATS_HIST_LEN 24
+/* Summary of how well a BufferMap covers DRAM, from ramses_bufmap_stats */
+struct BMStats {
+	size_t entries; /* Entries of `entry_len' bytes in all ranges */
+	size_t pages;
+	size_t pte_cnt; /* Extents contiguous in both address spaces */
+	size_t pte_max_pages; /* Pages in the longest extent */
+	size_t phys_runs; /* Runs of extents contiguous in physical memory */
+	size_t range_cnt;
+	size_t range_max; /* Entries in the longest range */
+	size_t range_hist[BMSTATS_HIST_LEN]; /* Ranges of [2^i, 2^(i+1)) entries; the last bucket takes all longer */
+	size_t bank_cnt; /* Banks with any part in the BufferMap */
+	size_t bank_rows_min; /* Fewest and most rows with any part in one bank */
+	size_t bank_rows_max;
+	size_t rows; /* Rows with any part in the BufferMap */
+	size_t rows_full; /* Rows entirely in the BufferMap */
+	size_t rows_partial;
+	size_t triples; /* Full rows with full rows either side, as for ramses_bufmap_triples */
+};
+
+/*
+ * Three vertically adjacent rows in one bank, all of them fully mapped by a
+ * BufferMap: a victim row and the aggressor rows either side of it.
+ */
+struct RowTriple {
+	struct DRAMAddr victim; /* Column 0 of the victim row */
+	struct BMPos lo; /* First entry of the row below the victim */
+	struct BMPos mid; /* First entry of the victim row */
+	struct BMPos hi; /* First entry of the row above the victim */
+};
+
+/* Callback for ramses_bufmap_triples; returning non-zero stops enumeration */
+typedef int (*ramses_triple_fn_t)(const struct RowTriple *t, void *arg);
+
 #define BUFMAP_NOCLOBBER	1 /* Do NOT use the buffer for scratch data */
 #define BUFMAP_ZEROFILL 	2 /* Zero out buffer after using for scratch data */
+#define BUFMAP_SEARCHIDX	4 /* Keep a cache-friendly index for ramses_bufmap_find */
+#define BUFMAP_ROWIDX   	8 /* Keep a bitset of the rows of each bank, for O(1) row queries */
 /*
  * Set up a BufferMap structure for a buffer `buf' of size `len', using `trans'
  * for virtual->physical address translation, and `msys' to describe the memory
  * system in use.
- * Possible flags are BUFMAP_NOCLOBBER and BUFMAP_ZEROFILL.
+ * Possible flags are BUFMAP_NOCLOBBER, BUFMAP_ZEROFILL, BUFMAP_SEARCHIDX and
+ * BUFMAP_ROWIDX.
  */
 int ramses_bufmap(struct BufferMap *bm, void *buf, size_t len,
                   struct Translation *trans, struct MemorySystem *msys,
                   int flags);
+/*
+ * Like ramses_bufmap, splitting address translation, resolution, sorting and
+ * coalescing across `nthreads' threads. The resulting BufferMap is identical.
+ * `trans' must be safe to call concurrently.
+ */
+int ramses_bufmap_parallel(struct BufferMap *bm, void *buf, size_t len,
+                           struct Translation *trans, struct MemorySystem *msys,
+                           int flags, int nthreads);
 /* Free BufferMap data structures allocated by ramses_bufmap */
 void ramses_bufmap_free(struct BufferMap *bm);
 
+/*
+ * Add the pages spanned by [buf, buf + len) to BufferMap `bm', merging them
+ * into its sorted PTEs and DRAM ranges in place. Only the new pages are
+ * translated and resolved, and only the index entries of the banks they fall
+ * in are rebuilt.
+ * Returns 0 on success; on failure returns 1 and leaves `bm' untouched, with
+ * errno set to EINVAL if any of the pages already is part of `bm'.
+ */
+int ramses_bufmap_extend(struct BufferMap *bm, void *buf, size_t len);
+/*
+ * Remove the pages spanned by [addr, addr + len) from BufferMap `bm',
+ * splitting its DRAM ranges as needed. As with ramses_bufmap_extend, only
+ * the index entries of the banks the pages fall in are rebuilt.
+ * Returns 0 on success; on failure returns 1 and leaves `bm' untouched, with
+ * errno set to EINVAL if no pages would be left.
+ */
+int ramses_bufmap_remove(struct BufferMap *bm, void *addr, size_t len);
+
+#define BUFMAP_SNAP_VERSION 1
+/* PTEs checked against the translator when loading a snapshot */
+#define BUFMAP_SNAP_SAMPLES 32
+/*
+ * Write the PTEs and DRAM ranges of BufferMap `bm' to file descriptor `fd' in
+ * a binary snapshot format, along with `msys_str', the string `bm->msys' was
+ * loaded from.
+ * Returns 0 on success, 1 on failure with errno set.
+ */
+int ramses_bufmap_save(struct BufferMap *bm, const char *msys_str, int fd);
+/*
+ * Set up BufferMap `bm' from a snapshot written by ramses_bufmap_save to `fd',
+ * mapping its PTEs and ranges read-only instead of copying them, so that
+ * several processes can share them. The buffer must be mapped at the same
+ * virtual address as when the snapshot was taken.
+ * `msys' must have been loaded from the same string as when saving; if
+ * `msys_str' is not NULL, it is compared against the saved one. A sample of
+ * BUFMAP_SNAP_SAMPLES PTEs is checked against `trans' before the snapshot is
+ * trusted. The only flags honoured are BUFMAP_SEARCHIDX and BUFMAP_ROWIDX.
+ * Returns 0 on success. On failure returns 1 and sets errno, to EINVAL for a
+ * malformed or mismatching snapshot and ESTALE if the sampled PTEs no longer
+ * agree with `trans'.
+ */
+int ramses_bufmap_load_mmap(struct BufferMap *bm, int fd,
+                            struct Translation *trans, struct MemorySystem *msys,
+                            const char *msys_str, int flags);
+
 /* Compute the DRAM address of an entry in a BufferMap */
 struct DRAMAddr ramses_bufmap_addr(struct BufferMap *bm, size_t ri, size_t ei);
 /* Compute the position of the next DRAM level boundary following `p' */
@@ -99,14 +242,24 @@ size_t ramses_bufmap_entrycnt(struct BufferMap *bm,
  */
 int ramses_bufmap_find(struct BufferMap *bm, struct DRAMAddr addr, struct BMPos *pos);
 /*
- * Find the appropriate PTE index within BufferMap `bm' for phys address `pa'.
+ * Find the index of the PTE within BufferMap `bm' mapping phys address `pa'.
  * If successful, returns 0  and sets *ptepos to the appropriate index.
  * Else, returns 1 and *ptepos is untouched.
  * `pos', if NULL will be ignored.
  */
 int ramses_bufmap_find_pte(struct BufferMap *bm, physaddr_t pa, size_t *ptepos);
+/*
+ * Find the entry of BufferMap `bm' containing virtual address `va'.
+ * If successful, returns 0, sets *pos to the position of the entry and
+ * *dramaddr to the DRAM address of `va' itself.
+ * Else, returns 1 and *pos and *dramaddr are untouched.
+ * `pos' and `dramaddr', if NULL, will be ignored.
+ */
+int ramses_bufmap_find_va(struct BufferMap *bm, uintptr_t va, struct BMPos *pos,
+                          struct DRAMAddr *dramaddr);
 /*
  * Find an entry with DRAM address on the same DRAM level `lvl' as `addr'.
+ * For DRAM_BANK and up, this is the first such entry.
  * If successful, returns 0 and sets *pos to the position of the found item.
  * Else, returns 1 and *pos is untouched.
  * `pos', if NULL will be ignored.
@@ -114,6 +267,43 @@ int ramses_bufmap_find_pte(struct BufferMap *bm, physaddr_t pa, size_t *ptepos);
 int ramses_bufmap_find_same(struct BufferMap *bm, struct DRAMAddr addr,
                             enum DRAMLevel lvl, struct BMPos *pos);
 
+/*
+ * Whether any part of the row of `addr', in its bank, is in BufferMap `bm'.
+ * Constant time with BUFMAP_ROWIDX.
+ */
+int ramses_bufmap_has_row(struct BufferMap *bm, struct DRAMAddr addr);
+/*
+ * Look up the rows `dist' rows below and above that of `addr', in its bank.
+ * Sets out[0] and out[1] to the position of an entry of each (the first one
+ * with BUFMAP_ROWIDX) if present in BufferMap `bm'.
+ * Returns a mask with bit 0 set if the lower row is present and bit 1 if the
+ * upper one is. Constant time with BUFMAP_ROWIDX.
+ */
+unsigned int ramses_bufmap_neighbors(struct BufferMap *bm, struct DRAMAddr addr,
+                                     unsigned int dist, struct BMPos out[2]);
+/*
+ * Number of rows of the bank of `addr' with any part in BufferMap `bm'.
+ * Constant time with BUFMAP_ROWIDX.
+ */
+size_t ramses_bufmap_bank_rows(struct BufferMap *bm, struct DRAMAddr addr);
+
+/*
+ * Compute coverage and fragmentation statistics of BufferMap `bm' into `*out',
+ * in one pass over its ranges and one over its PTEs.
+ */
+void ramses_bufmap_stats(struct BufferMap *bm, struct BMStats *out);
+
+/*
+ * Call `fn' on every RowTriple of BufferMap `bm', in DRAM order, passing `arg'
+ * along, in a single pass over its ranges. Rows are those of the DRAM
+ * addresses in `bm', i.e. after any remapping (such as rank mirroring) done
+ * by its memory system. Each row of a triple is `ramses_bufmap_epr(bm)'
+ * entries long, starting at the given position.
+ * Returns the number of triples passed to `fn'.
+ */
+size_t ramses_bufmap_triples(struct BufferMap *bm, ramses_triple_fn_t fn,
+                             void *arg);
+
 /*
  * Write out an AddrEntry corresponding to the memory area of size
  * `bm->entry_len' at position `bp' in BufferMap `bm'.
@@ -129,6 +319,22 @@ size_t ramses_bufmap_get_entries(struct BufferMap *bm,
                                  struct BMPos start, struct BMPos end,
                                  struct AddrEntry *entries, size_t maxents);
 
+/*
+ * Start iterating over the entries of BufferMap `bm' from `start' up to (not
+ * including) `end'. Consecutive entries reuse the PTE of the previous one
+ * where possible, making this cheaper than repeated ramses_bufmap_get_entry.
+ * With a fused memory system (see MSYS_FUSE), the physical address is only
+ * resolved at the start of each range and advanced from there on; otherwise
+ * it is resolved for every entry.
+ */
+void ramses_bufmap_iter_init(struct BMIter *it, struct BufferMap *bm,
+                             struct BMPos start, struct BMPos end);
+/*
+ * Write out the next entry of iterator `it' into `*entry' and advance.
+ * Returns 0 on success, 1 when past the end.
+ */
+int ramses_bufmap_iter_next(struct BMIter *it, struct AddrEntry *entry);
+
 /* Row length, in bytes, of a BufferMap */
 static inline size_t ramses_bufmap_rowlen(struct BufferMap *bm)
 {
@@ -14,18 +14,26 @@
 typedef struct DRAMAddr (*ramses_map_fn_t)(physaddr_t, int, void *);
 typedef physaddr_t (*ramses_map_reverse_fn_t)(struct DRAMAddr, int, void *);
 typedef size_t (*ramses_map_twiddle_gran_fn_t)(struct DRAMAddr, int, void *);
+typedef void (*ramses_map_batch_fn_t)(const physaddr_t *, struct DRAMAddr *,
+                                      size_t, int, void *);
+typedef void (*ramses_map_reverse_batch_fn_t)(const struct DRAMAddr *,
+                                              physaddr_t *, size_t, int, void *);
 
 struct MappingProps {
 	physaddr_t granularity;
 	unsigned int bank_cnt;
 	unsigned int col_cnt;
 	unsigned int cell_size;
+	physaddr_t linear_mask; /* PA bits the map is GF(2)-linear in; 0 if not linear */
 };
 
 struct Mapping {
 	ramses_map_fn_t map;
 	ramses_map_reverse_fn_t map_reverse;
 	ramses_map_twiddle_gran_fn_t twiddle_gran;
+	/* Optional array versions of map/map_reverse; NULL if not provided */
+	ramses_map_batch_fn_t map_batch;
+	ramses_map_reverse_batch_fn_t map_reverse_batch;
 	int flags;
 	void *arg;
 	struct MappingProps props;
@@ -47,4 +55,44 @@ static inline size_t ramses_map_twiddle_gran(struct Mapping *m, struct DRAMAddr
 	return m->twiddle_gran(mask, m->flags, m->arg);
 }
 
+static inline void ramses_map_batch(struct Mapping *m, const physaddr_t *in,
+                                    struct DRAMAddr *out, size_t n)
+{
+	if (m->map_batch != NULL) {
+		m->map_batch(in, out, n, m->flags, m->arg);
+		return;
+	}
+	for (size_t i = 0; i < n; i++) {
+		out[i] = m->map(in[i], m->flags, m->arg);
+	}
+}
+
+static inline void ramses_map_reverse_batch(struct Mapping *m,
+                                            const struct DRAMAddr *in,
+                                            physaddr_t *out, size_t n)
+{
+	if (m->map_reverse_batch != NULL) {
+		m->map_reverse_batch(in, out, n, m->flags, m->arg);
+		return;
+	}
+	for (size_t i = 0; i < n; i++) {
+		out[i] = m->map_reverse(in[i], m->flags, m->arg);
+	}
+}
+
+/* Vector extensions batch kernels may use, narrowest first */
+enum SIMDLevel {
+	SIMD_LEVEL_SCALAR,
+	SIMD_LEVEL_AVX2,
+	SIMD_LEVEL_AVX512
+};
+
+/*
+ * Keep the batch kernels of mappings set up from now on from using vector
+ * extensions wider than `cap', e.g. to test narrower kernels on wide CPUs.
+ * Extensions the CPU lacks are never used either way.
+ * Returns the previous cap, initially SIMD_LEVEL_AVX512.
+ */
+enum SIMDLevel ramses_simd_cap(enum SIMDLevel cap);
+
 #endif /* map.h */
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is licensed under the GPL2+.
+ */
+
+#ifndef RAMSES_MAP_XOR_H
+#define RAMSES_MAP_XOR_H 1
+
+#include <ramses/map.h>
+
+#include <stdint.h>
+
+#define XORMAP_MAXFUNCS 64
+
+/*
+ * Mapping where every DRAM address bit is the parity (XOR) of the physical
+ * address bits selected by a mask, as reverse-engineered by e.g. DRAMA.
+ * Masks are listed least significant bit first.
+ */
+struct XORMapOpts {
+	physaddr_t chan[8];
+	physaddr_t dimm[8];
+	physaddr_t rank[8];
+	physaddr_t bank[8];
+	physaddr_t row[16];
+	physaddr_t col[16];
+	int chan_bits;
+	int dimm_bits;
+	int rank_bits;
+	int bank_bits;
+	int row_bits;
+	int col_bits;
+	/* Set up by ramses_map_xor() */
+	int nfuncs;
+	physaddr_t fmask[XORMAP_MAXFUNCS]; /* PA mask of each DRAM bit */
+	uint8_t fbit[XORMAP_MAXFUNCS]; /* Bit position in a packed DRAMAddr */
+	physaddr_t domain; /* PA bits taken into account */
+	uint64_t inv[XORMAP_MAXFUNCS]; /* Inverse, one packed DRAMAddr mask per PA bit */
+};
+
+/*
+ * Set up `m' as an XOR mapping described by `o'.
+ * The masks must together cover a contiguous range of physical address bits,
+ * one DRAM bit per physical bit, and form an invertible matrix.
+ * Returns 0 on success, nonzero if the masks do not describe a bijection.
+ */
+int ramses_map_xor(struct Mapping *m, struct XORMapOpts *o);
+
+#endif /* xor.h */
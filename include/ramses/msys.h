@@ -10,12 +10,23 @@
 #include <ramses/map.h>
 #include <ramses/remap.h>
 
+struct FusedMap;
+struct JITMap;
+
+/* Range of contiguous DRAM area */
+struct DRAMRange {
+	struct DRAMAddr start;
+	size_t entry_cnt;
+};
+
 struct MemorySystem {
 	struct Mapping mapping;
 	size_t nremaps;
 	struct Remapping **remaps;
 	size_t nallocs;
 	void **allocs;
+	struct FusedMap *fused; /* Mapping and remaps compiled together, or NULL */
+	struct JITMap *jit; /* Native code for `fused', or NULL */
 };
 
 size_t ramses_msys_granularity(struct MemorySystem *m, size_t pagesz);
@@ -24,7 +35,93 @@ struct DRAMAddr ramses_resolve(struct MemorySystem *m, physaddr_t addr);
 
 physaddr_t ramses_resolve_reverse(struct MemorySystem *m, struct DRAMAddr addr);
 
+/*
+ * Resolve `n' physical addresses from `in' into DRAM addresses in `out'.
+ * Equivalent to calling ramses_resolve() on each element, but runs every
+ * mapping stage over a block of addresses at a time.
+ */
+void ramses_resolve_batch(struct MemorySystem *m, const physaddr_t *in,
+                          struct DRAMAddr *out, size_t n);
+/* Batch counterpart of ramses_resolve_reverse() */
+void ramses_resolve_reverse_batch(struct MemorySystem *m,
+                                  const struct DRAMAddr *in,
+                                  physaddr_t *out, size_t n);
+
+/*
+ * Resolve the physical range [start, start + len) into the DRAM ranges it
+ * covers, made up of entries of size `elen' (see ramses_msys_granularity).
+ * `start' and `len' must be multiples of `elen'.
+ * Writes the ranges, sorted and coalesced, into `out' and returns their count.
+ * If `out' is NULL, returns an upper bound on the number of ranges instead,
+ * which never exceeds `len / elen'.
+ * Fused memory systems are resolved directly from the structure of the
+ * mapping, without visiting every entry.
+ */
+size_t ramses_resolve_range(struct MemorySystem *m, physaddr_t start,
+                            size_t len, size_t elen, struct DRAMRange *out);
+/*
+ * Sort the `n' ranges in `r', made up of entries of size `elen', merging
+ * those contiguous in DRAM. Returns the resulting number of ranges.
+ */
+size_t ramses_dramrange_coalesce(struct MemorySystem *m, struct DRAMRange *r,
+                                 size_t n, size_t elen);
+
+/* Physical address range [start, end) */
+struct PhysRange {
+	physaddr_t start;
+	physaddr_t end;
+};
+
+/* First address on which ramses_msys_verify() found a memory system wrong */
+struct MSYSVerifyFail {
+	physaddr_t addr;
+	struct DRAMAddr da; /* What `addr' resolved to */
+	physaddr_t pa; /* What `da' resolved back to */
+	/*
+	 * 0 if the round trip failed; otherwise the path that disagreed with the
+	 * batch kernels: MSYS_VERIFY_SCALAR, MSYS_FUSE or MSYS_JIT
+	 */
+	int form;
+};
+
+#define MSYS_VERIFY_SCALAR 4
+#define MSYS_VERIFY_MAX_THREADS 64
+/*
+ * One in this many addresses is also resolved one at a time; being odd, the
+ * sample covers every lane of the vector kernels
+ */
+#define MSYS_VERIFY_SCALAR_STRIDE 31
+
+/*
+ * Check that `m' resolves every address in `ranges' to a DRAM address that
+ * resolves back to it, stepping by ramses_msys_granularity(m, pagesz).
+ * Resolution goes through the batch kernels, whose results are checked in
+ * both directions against per-address resolution of a sample of addresses
+ * (see MSYS_VERIFY_SCALAR_STRIDE). If `m' is compiled, its fused and native
+ * forms are also checked against the interpreted translation.
+ * Work is split across up to `nthreads' threads.
+ * Returns 0 if all addresses check out; otherwise returns 1 and, unless
+ * `fail' is NULL, describes the first failing address (in range order) there.
+ */
+int ramses_msys_verify(struct MemorySystem *m, const struct PhysRange *ranges,
+                       size_t nranges, size_t pagesz, int nthreads,
+                       struct MSYSVerifyFail *fail);
+
+#define MSYS_FUSE 1 /* Compile mapping and remaps into lookup tables if possible */
+#define MSYS_JIT 2 /* Also compile them to native code if possible; implies MSYS_FUSE */
+
 int ramses_msys_load(const char *str, struct MemorySystem *m, size_t *erridx);
+/*
+ * Like ramses_msys_load, with `flags' controlling post-processing of the
+ * loaded memory system.
+ * With MSYS_FUSE, a linear mapping and its remaps are fused into a single
+ * table-driven translation, giving results identical to the interpreted path.
+ * With MSYS_JIT, the fused form is further translated to machine code.
+ * Memory systems that cannot be fused or compiled are silently left as they
+ * are.
+ */
+int ramses_msys_load_flags(const char *str, struct MemorySystem *m,
+                           size_t *erridx, int flags);
 const char *ramses_msys_load_strerr(int err);
 
 void ramses_msys_free(struct MemorySystem *m);
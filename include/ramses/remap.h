@@ -18,11 +18,18 @@ union RemapArg {
 
 typedef struct DRAMAddr (*ramses_remap_fn_t)(struct DRAMAddr, union RemapArg);
 
+/*
+ * Remapping is GF(2)-linear in the address bits for every fixed rank and
+ * leaves the rank unchanged; allows fusing it into a linear mapping.
+ */
+#define REMAP_RANK_LINEAR 1
+
 struct Remapping {
 	ramses_remap_fn_t remap;
 	ramses_remap_fn_t remap_reverse;
 	union RemapArg arg;
 	struct DRAMAddr gran;
+	int flags;
 };
 
 static inline struct DRAMAddr
@@ -55,6 +62,23 @@ ramses_remap_chain_reverse(struct Remapping *r[], size_t nremaps, struct DRAMAdd
 	return addr;
 }
 
+/* Apply remapping `r' in place to an array of `n' DRAM addresses */
+static inline void
+ramses_remap_batch(struct Remapping *r, struct DRAMAddr *addrs, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		addrs[i] = r->remap(addrs[i], r->arg);
+	}
+}
+
+static inline void
+ramses_remap_reverse_batch(struct Remapping *r, struct DRAMAddr *addrs, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		addrs[i] = r->remap_reverse(addrs[i], r->arg);
+	}
+}
+
 
 extern struct Remapping RAMSES_REMAP_RANKMIRROR_DDR3;
 extern struct Remapping RAMSES_REMAP_RANKMIRROR_DDR4;
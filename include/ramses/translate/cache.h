@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is licensed under the GPL2+.
+ */
+
+/* Caching wrapper around another Translation (a software TLB) */
+
+#ifndef RAMSES_TRANSLATE_CACHE_H
+#define RAMSES_TRANSLATE_CACHE_H 1
+
+#include <ramses/translate.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRANSCACHE_WAYS 4
+#define TRANSCACHE_MAX_READAHEAD 512
+
+struct TransCacheEntry {
+	uintptr_t vpage; /* UINTPTR_MAX if unused */
+	physaddr_t pa;
+	uint64_t stamp; /* Last use, for LRU replacement within a set */
+};
+
+struct TransCacheStats {
+	uint64_t lookups;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t backend_calls; /* Calls into the wrapped translator */
+	uint64_t backend_pages; /* Pages fetched from it */
+	uint64_t invalidations;
+};
+
+struct TransCache {
+	struct Translation backend;
+	struct TransCacheEntry *entries; /* nsets sets of TRANSCACHE_WAYS ways */
+	size_t nsets;
+	size_t readahead; /* Pages fetched per miss, a power of two */
+	uint64_t clock;
+	struct TransCacheStats stats;
+};
+
+/*
+ * Set up `c' to cache translations of `backend', holding at least `entries'
+ * pages and fetching an aligned window of `readahead' pages (rounded to a
+ * power of two, at most TRANSCACHE_MAX_READAHEAD) on each miss.
+ * Returns 0 on success or 1 if memory could not be allocated.
+ *
+ * Range translations take cached pages from the cache and fetch each run of
+ * uncached pages from `backend' in one call, caching the results.
+ * Pages not mapped in memory are never cached.
+ * A TransCache must not be used from several threads at once.
+ */
+int ramses_translate_cache_init(struct TransCache *c,
+                                const struct Translation *backend,
+                                size_t entries, size_t readahead);
+
+/*
+ * Make `t' a translator that goes through cache `c'.
+ * `c' has to outlive any use of `t'.
+ */
+void ramses_translate_cache(struct Translation *t, struct TransCache *c);
+
+/* Drop cached translations of the pages overlapping [addr, addr + len) */
+void ramses_translate_cache_invalidate(struct TransCache *c,
+                                       uintptr_t addr, size_t len);
+
+/* Drop all cached translations */
+void ramses_translate_cache_flush(struct TransCache *c);
+
+/* Copy out the counters of `c'; reset them as well if `reset' is set */
+void ramses_translate_cache_stats(struct TransCache *c,
+                                  struct TransCacheStats *out, int reset);
+
+void ramses_translate_cache_free(struct TransCache *c);
+
+#endif /* translate/cache.h */
@@ -9,6 +9,20 @@
 
 #include <ramses/translate.h>
 
+#include <stddef.h>
+
 void ramses_translate_pagemap(struct Translation *t, int pagemap_fd);
+/*
+ * Like ramses_translate_pagemap, but for buffer [buf, buf + len) of the
+ * calling process: translate at the size of the pages actually backing it.
+ * That is its hugetlbfs page size, or 2MB if every 2MB page of it maps onto
+ * an aligned, physically contiguous 2MB frame (as transparent huge pages do),
+ * checked through the pagemap entries of all of its base pages; or the base
+ * page size otherwise.
+ * The buffer must be populated. Returns 0 on success, 1 if smaps could not be
+ * read, in which case `t' still translates at the base page size.
+ */
+int ramses_translate_pagemap_huge(struct Translation *t, int pagemap_fd,
+                                  void *buf, size_t len);
 
 #endif /* translate_pagemap.h */
@@ -13,6 +13,7 @@
 #include <ramses/types.h>
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /* For use in printf()-like functions */
 #define DRAMADDR_HEX_FMTSTR "(%1x %1x %1x %1x %4x %3x)"
@@ -25,30 +26,46 @@ enum DRAMLevel {
 	DRAM_DIMM,
 	DRAM_CHAN
 };
+/*
+ * Pack a DRAM address into an integer key; keys order like DRAM addresses,
+ * from channel down to column.
+ */
+static inline uint64_t ramses_dramaddr_key(struct DRAMAddr a)
+{
+	return ((uint64_t)a.chan << 56) | ((uint64_t)a.dimm << 48) |
+	       ((uint64_t)a.rank << 40) | ((uint64_t)a.bank << 32) |
+	       ((uint64_t)a.row << 16) | a.col;
+}
+/* Inverse of ramses_dramaddr_key */
+static inline struct DRAMAddr ramses_dramaddr_from_key(uint64_t k)
+{
+	return (struct DRAMAddr){
+		.chan = k >> 56, .dimm = k >> 48, .rank = k >> 40,
+		.bank = k >> 32, .row = k >> 16, .col = k
+	};
+}
+/* Key bits identifying a location on DRAM level `lvl' */
+static inline uint64_t ramses_dramlevel_keymask(enum DRAMLevel lvl)
+{
+	static const uint8_t shift[] = {
+		[DRAM_ROW] = 16, [DRAM_BANK] = 32, [DRAM_RANK] = 40,
+		[DRAM_DIMM] = 48, [DRAM_CHAN] = 56
+	};
+	return ~0ULL << shift[lvl];
+}
 /* Check whether two DRAM addresses are on the same DRAM level */
 static inline bool ramses_dramaddr_same(enum DRAMLevel lvl,
                                         struct DRAMAddr a, struct DRAMAddr b)
 {
-	bool ret = true;
-	switch (lvl) {
-		case DRAM_ROW:  ret = ret && (a.row == b.row);
-		case DRAM_BANK: ret = ret && (a.bank == b.bank);
-		case DRAM_RANK: ret = ret && (a.rank == b.rank);
-		case DRAM_DIMM: ret = ret && (a.dimm == b.dimm);
-		case DRAM_CHAN: ret = ret && (a.chan == b.chan);
-	}
-	return ret;
+	return !((ramses_dramaddr_key(a) ^ ramses_dramaddr_key(b)) &
+	         ramses_dramlevel_keymask(lvl));
 }
 /* qsort()-like comparison function for DRAM addresses */
 static inline int ramses_dramaddr_cmp(struct DRAMAddr a, struct DRAMAddr b)
 {
-	int ch = a.chan - b.chan;
-	int di = a.dimm - b.dimm;
-	int ra = a.rank - b.rank;
-	int ba = a.bank - b.bank;
-	int rw = a.row - b.row;
-	int cl = a.col - b.col;
-	return !ch ? !di ? !ra ? !ba ? !rw ? cl : rw : ba : ra : di : ch;
+	uint64_t ka = ramses_dramaddr_key(a);
+	uint64_t kb = ramses_dramaddr_key(b);
+	return (ka > kb) - (ka < kb);
 }
 
 #endif /* util.h */
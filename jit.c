@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+
+#include <sys/mman.h>
+
+#define JIT_MAXCODE 0x10000
+#define SELFCHECK_SAMPLES 4096
+
+/*
+ * Generated functions follow the SysV ABI: input in rdi, result in rax.
+ * rcx and rdx are used as scratch.
+ */
+struct Emitter {
+	uint8_t *buf;
+	size_t pos;
+	int err;
+	int bmi2;
+};
+
+static void emit(struct Emitter *e, const uint8_t *b, size_t n)
+{
+	if (e->pos + n > JIT_MAXCODE) {
+		e->err = 1;
+		return;
+	}
+	memcpy(&e->buf[e->pos], b, n);
+	e->pos += n;
+}
+
+#define EMIT(e, ...) do { \
+	const uint8_t _b[] = {__VA_ARGS__}; \
+	emit((e), _b, sizeof(_b)); \
+} while (0)
+
+static void emit_imm32(struct Emitter *e, uint32_t v)
+{
+	EMIT(e, v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24);
+}
+
+/* rcx = rdi */
+static void emit_load(struct Emitter *e)
+{
+	EMIT(e, 0x48, 0x89, 0xf9);
+}
+
+/* rdx = imm64 */
+static void emit_movrdx(struct Emitter *e, uint64_t v)
+{
+	EMIT(e, 0x48, 0xba);
+	emit_imm32(e, v);
+	emit_imm32(e, v >> 32);
+}
+
+/* rcx &= mask */
+static void emit_and(struct Emitter *e, uint64_t mask)
+{
+	if (mask < (1ULL << 31)) {
+		EMIT(e, 0x48, 0x81, 0xe1);
+		emit_imm32(e, mask);
+	} else {
+		emit_movrdx(e, mask);
+		EMIT(e, 0x48, 0x21, 0xd1);
+	}
+}
+
+/* rcx <<= s (or >>= -s) */
+static void emit_shift(struct Emitter *e, int s)
+{
+	if (s > 0) {
+		EMIT(e, 0x48, 0xc1, 0xe1, s);
+	} else if (s < 0) {
+		EMIT(e, 0x48, 0xc1, 0xe9, -s);
+	}
+}
+
+/* rax ^= rcx */
+static void emit_accum(struct Emitter *e)
+{
+	EMIT(e, 0x48, 0x31, 0xc8);
+}
+
+/* rax ^= parity(rdi & mask) << s */
+static void emit_parity(struct Emitter *e, uint64_t mask, int s)
+{
+	emit_load(e);
+	emit_and(e, mask);
+	EMIT(e, 0xf3, 0x48, 0x0f, 0xb8, 0xc9); /* popcnt rcx, rcx */
+	EMIT(e, 0x83, 0xe1, 0x01);
+	emit_shift(e, s);
+	emit_accum(e);
+}
+
+/* rax ^= pext(rdi, mask) << s */
+static void emit_pext(struct Emitter *e, uint64_t mask, int s)
+{
+	emit_movrdx(e, mask);
+	EMIT(e, 0xc4, 0xe2, 0xc2, 0xf5, 0xca); /* pext rcx, rdi, rdx */
+	emit_shift(e, s);
+	emit_accum(e);
+}
+
+/* rax = M * rdi, with `cols' the images of each input bit */
+static void emit_linear(struct Emitter *e, const uint64_t *cols)
+{
+	uint64_t rows[64] = {0};
+	uint64_t shiftmask[127] = {0};
+	uint64_t pextmask[64] = {0};
+	int pextshift[64];
+	int nshift = 0;
+	int npext = 0;
+	int last_o = -2, last_j = -1;
+
+	for (int j = 0; j < 64; j++) {
+		for (uint64_t c = cols[j]; c; c &= c - 1) {
+			rows[__builtin_ctzll(c)] |= 1ULL << j;
+		}
+	}
+	/*
+	 * Output bits copied from a single input bit are moved either in groups
+	 * sharing the same shift distance, or as PEXT runs of consecutive output
+	 * bits; whichever takes fewer operations. The rest are parities.
+	 */
+	for (int o = 0; o < 64; o++) {
+		if (__builtin_popcountll(rows[o]) != 1) {
+			continue;
+		}
+		int j = __builtin_ctzll(rows[o]);
+		if (!shiftmask[o - j + 63]) {
+			nshift++;
+		}
+		shiftmask[o - j + 63] |= rows[o];
+		if (o != last_o + 1 || j <= last_j) {
+			pextshift[npext++] = o;
+		}
+		pextmask[npext - 1] |= rows[o];
+		last_o = o;
+		last_j = j;
+	}
+
+	EMIT(e, 0x31, 0xc0); /* xor eax, eax */
+	if (e->bmi2 && npext < nshift) {
+		for (int i = 0; i < npext; i++) {
+			emit_pext(e, pextmask[i], pextshift[i]);
+		}
+	} else {
+		for (int s = 0; s < 127; s++) {
+			if (shiftmask[s]) {
+				emit_load(e);
+				emit_and(e, shiftmask[s]);
+				emit_shift(e, s - 63);
+				emit_accum(e);
+			}
+		}
+	}
+	for (int o = 0; o < 64; o++) {
+		if (__builtin_popcountll(rows[o]) > 1) {
+			emit_parity(e, rows[o], o);
+		}
+	}
+	EMIT(e, 0xc3); /* ret */
+}
+
+/*
+ * Branch to one of `npieces' bodies on the piece index in eax.
+ * Returns the offset of the rel32 of each branch, to be patched.
+ */
+static void emit_dispatch(struct Emitter *e, int npieces, size_t *fixups)
+{
+	for (int p = 1; p < npieces; p++) {
+		EMIT(e, 0x83, 0xf8, p); /* cmp eax, p */
+		EMIT(e, 0x0f, 0x84); /* je rel32 */
+		fixups[p] = e->pos;
+		emit_imm32(e, 0);
+	}
+}
+
+static void patch(struct Emitter *e, size_t fixup, size_t target)
+{
+	uint32_t rel = (uint32_t)(target - (fixup + 4));
+	if (!e->err) {
+		memcpy(&e->buf[fixup], &rel, sizeof(rel));
+	}
+}
+
+static void emit_resolve(struct Emitter *e, const struct FusedMap *f)
+{
+	const int npieces = 1 << f->rank_bits;
+	size_t fixups[FUSE_MAXPIECES];
+
+	if (npieces > 1) {
+		EMIT(e, 0x31, 0xc0);
+		for (int b = 0; b < f->rank_bits; b++) {
+			emit_parity(e, f->rankmask[b], b);
+		}
+		emit_dispatch(e, npieces, fixups);
+	}
+	for (int p = 0; p < npieces; p++) {
+		uint64_t cols[64];
+		for (int j = 0; j < 64; j++) {
+			cols[j] = (f->domain >> j) & 1 ? f->cols[p][j] : 0;
+		}
+		if (p) {
+			patch(e, fixups[p], e->pos);
+		}
+		emit_linear(e, cols);
+	}
+}
+
+static void emit_resolve_reverse(struct Emitter *e, const struct FusedMap *f)
+{
+	const int npieces = 1 << f->rank_bits;
+	size_t fixups[FUSE_MAXPIECES];
+
+	if (npieces > 1) {
+		EMIT(e, 0x48, 0x89, 0xf8); /* mov rax, rdi */
+		EMIT(e, 0x48, 0xc1, 0xe8, 16); /* shr rax, 16 */
+		EMIT(e, 0x83, 0xe0, npieces - 1); /* and eax, npieces - 1 */
+		emit_dispatch(e, npieces, fixups);
+	}
+	for (int p = 0; p < npieces; p++) {
+		uint64_t cols[64];
+		for (int i = 0; i < 64; i++) {
+			cols[i] = (f->rev_bytes >> (i / 8)) & 1 ? f->icols[p][i] : 0;
+		}
+		if (p) {
+			patch(e, fixups[p], e->pos);
+		}
+		emit_linear(e, cols);
+	}
+}
+
+static int selfcheck(const struct JITMap *j, const struct FusedMap *f)
+{
+	uint64_t x = 0x9e3779b97f4a7c15ULL;
+	for (int i = 0; i < SELFCHECK_SAMPLES; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		physaddr_t pa = x & f->domain;
+		struct DRAMAddr da = fused_resolve(f, pa);
+		if (dramaddr_to_lane(jit_resolve(j, pa)) != dramaddr_to_lane(da) ||
+		    jit_resolve_reverse(j, da) != fused_resolve_reverse(f, da))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+struct JITMap *jit_build(const struct FusedMap *f)
+{
+	struct JITMap *j;
+	struct Emitter e = {0};
+	size_t rev_off;
+	void *p;
+
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("popcnt")) {
+		return NULL;
+	}
+	e.bmi2 = __builtin_cpu_supports("bmi2");
+	e.buf = mmap(NULL, JIT_MAXCODE, PROT_READ | PROT_WRITE,
+	             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (e.buf == MAP_FAILED) {
+		return NULL;
+	}
+	emit_resolve(&e, f);
+	rev_off = e.pos;
+	emit_resolve_reverse(&e, f);
+	if (e.err || mprotect(e.buf, JIT_MAXCODE, PROT_READ | PROT_EXEC)) {
+		goto err_unmap;
+	}
+
+	j = malloc(sizeof(*j));
+	if (j == NULL) {
+		goto err_unmap;
+	}
+	j->code = e.buf;
+	j->size = JIT_MAXCODE;
+	/* ISO C has no object to function pointer conversion */
+	p = e.buf;
+	memcpy(&j->resolve, &p, sizeof(p));
+	p = e.buf + rev_off;
+	memcpy(&j->resolve_reverse, &p, sizeof(p));
+	if (selfcheck(j, f)) {
+		jit_free(j);
+		return NULL;
+	}
+	return j;
+
+	err_unmap:
+		munmap(e.buf, JIT_MAXCODE);
+		return NULL;
+}
+
+void jit_free(struct JITMap *j)
+{
+	if (j != NULL) {
+		munmap(j->code, j->size);
+		free(j);
+	}
+}
+
+#else
+
+struct JITMap *jit_build(const struct FusedMap *f)
+{
+	return NULL;
+}
+
+void jit_free(struct JITMap *j)
+{
+}
+
+#endif /* __GNUC__ && __x86_64__ */
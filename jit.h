@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is licensed under the GPL2+.
+ */
+
+/* Native code generation for fused memory systems */
+
+#ifndef RAMSES_JIT_H
+#define RAMSES_JIT_H 1
+
+#include "fuse.h"
+
+#include <stdint.h>
+
+typedef uint64_t (*jit_resolve_fn)(physaddr_t addr);
+typedef physaddr_t (*jit_resolve_reverse_fn)(uint64_t addr);
+
+struct JITMap {
+	void *code;
+	size_t size;
+	jit_resolve_fn resolve; /* Returns a packed DRAMAddr */
+	jit_resolve_reverse_fn resolve_reverse; /* Takes a packed DRAMAddr */
+};
+
+static inline struct DRAMAddr jit_resolve(const struct JITMap *j, physaddr_t addr)
+{
+	return dramaddr_from_lane(j->resolve(addr));
+}
+
+static inline physaddr_t jit_resolve_reverse(const struct JITMap *j, struct DRAMAddr addr)
+{
+	return j->resolve_reverse(dramaddr_to_lane(addr));
+}
+
+/*
+ * Compile `f' into straight-line machine code.
+ * Returns NULL if unsupported on this platform or on failure.
+ */
+struct JITMap *jit_build(const struct FusedMap *f);
+void jit_free(struct JITMap *j);
+
+#endif /* jit.h */
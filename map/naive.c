@@ -19,8 +19,10 @@
 #include <ramses/map/naive.h>
 
 #include <assert.h>
+#include <string.h>
 
 #include "bitops.h"
+#include "simd.h"
 
 #define MW_BITS 3
 #define COL_BITS 10
@@ -42,22 +44,41 @@ static inline int rowoff(enum DDRStandard ddr)
 	return BANK_OFF + bankbits(ddr);
 }
 
+/*
+ * Bit logic of the mapping, written once for both scalars and vectors of
+ * 64-bit lanes: `addr' and the fields share a type.
+ */
+#define NAIVE_MAP(addr, bbits, row_off, bank, row, col) \
+do { \
+	(col) = ((addr) >> MW_BITS) & LS_BITMASK(COL_BITS); \
+	(bank) = ((addr) >> BANK_OFF) & LS_BITMASK(bbits); \
+	(row) = ((addr) >> (row_off)) & LS_BITMASK(ROW_BITS); \
+} while (0)
+
+/* Bits of `addr' beyond the memory geometry */
+#define NAIVE_EXCESS(addr, row_off) ((addr) >> ((row_off) + ROW_BITS))
+
+#define NAIVE_MAP_REVERSE(row_off, bank, row, col) \
+	(((row) << (row_off)) + ((bank) << BANK_OFF) + ((col) << MW_BITS))
+
 static struct DRAMAddr map_naive(physaddr_t addr, int flags, void *arg)
 {
 	int bbits = bankbits((enum DDRStandard)flags);
 	int row_off = rowoff((enum DDRStandard)flags);
+	physaddr_t bank, row, col;
 	if (!(bbits && row_off)) {
 		return RAMSES_BADDRAMADDR;
 	}
 	/* Sanity check that address fits in memory geometry */
-	assert(!(addr >> (row_off + ROW_BITS)));
+	assert(!NAIVE_EXCESS(addr, row_off));
+	NAIVE_MAP(addr, bbits, row_off, bank, row, col);
 	return (struct DRAMAddr){
 		.chan = 0,
 		.dimm = 0,
 		.rank = 0,
-		.col = (addr >> MW_BITS) & LS_BITMASK(COL_BITS),
-		.bank = (addr >> BANK_OFF) & LS_BITMASK(bbits),
-		.row = (addr >> row_off) & LS_BITMASK(ROW_BITS),
+		.col = col,
+		.bank = bank,
+		.row = row,
 	};
 }
 
@@ -67,9 +88,8 @@ static physaddr_t map_reverse_naive(struct DRAMAddr addr, int flags, void *arg)
 	if (!row_off) {
 		return RAMSES_BADADDR;
 	}
-	return ((physaddr_t)addr.row << row_off) +
-	       ((physaddr_t)addr.bank << BANK_OFF) +
-	       ((physaddr_t)addr.col << MW_BITS);
+	return NAIVE_MAP_REVERSE(row_off, (physaddr_t)addr.bank,
+	                         (physaddr_t)addr.row, (physaddr_t)addr.col);
 }
 
 static size_t twiddle_gran_naive(struct DRAMAddr mask, int flags, void *arg)
@@ -92,12 +112,81 @@ static size_t twiddle_gran_naive(struct DRAMAddr mask, int flags, void *arg)
 	return 0;
 }
 
+#ifdef RAMSES_SIMD
+/* Batch kernels for vector type `V', compiled with function attribute `attr' */
+#define NAIVE_BATCH_FNS(V, attr, sfx) \
+attr static void map_naive_batch_##sfx(const physaddr_t *in, \
+                                       struct DRAMAddr *out, size_t n, \
+                                       int flags, void *arg) \
+{ \
+	const int bbits = bankbits((enum DDRStandard)flags); \
+	const int row_off = rowoff((enum DDRStandard)flags); \
+	size_t i = 0; \
+	if (bbits) { \
+		for (; i + SIMD_LANES(V) <= n; i += SIMD_LANES(V)) { \
+			V a, d, bank, row, col; \
+			memcpy(&a, &in[i], sizeof(a)); \
+			SIMD_ASSERT_ZERO(V, NAIVE_EXCESS(a, row_off)); \
+			NAIVE_MAP(a, bbits, row_off, bank, row, col); \
+			d = DRAMADDR_LANE_PACK(0, 0, 0, bank, row, col); \
+			memcpy(&out[i], &d, sizeof(d)); \
+		} \
+	} \
+	for (; i < n; i++) { \
+		out[i] = map_naive(in[i], flags, arg); \
+	} \
+} \
+attr static void map_reverse_naive_batch_##sfx(const struct DRAMAddr *in, \
+                                               physaddr_t *out, size_t n, \
+                                               int flags, void *arg) \
+{ \
+	const int row_off = rowoff((enum DDRStandard)flags); \
+	size_t i = 0; \
+	if (row_off) { \
+		for (; i + SIMD_LANES(V) <= n; i += SIMD_LANES(V)) { \
+			V d, a; \
+			memcpy(&d, &in[i], sizeof(d)); \
+			a = NAIVE_MAP_REVERSE(row_off, DRAMADDR_LANE_BANK(d), \
+			                      DRAMADDR_LANE_ROW(d), DRAMADDR_LANE_COL(d)); \
+			memcpy(&out[i], &a, sizeof(a)); \
+		} \
+	} \
+	for (; i < n; i++) { \
+		out[i] = map_reverse_naive(in[i], flags, arg); \
+	} \
+}
+
+NAIVE_BATCH_FNS(u64x4, SIMD_AVX2, avx2)
+NAIVE_BATCH_FNS(u64x8, SIMD_AVX512, avx512)
+#endif
+
+static void naive_set_batch(struct Mapping *m)
+{
+	m->map_batch = NULL;
+	m->map_reverse_batch = NULL;
+#ifdef RAMSES_SIMD
+	switch (simd_level()) {
+		case SIMD_LEVEL_AVX512:
+			m->map_batch = map_naive_batch_avx512;
+			m->map_reverse_batch = map_reverse_naive_batch_avx512;
+			break;
+		case SIMD_LEVEL_AVX2:
+			m->map_batch = map_naive_batch_avx2;
+			m->map_reverse_batch = map_reverse_naive_batch_avx2;
+			break;
+		default:
+			break;
+	}
+#endif
+}
+
 
 void ramses_map_naive(struct Mapping *m, enum DDRStandard ddr)
 {
 	m->map = map_naive;
 	m->map_reverse = map_reverse_naive;
 	m->twiddle_gran = twiddle_gran_naive;
+	naive_set_batch(m);
 	m->flags = (int)ddr;
 	m->arg = NULL;
 	m->props = (struct MappingProps){
@@ -105,6 +194,7 @@ void ramses_map_naive(struct Mapping *m, enum DDRStandard ddr)
 		.bank_cnt = 1 << bankbits(ddr),
 		.col_cnt = 1 << COL_BITS,
 		.cell_size = 1 << MW_BITS,
+		.linear_mask = bankbits(ddr) ? LS_BITMASK(rowoff(ddr) + ROW_BITS) : 0,
 	};
 }
 
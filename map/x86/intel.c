@@ -19,155 +19,166 @@
 #include <ramses/map/x86/intel.h>
 
 #include <assert.h>
+#include <string.h>
 
 #include "bitops.h"
+#include "simd.h"
 #include "pcihole.h"
 
 #define MW_BITS 3
 #define COL_BITS 10
 
-static struct DRAMAddr drammap_sandy(physaddr_t addr, int geom_flags)
-{
-	struct DRAMAddr retval = {0,0,0,0,0,0};
-	/* Idx: 0 */
-	if (geom_flags & INTEL_DUALCHAN) {
-		retval.chan = BIT(6, addr);
-		addr = POP_BIT(6, addr);
-	}
-	/* Discard index into memory word */
-	addr >>= MW_BITS;
-	/* Idx: 3 */
-	retval.col = addr & LS_BITMASK(COL_BITS);
-	addr >>= COL_BITS;
-	/* Idx: 13/14 */
-	/* HACK: DIMM selection rule assumed (and you know what they say about when you assume) */
-	if (geom_flags & INTEL_DUALDIMM) {
-		retval.dimm = BIT(3,addr);
-		addr = POP_BIT(3,addr);
-	}
-	/* Idx: 13/14, Possible Holes: 16/17 */
-	if (geom_flags & INTEL_DUALRANK) {
-		retval.rank = BIT(3,addr);
-		addr = POP_BIT(3,addr);
-	}
-	/* Idx: 13/14, Possible Holes: 16/17, 17/18 */
-	for (int i = 0; i < 3; i++) {
-		retval.bank |= (BIT(0,addr) ^ BIT(3,addr)) << i;
-		addr >>= 1;
-	}
-	retval.row = addr & LS_BITMASK(16);
-	addr >>= 16;
-	/* Sanity check that address fits in memory geometry */
-	assert(addr == 0);
-	return retval;
-}
+/*
+ * Bit logic of the mappings, written once for both scalars and vectors of
+ * 64-bit lanes: `T' is the type of the address and of every field.
+ * Forward mappings split `addr' into the DRAM address fields, leaving in
+ * `addr' the bits beyond the memory geometry. Reverse mappings assemble the
+ * physical address `ret' from the fields.
+ */
+#define DRAMMAP_SANDY(T, addr, geom_flags, chan, dimm, rank, bank, row, col) \
+do { \
+	(chan) = (dimm) = (rank) = (bank) = (T){0}; \
+	/* Idx: 0 */ \
+	if ((geom_flags) & INTEL_DUALCHAN) { \
+		(chan) = BIT(6, addr); \
+		(addr) = POP_BIT(6, addr); \
+	} \
+	/* Discard index into memory word */ \
+	(addr) >>= MW_BITS; \
+	/* Idx: 3 */ \
+	(col) = (addr) & LS_BITMASK(COL_BITS); \
+	(addr) >>= COL_BITS; \
+	/* Idx: 13/14 */ \
+	/* HACK: DIMM selection rule assumed (and you know what they say about when you assume) */ \
+	if ((geom_flags) & INTEL_DUALDIMM) { \
+		(dimm) = BIT(3, addr); \
+		(addr) = POP_BIT(3, addr); \
+	} \
+	/* Idx: 13/14, Possible Holes: 16/17 */ \
+	if ((geom_flags) & INTEL_DUALRANK) { \
+		(rank) = BIT(3, addr); \
+		(addr) = POP_BIT(3, addr); \
+	} \
+	/* Idx: 13/14, Possible Holes: 16/17, 17/18 */ \
+	for (int i_ = 0; i_ < 3; i_++) { \
+		(bank) |= (BIT(0, addr) ^ BIT(3, addr)) << i_; \
+		(addr) >>= 1; \
+	} \
+	(row) = (addr) & LS_BITMASK(16); \
+	(addr) >>= 16; \
+} while (0)
 
-static physaddr_t drammap_reverse_sandy(struct DRAMAddr addr, int geom_flags)
-{
-	physaddr_t retval = addr.row & LS_BITMASK(16);
-	if (geom_flags & INTEL_DUALRANK) {
-		retval <<= 1;
-		retval |= addr.rank & 1;
-	}
-	if (geom_flags & INTEL_DUALDIMM) {
-		retval <<= 1;
-		retval |= addr.dimm & 1;
-	}
-	for (int i = 2; i >= 0; i--) {
-		retval <<= 1;
-		retval |= BIT(i, addr.bank) ^ BIT(i, addr.row);
-	}
-	if (geom_flags & INTEL_DUALCHAN) {
-		retval <<= 7;
-		retval |= (addr.col >> 3) & LS_BITMASK(7);
-		retval <<= 1;
-		retval |= addr.chan & 1;
-		retval <<= 3;
-		retval |= addr.col & LS_BITMASK(3);
-	} else {
-		retval <<= COL_BITS;
-		retval |= addr.col & LS_BITMASK(COL_BITS);
-	}
-	retval <<= MW_BITS;
+#define DRAMMAP_REVERSE_SANDY(T, ret, geom_flags, chan, dimm, rank, bank, row, col) \
+do { \
+	(ret) = (row) & LS_BITMASK(16); \
+	if ((geom_flags) & INTEL_DUALRANK) { \
+		(ret) = ((ret) << 1) | ((rank) & 1); \
+	} \
+	if ((geom_flags) & INTEL_DUALDIMM) { \
+		(ret) = ((ret) << 1) | ((dimm) & 1); \
+	} \
+	for (int i_ = 2; i_ >= 0; i_--) { \
+		(ret) = ((ret) << 1) | (BIT(i_, bank) ^ BIT(i_, row)); \
+	} \
+	if ((geom_flags) & INTEL_DUALCHAN) { \
+		(ret) = ((ret) << 7) | (((col) >> 3) & LS_BITMASK(7)); \
+		(ret) = ((ret) << 1) | ((chan) & 1); \
+		(ret) = ((ret) << 3) | ((col) & LS_BITMASK(3)); \
+	} else { \
+		(ret) = ((ret) << COL_BITS) | ((col) & LS_BITMASK(COL_BITS)); \
+	} \
+	(ret) <<= MW_BITS; \
+} while (0)
 
-	return retval;
-}
+#define DRAMMAP_IVYHASWELL(T, addr, geom_flags, chan, dimm, rank, bank, row, col) \
+do { \
+	(chan) = (dimm) = (rank) = (bank) = (T){0}; \
+	/* Idx: 0 */ \
+	if ((geom_flags) & INTEL_DUALCHAN) { \
+		(chan) = BIT(7, addr) ^ BIT(8, addr) ^ BIT(9, addr) ^ BIT(12, addr) ^ \
+		         BIT(13, addr) ^ BIT(18, addr) ^ BIT(19, addr); \
+		(addr) = POP_BIT(7, addr); \
+	} \
+	/* Discard index into memory word */ \
+	(addr) >>= MW_BITS; \
+	/* Idx: 3 */ \
+	(col) = (addr) & LS_BITMASK(COL_BITS); \
+	(addr) >>= COL_BITS; \
+	/* Idx: 13/14 */ \
+	if ((geom_flags) & INTEL_DUALDIMM) { \
+		(dimm) = BIT(2, addr); \
+		(addr) = POP_BIT(2, addr); \
+	} \
+	/* Idx: 13/14, Possible Holes: 15/16 */ \
+	if ((geom_flags) & INTEL_DUALRANK) { \
+		(rank) = BIT(2, addr) ^ BIT(6, addr); \
+		(addr) = POP_BIT(2, addr); \
+	} \
+	/* Idx: 13/14, Possible Holes: 15/16, 16/17 */ \
+	for (int i_ = 0; i_ < 2; i_++) { \
+		(bank) |= (BIT(0, addr) ^ BIT(3, addr)) << i_; \
+		(addr) >>= 1; \
+	} \
+	(bank) |= (BIT(0, addr) ^ \
+	           BIT(((geom_flags) & INTEL_DUALRANK) ? 4 : 3, addr)) << 2; \
+	(addr) >>= 1; \
+	(row) = (addr) & LS_BITMASK(16); \
+	(addr) >>= 16; \
+} while (0)
 
-static struct DRAMAddr drammap_ivyhaswell(physaddr_t addr, int geom_flags)
-{
-	struct DRAMAddr retval = {0,0,0,0,0,0};
-	/* Idx: 0 */
-	if (geom_flags & INTEL_DUALCHAN) {
-		retval.chan = BIT(7,addr) ^ BIT(8,addr) ^ BIT(9,addr) ^ BIT(12,addr) ^
-					  BIT(13,addr) ^ BIT(18,addr) ^ BIT(19,addr);
-		addr = POP_BIT(7,addr);
-	}
-	/* Discard index into memory word */
-	addr >>= MW_BITS;
-	/* Idx: 3 */
-	retval.col = addr & LS_BITMASK(COL_BITS);
-	addr >>= COL_BITS;
-	/* Idx: 13/14 */
-	if (geom_flags & INTEL_DUALDIMM) {
-		retval.dimm = BIT(2,addr);
-		addr = POP_BIT(2,addr);
-	}
-	/* Idx: 13/14, Possible Holes: 15/16 */
-	if (geom_flags & INTEL_DUALRANK) {
-		retval.rank = BIT(2,addr) ^ BIT(6,addr);
-		addr = POP_BIT(2,addr);
-	}
-	/* Idx: 13/14, Possible Holes: 15/16, 16/17 */
-	for (int i = 0; i < 2; i++) {
-		retval.bank |= (BIT(0,addr) ^ BIT(3,addr)) << i;
-		addr >>= 1;
-	}
-	retval.bank |= (BIT(0,addr) ^ BIT((geom_flags & INTEL_DUALRANK) ? 4 : 3, addr)) << 2;
-	addr >>= 1;
+#define DRAMMAP_REVERSE_IVYHASWELL(T, ret, geom_flags, chan, dimm, rank, bank, row, col) \
+do { \
+	(ret) = (row) & LS_BITMASK(16); \
+	if ((geom_flags) & INTEL_DUALRANK) { \
+		(ret) = ((ret) << 1) | (BIT(2, bank) ^ BIT(3, row)); \
+		(ret) = ((ret) << 1) | (((rank) & 1) ^ BIT(2, row)); \
+	} else { \
+		(ret) = ((ret) << 1) | (BIT(2, bank) ^ BIT(2, row)); \
+	} \
+	if ((geom_flags) & INTEL_DUALDIMM) { \
+		(ret) = ((ret) << 1) | ((dimm) & 1); \
+	} \
+	for (int i_ = 1; i_ >= 0; i_--) { \
+		(ret) = ((ret) << 1) | (BIT(i_, bank) ^ BIT(i_, row)); \
+	} \
+	if ((geom_flags) & INTEL_DUALCHAN) { \
+		(ret) = ((ret) << 6) | (((col) >> 4) & LS_BITMASK(6)); \
+		(ret) <<= 1; \
+		(ret) |= ((chan) & 1) ^ BIT(1, ret) ^ BIT(2, ret) ^ \
+		         BIT(5, ret) ^ BIT(6, ret) ^ BIT(11, ret) ^ BIT(12, ret); \
+		(ret) = ((ret) << 4) | ((col) & LS_BITMASK(4)); \
+	} else { \
+		(ret) = ((ret) << COL_BITS) | ((col) & LS_BITMASK(COL_BITS)); \
+	} \
+	(ret) <<= MW_BITS; \
+} while (0)
 
-	retval.row = addr & LS_BITMASK(16);
-	addr >>= 16;
-	/* Sanity check that address fits in memory geometry */
-	assert(addr == 0);
-	return retval;
+/* Scalar instances of the mappings above, for mapping `name' */
+#define DRAMMAP_SCALAR_FNS(name, NAME) \
+static struct DRAMAddr drammap_##name(physaddr_t addr, int geom_flags) \
+{ \
+	physaddr_t chan, dimm, rank, bank, row, col; \
+	DRAMMAP_##NAME(physaddr_t, addr, geom_flags, \
+	               chan, dimm, rank, bank, row, col); \
+	/* Sanity check that address fits in memory geometry */ \
+	assert(addr == 0); \
+	return (struct DRAMAddr){ \
+		.chan = chan, .dimm = dimm, .rank = rank, \
+		.bank = bank, .row = row, .col = col \
+	}; \
+} \
+static physaddr_t drammap_reverse_##name(struct DRAMAddr addr, int geom_flags) \
+{ \
+	physaddr_t ret; \
+	DRAMMAP_REVERSE_##NAME(physaddr_t, ret, geom_flags, \
+	                       (physaddr_t)addr.chan, (physaddr_t)addr.dimm, \
+	                       (physaddr_t)addr.rank, (physaddr_t)addr.bank, \
+	                       (physaddr_t)addr.row, (physaddr_t)addr.col); \
+	return ret; \
 }
 
-static physaddr_t drammap_reverse_ivyhaswell(struct DRAMAddr addr, int geom_flags)
-{
-	physaddr_t retval = addr.row & LS_BITMASK(16);
-	if (geom_flags & INTEL_DUALRANK) {
-		retval <<= 1;
-		retval |= BIT(2, addr.bank) ^ BIT(3, addr.row);
-		retval <<= 1;
-		retval |= (addr.rank & 1) ^ BIT(2, addr.row);
-	} else {
-		retval <<= 1;
-		retval |= BIT(2, addr.bank) ^ BIT(2, addr.row);
-	}
-	if (geom_flags & INTEL_DUALDIMM) {
-		retval <<= 1;
-		retval |= addr.dimm & 1;
-	}
-	for (int i = 1; i >= 0; i--) {
-		retval <<= 1;
-		retval |= BIT(i, addr.bank) ^ BIT(i, addr.row);
-	}
-	if (geom_flags & INTEL_DUALCHAN) {
-		retval <<= 6;
-		retval |= (addr.col >> 4) & LS_BITMASK(6);
-		retval <<= 1;
-		retval |= (addr.chan & 1) ^ BIT(1,retval) ^ BIT(2,retval) ^
-		          BIT(5,retval) ^ BIT(6,retval) ^ BIT(11,retval) ^ BIT(12,retval);
-		retval <<= 4;
-		retval |= addr.col & LS_BITMASK(4);
-	} else {
-		retval <<= COL_BITS;
-		retval |= addr.col & LS_BITMASK(COL_BITS);
-	}
-	retval <<= MW_BITS;
-
-	return retval;
-}
+DRAMMAP_SCALAR_FNS(sandy, SANDY)
+DRAMMAP_SCALAR_FNS(ivyhaswell, IVYHASWELL)
 
 
 static inline size_t contiguous_twiddle(long long mask, size_t base, int maxbits)
@@ -183,6 +194,18 @@ static inline size_t contiguous_twiddle(long long mask, size_t base, int maxbits
 static inline int has_pcihole(const struct IntelCntrlOpts *o)
 { return o->pcibase && o->mem_top; }
 
+/* Without a PCI hole, both mappings are linear over all their address bits */
+static inline physaddr_t linear_mask(const struct IntelCntrlOpts *o)
+{
+	if (has_pcihole(o)) {
+		return 0;
+	}
+	return LS_BITMASK(MW_BITS + COL_BITS + 3 + 16 +
+	                  !!(o->geom & INTEL_DUALCHAN) +
+	                  !!(o->geom & INTEL_DUALDIMM) +
+	                  !!(o->geom & INTEL_DUALRANK));
+}
+
 
 static struct DRAMAddr map_sandy(physaddr_t addr, int flags, void *opts)
 {
@@ -262,18 +285,122 @@ static size_t twiddle_gran_ivyhaswell(struct DRAMAddr mask, int flags, void *opt
 	return contiguous_twiddle(mask.row, base, 0);
 }
 
+#ifdef RAMSES_SIMD
+/*
+ * Lane-parallel instances of the drammap_* functions above, operating on
+ * vectors of physical addresses and packed DRAM addresses.
+ */
+#define INTEL_LANE_FNS(V, attr, sfx, name, NAME) \
+attr static inline V drammap_##name##_##sfx(V addr, int geom_flags) \
+{ \
+	V chan, dimm, rank, bank, row, col; \
+	DRAMMAP_##NAME(V, addr, geom_flags, chan, dimm, rank, bank, row, col); \
+	SIMD_ASSERT_ZERO(V, addr); \
+	return DRAMADDR_LANE_PACK(chan, dimm, rank, bank, row, col); \
+} \
+attr static inline V drammap_reverse_##name##_##sfx(V addr, int geom_flags) \
+{ \
+	V ret; \
+	DRAMMAP_REVERSE_##NAME(V, ret, geom_flags, \
+	                       DRAMADDR_LANE_CHAN(addr), DRAMADDR_LANE_DIMM(addr), \
+	                       DRAMADDR_LANE_RANK(addr), DRAMADDR_LANE_BANK(addr), \
+	                       DRAMADDR_LANE_ROW(addr), DRAMADDR_LANE_COL(addr)); \
+	return ret; \
+}
+
+/* Batch hooks for mapping `name', built on the lane functions above */
+#define INTEL_BATCH_FNS(V, attr, sfx, name) \
+attr static void map_##name##_batch_##sfx(const physaddr_t *in, \
+                                          struct DRAMAddr *out, size_t n, \
+                                          int flags, void *opts) \
+{ \
+	const struct IntelCntrlOpts *o = (struct IntelCntrlOpts *)opts; \
+	size_t i = 0; \
+	for (; i + SIMD_LANES(V) <= n; i += SIMD_LANES(V)) { \
+		V a, d; \
+		if (has_pcihole(o)) { \
+			physaddr_t tmp[SIMD_LANES(V)]; \
+			for (size_t k = 0; k < SIMD_LANES(V); k++) { \
+				tmp[k] = pcihole_remap(in[i + k], o->pcibase, o->mem_top); \
+			} \
+			memcpy(&a, tmp, sizeof(a)); \
+		} else { \
+			memcpy(&a, &in[i], sizeof(a)); \
+		} \
+		d = drammap_##name##_##sfx(a, o->geom); \
+		memcpy(&out[i], &d, sizeof(d)); \
+	} \
+	for (; i < n; i++) { \
+		out[i] = map_##name(in[i], flags, opts); \
+	} \
+} \
+attr static void map_reverse_##name##_batch_##sfx(const struct DRAMAddr *in, \
+                                                  physaddr_t *out, size_t n, \
+                                                  int flags, void *opts) \
+{ \
+	const struct IntelCntrlOpts *o = (struct IntelCntrlOpts *)opts; \
+	size_t i = 0; \
+	for (; i + SIMD_LANES(V) <= n; i += SIMD_LANES(V)) { \
+		V d, a; \
+		memcpy(&d, &in[i], sizeof(d)); \
+		a = drammap_reverse_##name##_##sfx(d, o->geom); \
+		memcpy(&out[i], &a, sizeof(a)); \
+		if (has_pcihole(o)) { \
+			for (size_t k = 0; k < SIMD_LANES(V); k++) { \
+				out[i + k] = pcihole_remap_reverse(out[i + k], o->pcibase, \
+				                                   o->mem_top); \
+			} \
+		} \
+	} \
+	for (; i < n; i++) { \
+		out[i] = map_reverse_##name(in[i], flags, opts); \
+	} \
+}
+
+INTEL_LANE_FNS(u64x4, SIMD_AVX2, avx2, sandy, SANDY)
+INTEL_LANE_FNS(u64x4, SIMD_AVX2, avx2, ivyhaswell, IVYHASWELL)
+INTEL_BATCH_FNS(u64x4, SIMD_AVX2, avx2, sandy)
+INTEL_BATCH_FNS(u64x4, SIMD_AVX2, avx2, ivyhaswell)
+INTEL_LANE_FNS(u64x8, SIMD_AVX512, avx512, sandy, SANDY)
+INTEL_LANE_FNS(u64x8, SIMD_AVX512, avx512, ivyhaswell, IVYHASWELL)
+INTEL_BATCH_FNS(u64x8, SIMD_AVX512, avx512, sandy)
+INTEL_BATCH_FNS(u64x8, SIMD_AVX512, avx512, ivyhaswell)
+
+#define INTEL_SET_BATCH(m, name) \
+	switch (simd_level()) { \
+		case SIMD_LEVEL_AVX512: \
+			(m)->map_batch = map_##name##_batch_avx512; \
+			(m)->map_reverse_batch = map_reverse_##name##_batch_avx512; \
+			break; \
+		case SIMD_LEVEL_AVX2: \
+			(m)->map_batch = map_##name##_batch_avx2; \
+			(m)->map_reverse_batch = map_reverse_##name##_batch_avx2; \
+			break; \
+		default: \
+			(m)->map_batch = NULL; \
+			(m)->map_reverse_batch = NULL; \
+			break; \
+	}
+#else
+#define INTEL_SET_BATCH(m, name) \
+	(m)->map_batch = NULL; \
+	(m)->map_reverse_batch = NULL;
+#endif
+
 void ramses_map_x86_intel_sandy(struct Mapping *m, struct IntelCntrlOpts *o)
 {
 	m->map = map_sandy;
 	m->map_reverse = map_reverse_sandy;
 	m->twiddle_gran = twiddle_gran_sandy;
+	INTEL_SET_BATCH(m, sandy);
 	m->flags = 0;
 	m->arg = o;
 	m->props = (struct MappingProps){
 		.granularity = (o->geom & INTEL_DUALCHAN) ? (1 << 6) : (1 << 13),
 		.bank_cnt = 8,
 		.col_cnt = 1 << COL_BITS,
-		.cell_size = 1 << MW_BITS
+		.cell_size = 1 << MW_BITS,
+		.linear_mask = linear_mask(o)
 	};
 }
 
@@ -282,12 +409,14 @@ void ramses_map_x86_intel_ivyhaswell(struct Mapping *m, struct IntelCntrlOpts *o
 	m->map = map_ivyhaswell;
 	m->map_reverse = map_reverse_ivyhaswell;
 	m->twiddle_gran = twiddle_gran_ivyhaswell;
+	INTEL_SET_BATCH(m, ivyhaswell);
 	m->flags = 0;
 	m->arg = o;
 	m->props = (struct MappingProps){
 		.granularity = (o->geom & INTEL_DUALCHAN) ? (1 << 7) : (1 << 13),
 		.bank_cnt = 8,
 		.col_cnt = 1 << COL_BITS,
-		.cell_size = 1 << MW_BITS
+		.cell_size = 1 << MW_BITS,
+		.linear_mask = linear_mask(o)
 	};
 }
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <ramses/map/xor.h>
+
+#include "bitops.h"
+#include "gf2.h"
+#include "simd.h"
+
+static struct DRAMAddr map_xor(physaddr_t addr, int flags, void *arg)
+{
+	const struct XORMapOpts *o = (struct XORMapOpts *)arg;
+	uint64_t d = 0;
+	for (int i = 0; i < o->nfuncs; i++) {
+		d |= (uint64_t)gf2_parity(addr & o->fmask[i]) << o->fbit[i];
+	}
+	return dramaddr_from_lane(d);
+}
+
+static physaddr_t map_reverse_xor(struct DRAMAddr addr, int flags, void *arg)
+{
+	const struct XORMapOpts *o = (struct XORMapOpts *)arg;
+	const uint64_t d = dramaddr_to_lane(addr);
+	physaddr_t ret = 0;
+	physaddr_t bits = o->domain;
+	for (int k = 0; bits; bits &= bits - 1, k++) {
+		ret |= (physaddr_t)gf2_parity(d & o->inv[k]) << __builtin_ctzll(bits);
+	}
+	return ret;
+}
+
+static size_t twiddle_gran_xor(struct DRAMAddr mask, int flags, void *arg)
+{
+	const struct XORMapOpts *o = (struct XORMapOpts *)arg;
+	const uint64_t m = dramaddr_to_lane(mask);
+	int lsb = -1;
+	for (int i = 0; i < o->nfuncs; i++) {
+		if (BIT(o->fbit[i], m)) {
+			int fl = leastsetbit(o->fmask[i]);
+			if (lsb < 0 || fl < lsb) {
+				lsb = fl;
+			}
+		}
+	}
+	return (lsb >= 0) ? (size_t)1 << lsb : 0;
+}
+
+
+static int add_funcs(struct XORMapOpts *o, const physaddr_t *masks, int nbits,
+                     int maxbits, int packoff)
+{
+	if (nbits < 0 || nbits > maxbits) {
+		return 1;
+	}
+	for (int i = 0; i < nbits; i++) {
+		if (!masks[i] || o->nfuncs >= XORMAP_MAXFUNCS) {
+			return 1;
+		}
+		o->fmask[o->nfuncs] = masks[i];
+		o->fbit[o->nfuncs] = packoff + i;
+		o->nfuncs++;
+	}
+	return 0;
+}
+
+int ramses_map_xor(struct Mapping *m, struct XORMapOpts *o)
+{
+	uint64_t mat[XORMAP_MAXFUNCS];
+	uint64_t inv[XORMAP_MAXFUNCS];
+	int cellbit;
+	int granbit;
+
+	o->nfuncs = 0;
+	if (add_funcs(o, o->chan, o->chan_bits, 8, 0) ||
+	    add_funcs(o, o->dimm, o->dimm_bits, 8, 8) ||
+	    add_funcs(o, o->rank, o->rank_bits, 8, 16) ||
+	    add_funcs(o, o->bank, o->bank_bits, 8, 24) ||
+	    add_funcs(o, o->row, o->row_bits, 16, 32) ||
+	    add_funcs(o, o->col, o->col_bits, 16, 48) ||
+	    !o->nfuncs)
+	{
+		return 1;
+	}
+
+	o->domain = 0;
+	for (int i = 0; i < o->nfuncs; i++) {
+		o->domain |= o->fmask[i];
+	}
+	/* Need a contiguous span of PA bits, one per DRAM address bit */
+	cellbit = leastsetbit(o->domain);
+	if (__builtin_popcountll(o->domain) != o->nfuncs ||
+	    ((o->domain >> cellbit) & ((o->domain >> cellbit) + 1)))
+	{
+		return 1;
+	}
+
+	for (int i = 0; i < o->nfuncs; i++) {
+		mat[i] = gf2_compress(o->fmask[i], o->domain);
+	}
+	if (gf2_invert(mat, inv, o->nfuncs)) {
+		return 1;
+	}
+	/* Re-express the inverse in terms of packed DRAMAddr bits */
+	for (int k = 0; k < o->nfuncs; k++) {
+		o->inv[k] = 0;
+		for (int i = 0; i < o->nfuncs; i++) {
+			if (BIT(i, inv[k])) {
+				o->inv[k] |= 1ULL << o->fbit[i];
+			}
+		}
+	}
+
+	/* Contiguous in both spaces up to the first non-identity column bit */
+	granbit = cellbit;
+	for (int i = 0; i < o->col_bits; i++, granbit++) {
+		physaddr_t pbit = 1ULL << granbit;
+		int users = 0;
+		for (int k = 0; k < o->nfuncs; k++) {
+			users += !!(o->fmask[k] & pbit);
+		}
+		if (o->col[i] != pbit || users != 1) {
+			break;
+		}
+	}
+
+	m->map = map_xor;
+	m->map_reverse = map_reverse_xor;
+	m->twiddle_gran = twiddle_gran_xor;
+	m->map_batch = NULL;
+	m->map_reverse_batch = NULL;
+	m->flags = 0;
+	m->arg = o;
+	m->props = (struct MappingProps){
+		.granularity = 1ULL << granbit,
+		.bank_cnt = 1 << o->bank_bits,
+		.col_cnt = 1 << o->col_bits,
+		.cell_size = 1 << cellbit,
+		.linear_mask = o->domain,
+	};
+	return 0;
+}
+
+
+#include "xor_msys.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+static const struct MSYSParam MAP_XOR_PARAMS[] = {
+	{.name = "chan", .type = 's'},
+	{.name = "dimm", .type = 's'},
+	{.name = "rank", .type = 's'},
+	{.name = "bank", .type = 's'},
+	{.name = "row", .type = 's'},
+	{.name = "col", .type = 's'},
+};
+
+/* Parse a comma-separated list of masks */
+static int parse_masks(const char *s, physaddr_t *masks, int maxbits, int *nbits)
+{
+	int n = 0;
+	if (s == NULL) {
+		*nbits = 0;
+		return 0;
+	}
+	while (*s != '\0') {
+		char *end = NULL;
+		if (n >= maxbits) {
+			return 1;
+		}
+		errno = 0;
+		masks[n++] = strtoull(s, &end, 0);
+		if (end == s || errno == ERANGE || (*end != ',' && *end != '\0')) {
+			return 1;
+		}
+		s = (*end == ',') ? end + 1 : end;
+	}
+	*nbits = n;
+	return 0;
+}
+
+static int xor_config(struct Mapping *m, union MSYSArg *args,
+                      void **allocs, size_t *nallocs)
+{
+	struct XORMapOpts *opts = calloc(1, sizeof(*opts));
+	if (!opts) {
+		return 1;
+	}
+	if (parse_masks(args[0].str, opts->chan, 8, &opts->chan_bits) ||
+	    parse_masks(args[1].str, opts->dimm, 8, &opts->dimm_bits) ||
+	    parse_masks(args[2].str, opts->rank, 8, &opts->rank_bits) ||
+	    parse_masks(args[3].str, opts->bank, 8, &opts->bank_bits) ||
+	    parse_masks(args[4].str, opts->row, 16, &opts->row_bits) ||
+	    parse_masks(args[5].str, opts->col, 16, &opts->col_bits) ||
+	    ramses_map_xor(m, opts))
+	{
+		free(opts);
+		return 2;
+	}
+	*allocs = opts;
+	*nallocs = 1;
+	return 0;
+}
+
+const struct MapConfig MAP_XOR_CONFIG = {
+	.meta = {
+		.name = "xor",
+		.params = MAP_XOR_PARAMS,
+		.nparams = 6
+	},
+	.func = xor_config
+};
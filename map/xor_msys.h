@@ -0,0 +1,14 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is licensed under the GPL2+.
+ */
+
+#ifndef RAMSES_MAP_XOR_MSYS_H
+#define RAMSES_MAP_XOR_MSYS_H 1
+
+#include "msys_int.h"
+
+extern const struct MapConfig MAP_XOR_CONFIG;
+
+#endif /* xor_msys.h */
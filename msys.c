@@ -17,6 +17,19 @@
  */
 
 #include <ramses/msys.h>
+#include <ramses/util.h>
+
+#include "msys_int.h"
+#include "fuse.h"
+#include "jit.h"
+#include "sort.h"
+#include "par.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BATCH_BLOCK 256
 
 static size_t gcd(size_t a, size_t b)
 {
@@ -37,15 +50,397 @@ size_t ramses_msys_granularity(struct MemorySystem *m, size_t pagesz)
 	return gran;
 }
 
-struct DRAMAddr ramses_resolve(struct MemorySystem *m, physaddr_t addr)
+/* Resolution through the mapping and remaps, bypassing compiled forms */
+static inline struct DRAMAddr interp_resolve(struct MemorySystem *m,
+                                             physaddr_t addr)
 {
 	return ramses_remap_chain(m->remaps, m->nremaps,
 	                          ramses_map(&m->mapping, addr));
 }
 
-physaddr_t ramses_resolve_reverse(struct MemorySystem *m, struct DRAMAddr addr)
+static inline physaddr_t interp_resolve_reverse(struct MemorySystem *m,
+                                                struct DRAMAddr addr)
 {
 	return ramses_map_reverse(&m->mapping,
 		ramses_remap_chain_reverse(m->remaps, m->nremaps, addr)
 	);
 }
+
+struct DRAMAddr ramses_resolve(struct MemorySystem *m, physaddr_t addr)
+{
+	if (m->jit != NULL) {
+		return jit_resolve(m->jit, addr);
+	} else if (m->fused != NULL) {
+		return fused_resolve(m->fused, addr);
+	}
+	return interp_resolve(m, addr);
+}
+
+physaddr_t ramses_resolve_reverse(struct MemorySystem *m, struct DRAMAddr addr)
+{
+	if (m->jit != NULL) {
+		return jit_resolve_reverse(m->jit, addr);
+	} else if (m->fused != NULL) {
+		return fused_resolve_reverse(m->fused, addr);
+	}
+	return interp_resolve_reverse(m, addr);
+}
+
+/* Batch counterparts of the above */
+static void interp_batch(struct MemorySystem *m, const physaddr_t *in,
+                         struct DRAMAddr *out, size_t n)
+{
+	for (size_t base = 0; base < n; base += BATCH_BLOCK) {
+		const size_t cnt = (n - base < BATCH_BLOCK) ? n - base : BATCH_BLOCK;
+		struct DRAMAddr *o = &out[base];
+		ramses_map_batch(&m->mapping, &in[base], o, cnt);
+		for (size_t r = 0; r < m->nremaps; r++) {
+			ramses_remap_batch(m->remaps[r], o, cnt);
+		}
+	}
+}
+
+static void interp_reverse_batch(struct MemorySystem *m,
+                                 const struct DRAMAddr *in,
+                                 physaddr_t *out, size_t n)
+{
+	struct DRAMAddr tmp[BATCH_BLOCK];
+	for (size_t base = 0; base < n; base += BATCH_BLOCK) {
+		const size_t cnt = (n - base < BATCH_BLOCK) ? n - base : BATCH_BLOCK;
+		const struct DRAMAddr *src = &in[base];
+		if (m->nremaps) {
+			for (size_t i = 0; i < cnt; i++) {
+				tmp[i] = src[i];
+			}
+			for (size_t r = m->nremaps; r --> 0;) {
+				ramses_remap_reverse_batch(m->remaps[r], tmp, cnt);
+			}
+			src = tmp;
+		}
+		ramses_map_reverse_batch(&m->mapping, src, &out[base], cnt);
+	}
+}
+
+void ramses_resolve_batch(struct MemorySystem *m, const physaddr_t *in,
+                          struct DRAMAddr *out, size_t n)
+{
+	if (m->jit != NULL) {
+		for (size_t i = 0; i < n; i++) {
+			out[i] = jit_resolve(m->jit, in[i]);
+		}
+		return;
+	} else if (m->fused != NULL) {
+		for (size_t i = 0; i < n; i++) {
+			out[i] = fused_resolve(m->fused, in[i]);
+		}
+		return;
+	}
+	interp_batch(m, in, out, n);
+}
+
+void ramses_resolve_reverse_batch(struct MemorySystem *m,
+                                  const struct DRAMAddr *in,
+                                  physaddr_t *out, size_t n)
+{
+	if (m->jit != NULL) {
+		for (size_t i = 0; i < n; i++) {
+			out[i] = jit_resolve_reverse(m->jit, in[i]);
+		}
+		return;
+	} else if (m->fused != NULL) {
+		for (size_t i = 0; i < n; i++) {
+			out[i] = fused_resolve_reverse(m->fused, in[i]);
+		}
+		return;
+	}
+	interp_reverse_batch(m, in, out, n);
+}
+
+static int dramrange_cmp(const void *a, const void *b)
+{
+	return ramses_dramaddr_cmp(((struct DRAMRange *)a)->start,
+	                           ((struct DRAMRange *)b)->start);
+}
+
+struct RangeKeyJob {
+	struct DRAMRange *r;
+	size_t n;
+	bool to_key;
+};
+
+static void dramrange_keys(void *arg, int t, int nthreads)
+{
+	struct RangeKeyJob *j = (struct RangeKeyJob *)arg;
+	const size_t hi = par_chunk(j->n, t + 1, nthreads);
+	uint64_t k;
+
+	for (size_t i = par_chunk(j->n, t, nthreads); i < hi; i++) {
+		if (j->to_key) {
+			k = ramses_dramaddr_key(j->r[i].start);
+			memcpy(&j->r[i].start, &k, sizeof(k));
+		} else {
+			memcpy(&k, &j->r[i].start, sizeof(k));
+			j->r[i].start = ramses_dramaddr_from_key(k);
+		}
+	}
+}
+
+/*
+ * Radix sort ranges by temporarily storing the sort key of their start in
+ * place of it.
+ */
+static void dramrange_sort(struct DRAMRange *r, size_t n, void *scratch,
+                           int nthreads)
+{
+	struct RangeKeyJob job = { .r = r, .n = n, .to_key = true };
+	void *tmp = scratch;
+
+	if (n < RADIX_MIN ||
+	    (tmp == NULL && (tmp = malloc(n * sizeof(*r))) == NULL))
+	{
+		qsort(r, n, sizeof(*r), dramrange_cmp);
+		return;
+	}
+	par_run(nthreads, dramrange_keys, &job);
+	radix_sort64_par(r, tmp, n, sizeof(*r), nthreads);
+	job.to_key = false;
+	par_run(nthreads, dramrange_keys, &job);
+	if (tmp != scratch) {
+		free(tmp);
+	}
+}
+
+/* Merge adjacent ones among `n' sorted ranges; returns the resulting count */
+static size_t dramrange_merge(struct MemorySystem *m, struct DRAMRange *r,
+                              size_t n, size_t elen)
+{
+	size_t ri = 0;
+	for (size_t i = 1; i < n; i++) {
+		if (msys_dramrange_adjacent(m, &r[ri], &r[i], elen)) {
+			r[ri].entry_cnt += r[i].entry_cnt;
+		} else {
+			r[++ri] = r[i];
+		}
+	}
+	return ri + 1;
+}
+
+struct RangeMergeJob {
+	struct MemorySystem *m;
+	struct DRAMRange *r;
+	size_t n;
+	size_t elen;
+	size_t *cnt; /* Ranges left in each chunk */
+};
+
+static void dramrange_merge_chunk(void *arg, int t, int nthreads)
+{
+	struct RangeMergeJob *j = (struct RangeMergeJob *)arg;
+	const size_t lo = par_chunk(j->n, t, nthreads);
+	const size_t hi = par_chunk(j->n, t + 1, nthreads);
+	j->cnt[t] = (hi > lo) ? dramrange_merge(j->m, &j->r[lo], hi - lo, j->elen) : 0;
+}
+
+size_t msys_dramrange_coalesce(struct MemorySystem *m, struct DRAMRange *r,
+                               size_t n, size_t elen, void *scratch,
+                               int nthreads)
+{
+	struct RangeMergeJob job = { .m = m, .r = r, .n = n, .elen = elen };
+	size_t ri = 0;
+
+	if (!n) {
+		return 0;
+	}
+	dramrange_sort(r, n, scratch, nthreads);
+	if (nthreads <= 1 || n < (size_t)nthreads * RADIX_MIN ||
+	    (job.cnt = malloc(nthreads * sizeof(*job.cnt))) == NULL)
+	{
+		return dramrange_merge(m, r, n, elen);
+	}
+	/*
+	 * Merging only depends on neighbouring pairs, so chunks can be merged
+	 * separately and then stitched together across their boundaries.
+	 */
+	par_run(nthreads, dramrange_merge_chunk, &job);
+	for (int t = 0; t < nthreads; t++) {
+		size_t i = par_chunk(n, t, nthreads);
+		size_t c = job.cnt[t];
+		if (c && ri && msys_dramrange_adjacent(m, &r[ri - 1], &r[i], elen)) {
+			r[ri - 1].entry_cnt += r[i].entry_cnt;
+			i++;
+			c--;
+		}
+		memmove(&r[ri], &r[i], c * sizeof(*r));
+		ri += c;
+	}
+	free(job.cnt);
+	return ri;
+}
+
+size_t ramses_dramrange_coalesce(struct MemorySystem *m, struct DRAMRange *r,
+                                 size_t n, size_t elen)
+{
+	return msys_dramrange_coalesce(m, r, n, elen, NULL, 1);
+}
+
+size_t msys_resolve_range(struct MemorySystem *m, physaddr_t start,
+                          size_t len, size_t elen, struct DRAMRange *out,
+                          void *scratch)
+{
+	const size_t ecnt = len / elen;
+	physaddr_t pabuf[BATCH_BLOCK];
+	struct DRAMAddr dabuf[BATCH_BLOCK];
+	size_t n;
+
+	if (m->fused != NULL && fused_range_supported(&m->mapping.props, elen)) {
+		n = fused_resolve_range(m->fused, &m->mapping.props, start, len, elen, out);
+		if (out == NULL) {
+			return n;
+		}
+	} else if (out == NULL) {
+		return ecnt;
+	} else {
+		for (size_t base = 0; base < ecnt; base += BATCH_BLOCK) {
+			const size_t cnt = (ecnt - base < BATCH_BLOCK) ? ecnt - base : BATCH_BLOCK;
+			for (size_t i = 0; i < cnt; i++) {
+				pabuf[i] = start + (base + i) * elen;
+			}
+			ramses_resolve_batch(m, pabuf, dabuf, cnt);
+			for (size_t i = 0; i < cnt; i++) {
+				out[base + i].start = dabuf[i];
+				out[base + i].entry_cnt = 1;
+			}
+		}
+		n = ecnt;
+	}
+	return msys_dramrange_coalesce(m, out, n, elen, scratch, 1);
+}
+
+size_t ramses_resolve_range(struct MemorySystem *m, physaddr_t start,
+                            size_t len, size_t elen, struct DRAMRange *out)
+{
+	return msys_resolve_range(m, start, len, elen, out, NULL);
+}
+
+struct VerifyJob {
+	struct MemorySystem *m;
+	const struct PhysRange *ranges;
+	size_t step;
+	size_t total; /* Addresses to check across all ranges */
+	bool found[MSYS_VERIFY_MAX_THREADS];
+	struct MSYSVerifyFail fail[MSYS_VERIFY_MAX_THREADS];
+};
+
+static size_t range_steps(const struct PhysRange *r, size_t step)
+{
+	return (r->end > r->start) ? (r->end - r->start + step - 1) / step : 0;
+}
+
+static void verify_fail(struct VerifyJob *j, int t, physaddr_t addr,
+                        struct DRAMAddr da, physaddr_t pa, int form)
+{
+	j->fail[t] = (struct MSYSVerifyFail){
+		.addr = addr, .da = da, .pa = pa, .form = form
+	};
+	j->found[t] = true;
+}
+
+/* Check addresses [lo, hi) of the concatenated ranges, stopping at a failure */
+static void verify_part(void *arg, int t, int nthreads)
+{
+	struct VerifyJob *j = (struct VerifyJob *)arg;
+	struct MemorySystem *m = j->m;
+	size_t lo = par_chunk(j->total, t, nthreads);
+	const size_t hi = par_chunk(j->total, t + 1, nthreads);
+	physaddr_t in[BATCH_BLOCK], pa[BATCH_BLOCK], fpa[BATCH_BLOCK], jpa[BATCH_BLOCK];
+	struct DRAMAddr da[BATCH_BLOCK], fda[BATCH_BLOCK], jda[BATCH_BLOCK];
+	size_t ri = 0, rbase = 0;
+
+	j->found[t] = false;
+	while (lo < hi) {
+		const size_t first = lo;
+		size_t cnt = 0;
+		/* Gather the next block of addresses, which may span ranges */
+		while (cnt < BATCH_BLOCK && lo < hi) {
+			size_t rsteps = range_steps(&j->ranges[ri], j->step);
+			if (lo - rbase >= rsteps) {
+				rbase += rsteps;
+				ri++;
+				continue;
+			}
+			in[cnt++] = j->ranges[ri].start + (lo - rbase) * j->step;
+			lo++;
+		}
+		interp_batch(m, in, da, cnt);
+		interp_reverse_batch(m, da, pa, cnt);
+		/* Compiled forms are held to the interpreted batch translation */
+		for (size_t i = 0; m->fused != NULL && i < cnt; i++) {
+			fda[i] = fused_resolve(m->fused, in[i]);
+			fpa[i] = fused_resolve_reverse(m->fused, da[i]);
+		}
+		for (size_t i = 0; m->jit != NULL && i < cnt; i++) {
+			jda[i] = jit_resolve(m->jit, in[i]);
+			jpa[i] = jit_resolve_reverse(m->jit, da[i]);
+		}
+		for (size_t i = 0; i < cnt; i++) {
+			if (pa[i] != in[i]) {
+				verify_fail(j, t, in[i], da[i], pa[i], 0);
+				return;
+			}
+			/* The batch kernels are held to the per-address path */
+			if ((first + i) % MSYS_VERIFY_SCALAR_STRIDE == 0) {
+				struct DRAMAddr sda = interp_resolve(m, in[i]);
+				physaddr_t spa = interp_resolve_reverse(m, da[i]);
+				if (ramses_dramaddr_cmp(sda, da[i]) || spa != in[i]) {
+					verify_fail(j, t, in[i], sda, spa, MSYS_VERIFY_SCALAR);
+					return;
+				}
+			}
+			if (m->fused != NULL &&
+			           (ramses_dramaddr_cmp(fda[i], da[i]) || fpa[i] != in[i]))
+			{
+				verify_fail(j, t, in[i], fda[i], fpa[i], MSYS_FUSE);
+				return;
+			} else if (m->jit != NULL &&
+			           (ramses_dramaddr_cmp(jda[i], da[i]) || jpa[i] != in[i]))
+			{
+				verify_fail(j, t, in[i], jda[i], jpa[i], MSYS_JIT);
+				return;
+			}
+		}
+	}
+}
+
+int ramses_msys_verify(struct MemorySystem *m, const struct PhysRange *ranges,
+                       size_t nranges, size_t pagesz, int nthreads,
+                       struct MSYSVerifyFail *fail)
+{
+	struct VerifyJob job = {
+		.m = m,
+		.ranges = ranges,
+		.step = ramses_msys_granularity(m, pagesz)
+	};
+
+	for (size_t i = 0; i < nranges; i++) {
+		job.total += range_steps(&ranges[i], job.step);
+	}
+	if (nthreads < 1) {
+		nthreads = 1;
+	} else if (nthreads > MSYS_VERIFY_MAX_THREADS) {
+		nthreads = MSYS_VERIFY_MAX_THREADS;
+	}
+	if ((size_t)nthreads > job.total / BATCH_BLOCK) {
+		nthreads = (job.total > BATCH_BLOCK) ? job.total / BATCH_BLOCK : 1;
+	}
+	par_run(nthreads, verify_part, &job);
+	/* Chunks follow the order of `ranges', so the first to fail holds the answer */
+	for (int t = 0; t < nthreads; t++) {
+		if (job.found[t]) {
+			if (fail != NULL) {
+				*fail = job.fail[t];
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
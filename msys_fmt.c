@@ -18,6 +18,8 @@
 
 #include <ramses/msys.h>
 #include "msys_int.h"
+#include "fuse.h"
+#include "jit.h"
 
 #include <stddef.h>
 #include <ctype.h>
@@ -27,10 +29,12 @@
 /* Mapping configs */
 #include "map/naive_msys.h"
 #include "map/x86/intel_msys.h"
+#include "map/xor_msys.h"
 
 static const struct MapConfig *MAP_CONFIGS[] = {
 	&MAP_NAIVE_CONFIG,
-	&MAP_INTEL_CONFIG
+	&MAP_INTEL_CONFIG,
+	&MAP_XOR_CONFIG
 };
 static const size_t
 MAP_CONFIGS_LEN = sizeof(MAP_CONFIGS) / sizeof(*MAP_CONFIGS);
@@ -257,6 +261,8 @@ static int msys_writeout(struct MemorySystem *m,
 	m->remaps = out_remaps;
 	m->nallocs = alloc_top;
 	m->allocs = out_allocs;
+	m->fused = NULL;
+	m->jit = NULL;
 	return 0;
 }
 
@@ -266,6 +272,12 @@ static int msys_writeout(struct MemorySystem *m,
 #define MAX_CFGARGS 128
 
 int ramses_msys_load(const char *str, struct MemorySystem *m, size_t *erridx)
+{
+	return ramses_msys_load_flags(str, m, erridx, 0);
+}
+
+int ramses_msys_load_flags(const char *str, struct MemorySystem *m,
+                           size_t *erridx, int flags)
 {
 	int err = -1;
 #define EBAIL(e) { err = (e); goto bail; }
@@ -456,6 +468,12 @@ int ramses_msys_load(const char *str, struct MemorySystem *m, size_t *erridx)
 		m, inst_remaps, inst_top, remaps, remap_top, allocs, alloc_top
 	)))
 	{
+		if (flags & (MSYS_FUSE | MSYS_JIT)) {
+			m->fused = fused_build(m);
+		}
+		if ((flags & MSYS_JIT) && m->fused != NULL) {
+			m->jit = jit_build(m->fused);
+		}
 		return 0;
 	}
 
@@ -476,6 +494,8 @@ const char *ramses_msys_load_strerr(int err)
 
 void ramses_msys_free(struct MemorySystem *m)
 {
+	jit_free(m->jit);
+	fused_free(m->fused);
 	free_allocs(m->allocs, m->nallocs);
 	free(m->allocs);
 }
@@ -9,6 +9,8 @@
 
 #include <ramses/map.h>
 #include <ramses/remap.h>
+#include <ramses/msys.h>
+#include <ramses/util.h>
 
 struct MSYSParam {
 	char *name;
@@ -42,4 +44,34 @@ struct RemapConfig {
 	msys_remap_config_fn_t func;
 };
 
+/* Distance in bytes from `b' to `a' within a bank, in (row, col) order */
+static inline size_t
+msys_dramaddr_rcdiff(struct DRAMAddr a, struct DRAMAddr b, struct MemorySystem *m)
+{
+	return ((a.row - b.row) * m->mapping.props.col_cnt + (a.col - b.col)) *
+	       m->mapping.props.cell_size;
+}
+
+/* Whether range `b' picks up in DRAM where range `a' ends */
+static inline bool msys_dramrange_adjacent(struct MemorySystem *m,
+                                           const struct DRAMRange *a,
+                                           const struct DRAMRange *b,
+                                           size_t elen)
+{
+	return ramses_dramaddr_same(DRAM_BANK, a->start, b->start) &&
+	       msys_dramaddr_rcdiff(b->start, a->start, m) == a->entry_cnt * elen;
+}
+
+/*
+ * ramses_resolve_range and ramses_dramrange_coalesce, sorting with `scratch'
+ * (room for as many ranges as are being sorted) instead of allocating it.
+ * `scratch' may be NULL. Coalescing runs on `nthreads' threads.
+ */
+size_t msys_resolve_range(struct MemorySystem *m, physaddr_t start,
+                          size_t len, size_t elen, struct DRAMRange *out,
+                          void *scratch);
+size_t msys_dramrange_coalesce(struct MemorySystem *m, struct DRAMRange *r,
+                               size_t n, size_t elen, void *scratch,
+                               int nthreads);
+
 #endif /* msys_int.h */
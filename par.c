@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "par.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+struct ParTask {
+	par_fn_t fn;
+	void *arg;
+	int t;
+	int nthreads;
+	pthread_t thread;
+	bool started;
+};
+
+/* Nesting depth of par_run calls with more than one task on this thread */
+static __thread int par_depth;
+
+int par_nested(void)
+{
+	return par_depth > 0;
+}
+
+static void *par_start(void *arg)
+{
+	struct ParTask *task = (struct ParTask *)arg;
+	par_depth = 1;
+	task->fn(task->arg, task->t, task->nthreads);
+	return NULL;
+}
+
+void par_run(int nthreads, par_fn_t fn, void *arg)
+{
+	struct ParTask *tasks = NULL;
+
+	if (nthreads > 1) {
+		tasks = calloc(nthreads, sizeof(*tasks));
+	}
+	par_depth += (nthreads > 1);
+	if (tasks == NULL) {
+		for (int t = 0; t < nthreads; t++) {
+			fn(arg, t, nthreads);
+		}
+		par_depth -= (nthreads > 1);
+		return;
+	}
+	for (int t = 1; t < nthreads; t++) {
+		tasks[t] = (struct ParTask){
+			.fn = fn, .arg = arg, .t = t, .nthreads = nthreads
+		};
+		tasks[t].started = !pthread_create(&tasks[t].thread, NULL,
+		                                   par_start, &tasks[t]);
+	}
+	fn(arg, 0, nthreads);
+	for (int t = 1; t < nthreads; t++) {
+		if (tasks[t].started) {
+			pthread_join(tasks[t].thread, NULL);
+		} else {
+			fn(arg, t, nthreads);
+		}
+	}
+	free(tasks);
+	par_depth--;
+}
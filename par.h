@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is licensed under the GPL2+.
+ */
+
+/* Minimal fork-join parallelism */
+
+#ifndef RAMSES_PAR_H
+#define RAMSES_PAR_H 1
+
+#include <stddef.h>
+
+typedef void (*par_fn_t)(void *arg, int t, int nthreads);
+
+/*
+ * Run fn(arg, t, nthreads) for every t in [0, nthreads), each on its own
+ * thread where possible, and wait for all of them to finish.
+ * Work that cannot be given a thread runs on the calling thread.
+ */
+void par_run(int nthreads, par_fn_t fn, void *arg);
+/*
+ * Whether the caller runs as a task of a par_run with more than one task,
+ * i.e. should not fan out further.
+ */
+int par_nested(void);
+
+/* Bounds of chunk `t' when splitting `n' items `nthreads' ways */
+static inline size_t par_chunk(size_t n, int t, int nthreads)
+{
+	return (n / nthreads) * t + ((n % nthreads) * t) / nthreads;
+}
+
+#endif /* par.h */
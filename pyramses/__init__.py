@@ -18,11 +18,15 @@
 
 import os
 import sys
-import struct
 import ctypes
 import ctypes.util
 import functools
 
+try:
+    import numpy as _np
+except ImportError:
+    _np = None
+
 LIBNAME = 'libramses.so'
 
 
@@ -30,6 +34,19 @@ _physaddr_t = ctypes.c_ulonglong
 
 BADADDR = _physaddr_t(-1).value
 
+MSYS_FUSE = 1
+MSYS_JIT = 2
+MSYS_VERIFY_SCALAR = 4
+
+BUFMAP_NOCLOBBER = 1
+BUFMAP_ZEROFILL = 2
+BUFMAP_SEARCHIDX = 4
+BUFMAP_ROWIDX = 8
+
+SIMD_LEVEL_SCALAR = 0
+SIMD_LEVEL_AVX2 = 1
+SIMD_LEVEL_AVX512 = 2
+
 
 class RamsesError(Exception):
     """Exception class used to encapsulate RAMSES errors"""
@@ -52,18 +69,18 @@ class DRAMAddr(ctypes.Structure):
 
     def __eq__(self, other):
         if isinstance(other, DRAMAddr):
-            return self.numeric_value == other.numeric_value
+            return self.key == other.key
         else:
             return NotImplemented
 
     def __lt__(self, other):
         if isinstance(other, DRAMAddr):
-            return self.numeric_value < other.numeric_value
+            return self.key < other.key
         else:
             return NotImplemented
 
     def __hash__(self):
-        return self.numeric_value
+        return self.key
 
     def __len__(self):
         return len(self._fields_)
@@ -86,6 +103,13 @@ class DRAMAddr(ctypes.Structure):
         return (self.col + (self.row << 16) + (self.bank << 32) +
                 (self.rank << 40) + (self.dimm << 48) + (self.chan << 52))
 
+    @property
+    def key(self):
+        """Same as ramses_dramaddr_key: a unique integer ordering like the
+        address itself, from channel down to column"""
+        return ((self.chan << 56) | (self.dimm << 48) | (self.rank << 40) |
+                (self.bank << 32) | (self.row << 16) | self.col)
+
     def __add__(self, other):
         if isinstance(other, DRAMAddr):
             return type(self)(
@@ -113,44 +137,109 @@ class DRAMAddr(ctypes.Structure):
             return NotImplemented
 
 
+# Layout of struct DRAMAddr, for the array methods
+if _np is not None:
+    DRAMADDR_DTYPE = _np.dtype([('chan', _np.uint8),
+                                ('dimm', _np.uint8),
+                                ('rank', _np.uint8),
+                                ('bank', _np.uint8),
+                                ('row', _np.uint16),
+                                ('col', _np.uint16)])
+else:
+    DRAMADDR_DTYPE = None
+
+
+def _require_numpy():
+    if _np is None:
+        raise RamsesError('NumPy is required for array operations')
+
+
+def _array_in(a, dtype):
+    """View `a' as a C-contiguous array of `dtype', copying only if needed"""
+    return _np.ascontiguousarray(a, dtype=dtype)
+
+
+def _array_out(out, shape, dtype):
+    if out is None:
+        return _np.empty(shape, dtype=dtype)
+    if (out.dtype != dtype or out.shape != shape or
+            not out.flags.c_contiguous or not out.flags.writeable):
+        raise ValueError('out must be a writeable C-contiguous array of '
+                         'shape {} and dtype {}'.format(shape, dtype))
+    return out
+
+
 def _assert_lib():
     if _lib is None:
         init_lib()
 
 
+def simd_cap(level):
+    """Keep memory systems loaded from now on from using vector extensions
+    wider than `level' (a SIMD_LEVEL_* value). Returns the previous cap."""
+    _assert_lib()
+    return _lib.ramses_simd_cap(level)
+
+
 class _MappingProps(ctypes.Structure):
     _fields_ = [('granularity', _physaddr_t),
                 ('bank_cnt', ctypes.c_uint),
                 ('col_cnt', ctypes.c_uint),
-                ('cell_size', ctypes.c_uint)]
+                ('cell_size', ctypes.c_uint),
+                ('linear_mask', _physaddr_t)]
 
 class _Mapping(ctypes.Structure):
     _fields_ = [('map', ctypes.c_void_p),
                 ('map_reverse', ctypes.c_void_p),
                 ('twiddle_gran', ctypes.c_void_p),
+                ('map_batch', ctypes.c_void_p),
+                ('map_reverse_batch', ctypes.c_void_p),
                 ('flags', ctypes.c_int),
                 ('arg', ctypes.c_void_p),
                 ('props', _MappingProps)]
 
 
+class _PhysRange(ctypes.Structure):
+    _fields_ = [('start', _physaddr_t),
+                ('end', _physaddr_t)]
+
+class _PTE(ctypes.Structure):
+    _fields_ = [('pa', _physaddr_t),
+                ('va', ctypes.c_size_t),
+                ('npages', ctypes.c_size_t)]
+
+class _DRAMRange(ctypes.Structure):
+    _fields_ = [('start', DRAMAddr),
+                ('entry_cnt', ctypes.c_size_t)]
+
+
+class MSYSVerifyFail(ctypes.Structure):
+    _fields_ = [('addr', _physaddr_t),
+                ('da', DRAMAddr),
+                ('pa', _physaddr_t),
+                ('form', ctypes.c_int)]
+
+
 class MemorySystem(ctypes.Structure):
     _fields_ = [('mapping', _Mapping),
                 ('nremaps', ctypes.c_size_t),
                 ('remaps', ctypes.c_void_p),
                 ('nallocs', ctypes.c_size_t),
-                ('allocs', ctypes.c_void_p)]
+                ('allocs', ctypes.c_void_p),
+                ('fused', ctypes.c_void_p),
+                ('jit', ctypes.c_void_p)]
 
-    def load(self, s):
+    def load(self, s, flags=0):
         _assert_lib()
         cs = ctypes.c_char_p(s.encode('utf-8'))
-        r = _lib.ramses_msys_load(cs, ctypes.byref(self), None)
+        r = _lib.ramses_msys_load_flags(cs, ctypes.byref(self), None, flags)
         if r:
             raise RamsesError('ramses_msys_load error: ' +
                               _lib.ramses_msys_load_strerr(r).decode('ascii'))
 
-    def load_file(self, fname):
+    def load_file(self, fname, flags=0):
         with open(fname, 'r') as f:
-            return self.load(f.read())
+            return self.load(f.read(), flags)
 
     def granularity(self, pagesize):
         _assert_lib()
@@ -164,6 +253,46 @@ class MemorySystem(ctypes.Structure):
         _assert_lib()
         return _lib.ramses_resolve_reverse(ctypes.byref(self), dram_addr)
 
+    def resolve_array(self, phys_addrs, out=None):
+        """Resolve an array of physical addresses into an array of
+        DRAMADDR_DTYPE, in a single call into the library. C-contiguous uint64
+        input is used in place; results are written to `out' if given.
+        """
+        _assert_lib()
+        _require_numpy()
+        pa = _array_in(phys_addrs, _np.uint64)
+        out = _array_out(out, pa.shape, DRAMADDR_DTYPE)
+        _lib.ramses_resolve_batch(ctypes.byref(self), pa.ctypes.data,
+                                  out.ctypes.data, pa.size)
+        return out
+
+    def resolve_reverse_array(self, dram_addrs, out=None):
+        """Inverse of resolve_array: DRAMADDR_DTYPE array in, uint64 out"""
+        _assert_lib()
+        _require_numpy()
+        da = _array_in(dram_addrs, DRAMADDR_DTYPE)
+        out = _array_out(out, da.shape, _np.uint64)
+        _lib.ramses_resolve_reverse_batch(ctypes.byref(self), da.ctypes.data,
+                                          out.ctypes.data, da.size)
+        return out
+
+    def verify(self, ranges, pagesize, nthreads=None):
+        """Check that every address in `ranges' (a sequence of (start, stop)
+        pairs) round-trips through the memory system, stepping by
+        granularity(pagesize). A sample is also resolved one address at a
+        time, and compiled forms are checked against the interpreted one.
+        Returns None on success or the first MSYSVerifyFail.
+        """
+        _assert_lib()
+        arr = (_PhysRange * len(ranges))(*ranges)
+        fail = MSYSVerifyFail()
+        if nthreads is None:
+            nthreads = os.cpu_count() or 1
+        if _lib.ramses_msys_verify(ctypes.byref(self), arr, len(ranges),
+                                   pagesize, nthreads, ctypes.byref(fail)):
+            return fail
+        return None
+
     def __del__(self):
         try:
             if _lib is not None:
@@ -206,18 +335,32 @@ class _VMMap:
         return self.trans.translate(addr, self.trans.page_shift, self.trans.arg)
 
     def translate_range(self, addr, page_count):
-        obuf = ctypes.create_string_buffer(page_count * ctypes.sizeof(ctypes.c_ulonglong))
+        obuf = (_physaddr_t * page_count)()
         cnt = self.trans.translate_range(
             addr, page_count, obuf, self.trans.page_shift, self.trans.arg
         )
-        unpacker = struct.iter_unpack('Q', obuf.raw)
-        return [next(unpacker)[0] for _ in range(cnt)]
+        return obuf[:cnt]
+
+    def translate_array(self, addr, page_count, out=None):
+        """Like translate_range, but fills and returns a uint64 array.
+        Only the translated prefix is returned, as a view of `out' if given.
+        """
+        _require_numpy()
+        out = _array_out(out, (page_count,), _np.uint64)
+        cnt = self.trans.translate_range(
+            addr, page_count, out.ctypes.data, self.trans.page_shift, self.trans.arg
+        )
+        return out[:cnt]
 
 
 class Pagemap(_VMMap):
-    def __init__(self, pid=None):
+    """Translation through /proc/<pid>/pagemap. If `buf' is an (address,
+    length) pair in this process, translate at the size of the pages backing
+    it instead of the base page size."""
+    def __init__(self, pid=None, buf=None):
         pidstr = str(pid) if pid is not None else 'self'
         self.pagemap_path = os.path.join('/proc', pidstr, 'pagemap')
+        self.buf = buf
         self.trans = None
         self.fd = -1
 
@@ -225,7 +368,11 @@ class Pagemap(_VMMap):
         _assert_lib()
         self.fd = os.open(self.pagemap_path, os.O_RDONLY)
         self.trans = _nulltrans()
-        _lib.ramses_translate_pagemap(ctypes.byref(self.trans), self.fd)
+        if self.buf is None:
+            _lib.ramses_translate_pagemap(ctypes.byref(self.trans), self.fd)
+        else:
+            _lib.ramses_translate_pagemap_huge(ctypes.byref(self.trans),
+                                               self.fd, *self.buf)
         return self
 
     def __exit__(self, e_type, e_val, traceb):
@@ -242,6 +389,308 @@ class Heurmap(_VMMap):
         _lib.ramses_translate_heuristic(ctypes.byref(self.trans), cont_bits, base)
 
 
+class _TransCacheStats(ctypes.Structure):
+    _fields_ = [('lookups', ctypes.c_uint64),
+                ('hits', ctypes.c_uint64),
+                ('misses', ctypes.c_uint64),
+                ('backend_calls', ctypes.c_uint64),
+                ('backend_pages', ctypes.c_uint64),
+                ('invalidations', ctypes.c_uint64)]
+
+
+class _TransCache(ctypes.Structure):
+    _fields_ = [('backend', _Translation),
+                ('entries', ctypes.c_void_p),
+                ('nsets', ctypes.c_size_t),
+                ('readahead', ctypes.c_size_t),
+                ('clock', ctypes.c_uint64),
+                ('stats', _TransCacheStats)]
+
+
+class CachedMap(_VMMap):
+    """Caches the translations of another, entered, map"""
+    def __init__(self, vmmap, entries=4096, readahead=64):
+        self.vmmap = vmmap
+        self.entries = entries
+        self.readahead = readahead
+        self.cache = None
+        self.trans = None
+
+    def __enter__(self):
+        _assert_lib()
+        self.cache = _TransCache()
+        if _lib.ramses_translate_cache_init(ctypes.byref(self.cache),
+                                            ctypes.byref(self.vmmap.trans),
+                                            self.entries, self.readahead):
+            raise MemoryError('Cannot allocate translation cache')
+        self.trans = _nulltrans()
+        _lib.ramses_translate_cache(ctypes.byref(self.trans),
+                                    ctypes.byref(self.cache))
+        return self
+
+    def __exit__(self, e_type, e_val, traceb):
+        self.trans = None
+        _lib.ramses_translate_cache_free(ctypes.byref(self.cache))
+        self.cache = None
+        return False
+
+    def invalidate(self, addr, length):
+        _lib.ramses_translate_cache_invalidate(ctypes.byref(self.cache),
+                                               addr, length)
+
+    def flush(self):
+        _lib.ramses_translate_cache_flush(ctypes.byref(self.cache))
+
+    def stats(self, reset=False):
+        s = _TransCacheStats()
+        _lib.ramses_translate_cache_stats(ctypes.byref(self.cache),
+                                          ctypes.byref(s), reset)
+        return {f: getattr(s, f) for f, _ in s._fields_}
+
+
+_BMSTATS_HIST_LEN = 24
+
+class _BMStats(ctypes.Structure):
+    _fields_ = [('entries', ctypes.c_size_t),
+                ('pages', ctypes.c_size_t),
+                ('pte_cnt', ctypes.c_size_t),
+                ('pte_max_pages', ctypes.c_size_t),
+                ('phys_runs', ctypes.c_size_t),
+                ('range_cnt', ctypes.c_size_t),
+                ('range_max', ctypes.c_size_t),
+                ('range_hist', ctypes.c_size_t * _BMSTATS_HIST_LEN),
+                ('bank_cnt', ctypes.c_size_t),
+                ('bank_rows_min', ctypes.c_size_t),
+                ('bank_rows_max', ctypes.c_size_t),
+                ('rows', ctypes.c_size_t),
+                ('rows_full', ctypes.c_size_t),
+                ('rows_partial', ctypes.c_size_t),
+                ('triples', ctypes.c_size_t)]
+
+
+class _BankDir(ctypes.Structure):
+    _fields_ = [('banks', ctypes.c_void_p),
+                ('bank_cnt', ctypes.c_size_t),
+                ('lut', ctypes.c_void_p),
+                ('dim', ctypes.c_uint * 4)]
+
+class _RangeIndex(ctypes.Structure):
+    _fields_ = [('keys', ctypes.c_void_p),
+                ('ranks', ctypes.c_void_p)]
+
+class _VAIndex(ctypes.Structure):
+    _fields_ = [('base', ctypes.c_void_p),
+                ('pa', ctypes.c_void_p),
+                ('ext', ctypes.c_void_p),
+                ('len', ctypes.c_size_t),
+                ('dense', ctypes.c_int)]
+
+class _RowIndex(ctypes.Structure):
+    _fields_ = [('bits', ctypes.c_void_p),
+                ('rank', ctypes.c_void_p),
+                ('bank_word', ctypes.c_void_p),
+                ('bank_row', ctypes.c_void_p),
+                ('rowpos', ctypes.c_void_p)]
+
+class _BufferMap(ctypes.Structure):
+    _fields_ = [('bufbase', ctypes.c_void_p),
+                ('ptes', ctypes.c_void_p),
+                ('pte_cnt', ctypes.c_size_t),
+                ('page_size', ctypes.c_size_t),
+                ('ranges', ctypes.c_void_p),
+                ('range_cnt', ctypes.c_size_t),
+                ('entry_len', ctypes.c_size_t),
+                ('msys', ctypes.c_void_p),
+                ('trans', _Translation),
+                ('bankdir', _BankDir),
+                ('rindex', _RangeIndex),
+                ('vaindex', _VAIndex),
+                ('rowidx', _RowIndex),
+                ('snapshot', ctypes.c_void_p),
+                ('snapshot_len', ctypes.c_size_t)]
+
+class _BMPos(ctypes.Structure):
+    _fields_ = [('ri', ctypes.c_size_t),
+                ('ei', ctypes.c_size_t)]
+
+class _AddrEntry(ctypes.Structure):
+    _fields_ = [('virtp', ctypes.c_void_p),
+                ('dramaddr', DRAMAddr)]
+
+class _BMIter(ctypes.Structure):
+    _fields_ = [('bm', ctypes.c_void_p),
+                ('pos', _BMPos),
+                ('end', _BMPos),
+                ('da', DRAMAddr),
+                ('pa', _physaddr_t),
+                ('pte', ctypes.c_size_t)]
+
+
+class _RowTriple(ctypes.Structure):
+    _fields_ = [('victim', DRAMAddr),
+                ('lo', _BMPos),
+                ('mid', _BMPos),
+                ('hi', _BMPos)]
+
+_TripleFunc = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.POINTER(_RowTriple),
+                               ctypes.c_void_p)
+
+
+class BufferMap:
+    """DRAM map of the buffer at `addr' of `length' bytes.
+    If `snapshot' is a file descriptor, the map is loaded from the snapshot
+    written there by save() instead, checking its memory system string
+    against `msys_str' if given.
+    """
+    def __init__(self, addr, length, vmmap, msys, flags=BUFMAP_NOCLOBBER,
+                 nthreads=None, snapshot=None, msys_str=None):
+        self.addr = addr
+        self.length = length
+        self.vmmap = vmmap
+        self.msys = msys
+        self.flags = flags
+        self.nthreads = nthreads
+        self.snapshot = snapshot
+        self.msys_str = msys_str
+        self.bm = None
+
+    def __enter__(self):
+        _assert_lib()
+        bm = _BufferMap()
+        if self.snapshot is not None:
+            err = _lib.ramses_bufmap_load_mmap(
+                ctypes.byref(bm), self.snapshot,
+                ctypes.byref(self.vmmap.trans), ctypes.byref(self.msys),
+                None if self.msys_str is None else self.msys_str.encode('utf-8'),
+                self.flags
+            )
+        elif self.nthreads is None:
+            err = _lib.ramses_bufmap(ctypes.byref(bm), self.addr, self.length,
+                                     ctypes.byref(self.vmmap.trans),
+                                     ctypes.byref(self.msys), self.flags)
+        else:
+            err = _lib.ramses_bufmap_parallel(
+                ctypes.byref(bm), self.addr, self.length,
+                ctypes.byref(self.vmmap.trans), ctypes.byref(self.msys),
+                self.flags, self.nthreads
+            )
+        if err:
+            raise RamsesError('ramses_bufmap failed')
+        self.bm = bm
+        return self
+
+    def __exit__(self, e_type, e_val, traceb):
+        _lib.ramses_bufmap_free(ctypes.byref(self.bm))
+        self.bm = None
+        return False
+
+    def extend(self, addr, length):
+        if _lib.ramses_bufmap_extend(ctypes.byref(self.bm), addr, length):
+            raise RamsesError('ramses_bufmap_extend failed')
+
+    def remove(self, addr, length):
+        if _lib.ramses_bufmap_remove(ctypes.byref(self.bm), addr, length):
+            raise RamsesError('ramses_bufmap_remove failed')
+
+    @property
+    def entry_len(self):
+        return self.bm.entry_len
+
+    def ptes(self):
+        """List of (physical address, virtual address, page count) of each
+        extent, sorted by physical address"""
+        return [(p.pa, p.va, p.npages) for p in
+                (_PTE * self.bm.pte_cnt).from_address(self.bm.ptes)]
+
+    def ranges(self):
+        """List of (start DRAMAddr, entry count) of each range, in order"""
+        return [(DRAMAddr(*r.start), r.entry_cnt) for r in
+                (_DRAMRange * self.bm.range_cnt).from_address(self.bm.ranges)]
+
+    def end(self):
+        """Position just past the last entry"""
+        return (self.bm.range_cnt, 0)
+
+    def entry(self, pos):
+        """(virtual address, DRAMAddr) of the entry at position `pos'"""
+        e = _AddrEntry()
+        if _lib.ramses_bufmap_get_entry(ctypes.byref(self.bm), _BMPos(*pos),
+                                        ctypes.byref(e)):
+            raise RamsesError('no entry at {}'.format(pos))
+        return (e.virtp, DRAMAddr(*e.dramaddr))
+
+    def entries(self, start=(0, 0), end=None):
+        """Generate the entries from `start' up to `end', as for entry()"""
+        it = _BMIter()
+        e = _AddrEntry()
+        _lib.ramses_bufmap_iter_init(ctypes.byref(it), ctypes.byref(self.bm),
+                                     _BMPos(*start),
+                                     _BMPos(*(end or self.end())))
+        while not _lib.ramses_bufmap_iter_next(ctypes.byref(it), ctypes.byref(e)):
+            yield (e.virtp, DRAMAddr(*e.dramaddr))
+
+    def find(self, dramaddr):
+        """Position of the entry at `dramaddr', or None if not mapped"""
+        pos = _BMPos()
+        if _lib.ramses_bufmap_find(ctypes.byref(self.bm), dramaddr,
+                                   ctypes.byref(pos)):
+            return None
+        return (pos.ri, pos.ei)
+
+    def find_va(self, va):
+        """(position of the entry, DRAMAddr) of virtual address `va', or
+        None if not mapped"""
+        pos = _BMPos()
+        da = DRAMAddr()
+        if _lib.ramses_bufmap_find_va(ctypes.byref(self.bm), va,
+                                      ctypes.byref(pos), ctypes.byref(da)):
+            return None
+        return ((pos.ri, pos.ei), da)
+
+    def has_row(self, dramaddr):
+        """Whether any part of the row of `dramaddr' is mapped"""
+        return bool(_lib.ramses_bufmap_has_row(ctypes.byref(self.bm), dramaddr))
+
+    def neighbors(self, dramaddr, dist=1):
+        """Positions of an entry of the rows `dist' below and above that of
+        `dramaddr', each None if not mapped"""
+        out = (_BMPos * 2)()
+        mask = _lib.ramses_bufmap_neighbors(ctypes.byref(self.bm), dramaddr,
+                                            dist, out)
+        return tuple((out[i].ri, out[i].ei) if mask & (1 << i) else None
+                     for i in range(2))
+
+    def bank_rows(self, dramaddr):
+        """Number of rows of the bank of `dramaddr' with any part mapped"""
+        return _lib.ramses_bufmap_bank_rows(ctypes.byref(self.bm), dramaddr)
+
+    def triples(self):
+        """List of (victim DRAMAddr, lo, mid, hi positions) of each triple of
+        fully mapped adjacent rows, in DRAM order"""
+        out = []
+        def cb(t, arg):
+            t = t.contents
+            out.append((DRAMAddr(*t.victim), (t.lo.ri, t.lo.ei),
+                        (t.mid.ri, t.mid.ei), (t.hi.ri, t.hi.ei)))
+            return 0
+        _lib.ramses_bufmap_triples(ctypes.byref(self.bm), _TripleFunc(cb), None)
+        return out
+
+    def save(self, fd, msys_str):
+        """Write a snapshot to file descriptor `fd'; `msys_str' is the string
+        the memory system was loaded from"""
+        if _lib.ramses_bufmap_save(ctypes.byref(self.bm),
+                                   msys_str.encode('utf-8'), fd):
+            raise RamsesError('ramses_bufmap_save failed')
+
+    def stats(self):
+        s = _BMStats()
+        _lib.ramses_bufmap_stats(ctypes.byref(self.bm), ctypes.byref(s))
+        d = {f: getattr(s, f) for f, _ in s._fields_}
+        d['range_hist'] = list(s.range_hist)
+        return d
+
+
 # Module init code
 
 try:
@@ -275,20 +724,80 @@ def init_lib(extra_paths=None):
 
     _lib.ramses_msys_load.restype = ctypes.c_int
     _lib.ramses_msys_load.argtypes = [ctypes.c_char_p, ctypes.c_void_p, ctypes.c_void_p]
+    _lib.ramses_msys_load_flags.restype = ctypes.c_int
+    _lib.ramses_msys_load_flags.argtypes = [ctypes.c_char_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int]
     _lib.ramses_msys_load_strerr.restype = ctypes.c_char_p
     _lib.ramses_msys_load_strerr.argtypes = [ctypes.c_int]
 
+    _lib.ramses_simd_cap.restype = ctypes.c_int
+    _lib.ramses_simd_cap.argtypes = [ctypes.c_int]
+
     _lib.ramses_resolve.restype = DRAMAddr
     _lib.ramses_resolve.argtypes = [ctypes.c_void_p, _physaddr_t]
     _lib.ramses_resolve_reverse.restype = _physaddr_t
     _lib.ramses_resolve_reverse.argtypes = [ctypes.c_void_p, DRAMAddr]
+    _lib.ramses_resolve_batch.restype = None
+    _lib.ramses_resolve_batch.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t]
+    _lib.ramses_resolve_reverse_batch.restype = None
+    _lib.ramses_resolve_reverse_batch.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t]
 
     _lib.ramses_msys_granularity.restype = ctypes.c_size_t
     _lib.ramses_msys_granularity.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+    _lib.ramses_msys_verify.restype = ctypes.c_int
+    _lib.ramses_msys_verify.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t, ctypes.c_size_t, ctypes.c_int, ctypes.c_void_p]
 
     _lib.ramses_translate_heuristic.restype = None
     _lib.ramses_translate_heuristic.argtypes = [ctypes.c_void_p, ctypes.c_int, _physaddr_t]
     _lib.ramses_translate_pagemap.restype = None
     _lib.ramses_translate_pagemap.argtypes = [ctypes.c_void_p, ctypes.c_int]
+    _lib.ramses_translate_pagemap_huge.restype = ctypes.c_int
+    _lib.ramses_translate_pagemap_huge.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_void_p, ctypes.c_size_t]
+    _lib.ramses_bufmap.restype = ctypes.c_int
+    _lib.ramses_bufmap.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int]
+    _lib.ramses_bufmap_parallel.restype = ctypes.c_int
+    _lib.ramses_bufmap_parallel.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int, ctypes.c_int]
+    _lib.ramses_bufmap_free.restype = None
+    _lib.ramses_bufmap_free.argtypes = [ctypes.c_void_p]
+    _lib.ramses_bufmap_extend.restype = ctypes.c_int
+    _lib.ramses_bufmap_extend.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t]
+    _lib.ramses_bufmap_remove.restype = ctypes.c_int
+    _lib.ramses_bufmap_remove.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t]
+    _lib.ramses_bufmap_get_entry.restype = ctypes.c_int
+    _lib.ramses_bufmap_get_entry.argtypes = [ctypes.c_void_p, _BMPos, ctypes.c_void_p]
+    _lib.ramses_bufmap_iter_init.restype = None
+    _lib.ramses_bufmap_iter_init.argtypes = [ctypes.c_void_p, ctypes.c_void_p, _BMPos, _BMPos]
+    _lib.ramses_bufmap_iter_next.restype = ctypes.c_int
+    _lib.ramses_bufmap_iter_next.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+    _lib.ramses_bufmap_find.restype = ctypes.c_int
+    _lib.ramses_bufmap_find.argtypes = [ctypes.c_void_p, DRAMAddr, ctypes.c_void_p]
+    _lib.ramses_bufmap_find_va.restype = ctypes.c_int
+    _lib.ramses_bufmap_find_va.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_void_p, ctypes.c_void_p]
+    _lib.ramses_bufmap_save.restype = ctypes.c_int
+    _lib.ramses_bufmap_save.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int]
+    _lib.ramses_bufmap_load_mmap.restype = ctypes.c_int
+    _lib.ramses_bufmap_load_mmap.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int]
+    _lib.ramses_bufmap_has_row.restype = ctypes.c_int
+    _lib.ramses_bufmap_has_row.argtypes = [ctypes.c_void_p, DRAMAddr]
+    _lib.ramses_bufmap_neighbors.restype = ctypes.c_uint
+    _lib.ramses_bufmap_neighbors.argtypes = [ctypes.c_void_p, DRAMAddr, ctypes.c_uint, ctypes.c_void_p]
+    _lib.ramses_bufmap_bank_rows.restype = ctypes.c_size_t
+    _lib.ramses_bufmap_bank_rows.argtypes = [ctypes.c_void_p, DRAMAddr]
+    _lib.ramses_bufmap_triples.restype = ctypes.c_size_t
+    _lib.ramses_bufmap_triples.argtypes = [ctypes.c_void_p, _TripleFunc, ctypes.c_void_p]
+    _lib.ramses_bufmap_stats.restype = None
+    _lib.ramses_bufmap_stats.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+
+    _lib.ramses_translate_cache_init.restype = ctypes.c_int
+    _lib.ramses_translate_cache_init.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t, ctypes.c_size_t]
+    _lib.ramses_translate_cache.restype = None
+    _lib.ramses_translate_cache.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+    _lib.ramses_translate_cache_invalidate.restype = None
+    _lib.ramses_translate_cache_invalidate.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t]
+    _lib.ramses_translate_cache_flush.restype = None
+    _lib.ramses_translate_cache_flush.argtypes = [ctypes.c_void_p]
+    _lib.ramses_translate_cache_stats.restype = None
+    _lib.ramses_translate_cache_stats.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int]
+    _lib.ramses_translate_cache_free.restype = None
+    _lib.ramses_translate_cache_free.argtypes = [ctypes.c_void_p]
 
 # End module init code
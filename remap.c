@@ -80,14 +80,16 @@ struct Remapping RAMSES_REMAP_RANKMIRROR_DDR3 = {
 	.remap = rkmirror_ddr3,
 	.remap_reverse = rkmirror_ddr3,
 	.arg = {.p = NULL},
-	.gran = {0, 0, 0, 3, 0x1f8, 0x1f8}
+	.gran = {0, 0, 0, 3, 0x1f8, 0x1f8},
+	.flags = REMAP_RANK_LINEAR
 };
 
 struct Remapping RAMSES_REMAP_RANKMIRROR_DDR4 = {
 	.remap = rkmirror_ddr4,
 	.remap_reverse = rkmirror_ddr4,
 	.arg = {.p = NULL},
-	.gran = {0, 0, 0, 0xf, 0x29f8, 0x29f8}
+	.gran = {0, 0, 0, 0xf, 0x29f8, 0x29f8},
+	.flags = REMAP_RANK_LINEAR
 };
 
 void ramses_remap_rasxor(struct Remapping *r, int bit, int xormask)
@@ -98,6 +100,7 @@ void ramses_remap_rasxor(struct Remapping *r, int bit, int xormask)
 	r->arg.val[0] = bit;
 	r->arg.val[1] = xormask;
 	r->gran = (struct DRAMAddr){0, 0, 0, 0, xormask, 0};
+	r->flags = REMAP_RANK_LINEAR;
 }
 
 
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "simd.h"
+
+#include <ramses/map.h>
+
+static enum SIMDLevel simd_cap = SIMD_LEVEL_AVX512;
+
+enum SIMDLevel ramses_simd_cap(enum SIMDLevel cap)
+{
+	enum SIMDLevel old = simd_cap;
+	simd_cap = cap;
+	return old;
+}
+
+#ifdef RAMSES_SIMD
+enum SIMDLevel simd_level(void)
+{
+	enum SIMDLevel lvl;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		lvl = SIMD_LEVEL_AVX512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		lvl = SIMD_LEVEL_AVX2;
+	} else {
+		lvl = SIMD_LEVEL_SCALAR;
+	}
+	return (lvl < simd_cap) ? lvl : simd_cap;
+}
+#endif
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is licensed under the GPL2+.
+ */
+
+/* Helpers for runtime-dispatched SIMD batch kernels */
+
+#ifndef RAMSES_SIMD_H
+#define RAMSES_SIMD_H 1
+
+#include <ramses/map.h>
+#include <ramses/types.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define RAMSES_SIMD 1
+
+/* Four/eight 64-bit lanes, operated on with GCC vector extensions */
+typedef uint64_t u64x4 __attribute__((vector_size(32)));
+typedef uint64_t u64x8 __attribute__((vector_size(64)));
+
+#define SIMD_AVX2 __attribute__((target("avx2")))
+#define SIMD_AVX512 __attribute__((target("avx512f")))
+
+#define SIMD_LANES(V) (sizeof(V) / sizeof(uint64_t))
+
+/* Whether all `n' lanes starting at `v' are zero */
+static inline int simd_lanes_zero(const uint64_t *v, size_t n)
+{
+	uint64_t acc = 0;
+	for (size_t i = 0; i < n; i++) {
+		acc |= v[i];
+	}
+	return !acc;
+}
+
+/* assert() that every lane of `v', of vector type `V', is zero */
+#define SIMD_ASSERT_ZERO(V, v) \
+do { \
+	const V zchk_ = (v); \
+	(void)zchk_; \
+	assert(simd_lanes_zero((const uint64_t *)&zchk_, SIMD_LANES(V))); \
+} while (0)
+
+/*
+ * Widest vector extension supported by the running CPU, capped by
+ * ramses_simd_cap()
+ */
+enum SIMDLevel simd_level(void);
+#endif /* __GNUC__ && __x86_64__ */
+
+/*
+ * Pack/unpack DRAM address fields held in 64-bit lanes to/from the in-memory
+ * layout of struct DRAMAddr (little-endian). Usable on both scalars and
+ * vectors.
+ */
+#define DRAMADDR_LANE_PACK(chan, dimm, rank, bank, row, col) \
+	((chan) | ((dimm) << 8) | ((rank) << 16) | ((bank) << 24) | \
+	 ((row) << 32) | ((col) << 48))
+
+#define DRAMADDR_LANE_CHAN(v) ((v) & 0xff)
+#define DRAMADDR_LANE_DIMM(v) (((v) >> 8) & 0xff)
+#define DRAMADDR_LANE_RANK(v) (((v) >> 16) & 0xff)
+#define DRAMADDR_LANE_BANK(v) (((v) >> 24) & 0xff)
+#define DRAMADDR_LANE_ROW(v) (((v) >> 32) & 0xffff)
+#define DRAMADDR_LANE_COL(v) (((v) >> 48) & 0xffff)
+
+static inline uint64_t dramaddr_to_lane(struct DRAMAddr a)
+{
+	return DRAMADDR_LANE_PACK((uint64_t)a.chan, (uint64_t)a.dimm,
+	                          (uint64_t)a.rank, (uint64_t)a.bank,
+	                          (uint64_t)a.row, (uint64_t)a.col);
+}
+
+static inline struct DRAMAddr dramaddr_from_lane(uint64_t v)
+{
+	return (struct DRAMAddr){
+		.chan = DRAMADDR_LANE_CHAN(v),
+		.dimm = DRAMADDR_LANE_DIMM(v),
+		.rank = DRAMADDR_LANE_RANK(v),
+		.bank = DRAMADDR_LANE_BANK(v),
+		.row = DRAMADDR_LANE_ROW(v),
+		.col = DRAMADDR_LANE_COL(v),
+	};
+}
+
+#endif /* simd.h */
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "sort.h"
+#include "par.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES (64 / RADIX_BITS)
+
+static inline uint64_t reckey(const unsigned char *rec)
+{
+	uint64_t k;
+	memcpy(&k, rec, sizeof(k));
+	return k;
+}
+
+static inline unsigned digit(uint64_t k, int pass)
+{
+	return (k >> (pass * RADIX_BITS)) & (RADIX_BUCKETS - 1);
+}
+
+/* Inlined separately for each constant `size' */
+static inline void radix_sort_sz(unsigned char *base, unsigned char *scratch,
+                                 size_t n, const size_t size)
+{
+	size_t hist[RADIX_PASSES][RADIX_BUCKETS] = {{0}};
+	unsigned char *src = base;
+	unsigned char *dst = scratch;
+
+	for (size_t i = 0; i < n; i++) {
+		uint64_t k = reckey(&src[i * size]);
+		for (int p = 0; p < RADIX_PASSES; p++) {
+			hist[p][digit(k, p)]++;
+		}
+	}
+	for (int p = 0; p < RADIX_PASSES; p++) {
+		size_t off = 0;
+		/* Skip digits shared by all keys */
+		if (hist[p][digit(reckey(src), p)] == n) {
+			continue;
+		}
+		for (int b = 0; b < RADIX_BUCKETS; b++) {
+			size_t c = hist[p][b];
+			hist[p][b] = off;
+			off += c;
+		}
+		for (size_t i = 0; i < n; i++) {
+			const unsigned char *rec = &src[i * size];
+			memcpy(&dst[hist[p][digit(reckey(rec), p)]++ * size], rec, size);
+		}
+		unsigned char *t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != base) {
+		memcpy(base, src, n * size);
+	}
+}
+
+void radix_sort64(void *base, void *scratch, size_t n, size_t size)
+{
+	if (!n) {
+		return;
+	} else if (size == 16) {
+		radix_sort_sz(base, scratch, n, 16);
+	} else {
+		radix_sort_sz(base, scratch, n, size);
+	}
+}
+
+/*
+ * Parallel LSD passes: every thread histograms its slice of the source, then
+ * scatters it starting from its own offset within each bucket, after the
+ * slices of lower-numbered threads. This keeps the sort stable.
+ */
+struct RadixPar {
+	unsigned char *src;
+	unsigned char *dst;
+	size_t n;
+	size_t size;
+	int pass;
+	size_t (*hist)[RADIX_BUCKETS]; /* [thread][bucket] */
+};
+
+static void radix_par_hist(void *arg, int t, int nthreads)
+{
+	struct RadixPar *r = (struct RadixPar *)arg;
+	const size_t lo = par_chunk(r->n, t, nthreads);
+	const size_t hi = par_chunk(r->n, t + 1, nthreads);
+	size_t *hist = r->hist[t];
+
+	memset(hist, 0, RADIX_BUCKETS * sizeof(*hist));
+	for (size_t i = lo; i < hi; i++) {
+		hist[digit(reckey(&r->src[i * r->size]), r->pass)]++;
+	}
+}
+
+static inline void radix_par_scatter_sz(struct RadixPar *r, size_t *off,
+                                        size_t lo, size_t hi, const size_t size)
+{
+	for (size_t i = lo; i < hi; i++) {
+		const unsigned char *rec = &r->src[i * size];
+		memcpy(&r->dst[off[digit(reckey(rec), r->pass)]++ * size], rec, size);
+	}
+}
+
+static void radix_par_scatter(void *arg, int t, int nthreads)
+{
+	struct RadixPar *r = (struct RadixPar *)arg;
+	const size_t lo = par_chunk(r->n, t, nthreads);
+	const size_t hi = par_chunk(r->n, t + 1, nthreads);
+
+	if (r->size == 16) {
+		radix_par_scatter_sz(r, r->hist[t], lo, hi, 16);
+	} else {
+		radix_par_scatter_sz(r, r->hist[t], lo, hi, r->size);
+	}
+}
+
+void radix_sort64_par(void *base, void *scratch, size_t n, size_t size,
+                      int nthreads)
+{
+	struct RadixPar r = {
+		.src = base, .dst = scratch, .n = n, .size = size
+	};
+	uint64_t diff = 0;
+
+	if (nthreads <= 1 || n < (size_t)nthreads * RADIX_MIN) {
+		radix_sort64(base, scratch, n, size);
+		return;
+	}
+	r.hist = malloc(nthreads * sizeof(*r.hist));
+	if (r.hist == NULL) {
+		radix_sort64(base, scratch, n, size);
+		return;
+	}
+	/* Digits shared by all keys need no pass */
+	for (size_t i = 1; i < n; i++) {
+		diff |= reckey(r.src) ^ reckey(&r.src[i * size]);
+	}
+	for (r.pass = 0; r.pass < RADIX_PASSES; r.pass++) {
+		size_t off = 0;
+		if (!digit(diff, r.pass)) {
+			continue;
+		}
+		par_run(nthreads, radix_par_hist, &r);
+		for (int b = 0; b < RADIX_BUCKETS; b++) {
+			for (int t = 0; t < nthreads; t++) {
+				size_t c = r.hist[t][b];
+				r.hist[t][b] = off;
+				off += c;
+			}
+		}
+		par_run(nthreads, radix_par_scatter, &r);
+		unsigned char *t = r.src;
+		r.src = r.dst;
+		r.dst = t;
+	}
+	if (r.src != base) {
+		memcpy(base, r.src, n * size);
+	}
+	free(r.hist);
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is licensed under the GPL2+.
+ */
+
+/* Radix sorting of records keyed by a leading 64-bit integer */
+
+#ifndef RAMSES_SORT_H
+#define RAMSES_SORT_H 1
+
+#include <stddef.h>
+
+/* Below this many records, radix sorting is not worth it */
+#define RADIX_MIN 256
+
+/*
+ * Sort `n' records of `size' bytes at `base' in ascending order of the
+ * uint64_t stored in their first 8 bytes. Stable.
+ * `scratch' must have room for `n' records.
+ */
+void radix_sort64(void *base, void *scratch, size_t n, size_t size);
+/* radix_sort64 on `nthreads' threads, with the same result */
+void radix_sort64_par(void *base, void *scratch, size_t n, size_t size,
+                      int nthreads);
+
+#endif /* sort.h */
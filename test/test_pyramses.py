@@ -4,7 +4,13 @@
 #
 # This program is licensed under the GPL2+.
 
+import os
 import sys
+import mmap
+import random
+import struct
+import tempfile
+import ctypes
 
 import pyramses
 
@@ -15,41 +21,27 @@ _M = 1 << 20
 _G = 1 << 30
 PAGESIZE = 4096
 
-CASES = [CASE(*x) for x in [
-    ('map:naive:ddr3', [(0, 4*_G)]),
-    ('map:naive:ddr4', [(0, 8*_G)]),
-    ('map:intel:sandy', [(0, 4*_G)]),
-    ('map:intel:sandy:2rank', [(0, 8*_G)]),
-    ('map:intel:sandy:2dimm', [(0, 8*_G)]),
-    ('map:intel:sandy:2chan', [(0, 8*_G)]),
-    ('map:intel:sandy:2dimm:2rank', [(0, 16*_G)]),
-    ('map:intel:sandy:2chan:2rank', [(0, 16*_G)]),
-    ('map:intel:sandy:2chan:2dimm', [(0, 16*_G)]),
-    ('map:intel:sandy:2chan:2dimm:2rank', [(0, 32*_G)]),
-    ('map:intel:ivyhaswell', [(0, 4*_G)]),
-    ('map:intel:ivyhaswell:2rank', [(0, 8*_G)]),
-    ('map:intel:ivyhaswell:2dimm', [(0, 8*_G)]),
-    ('map:intel:ivyhaswell:2chan', [(0, 8*_G)]),
-    ('map:intel:ivyhaswell:2dimm:2rank', [(0, 16*_G)]),
-    ('map:intel:ivyhaswell:2chan:2rank', [(0, 16*_G)]),
-    ('map:intel:ivyhaswell:2chan:2dimm', [(0, 16*_G)]),
-    ('map:intel:ivyhaswell:2chan:2dimm:2rank', [(0, 32*_G)]),
-    ('map:intel:sandy:pcibase=0x7f800000:tom=0x100000000', [(0, 0x7f8*_M), (4*_G, 4*_G + 0x808*_M)]),
-    ('map:intel:sandy:2rank:pcibase=0x7f800000:tom=0x200000000', [(0, 0x7f8*_M), (4*_G, 8*_G + 0x808*_M)]),
-    ('map:intel:sandy:2dimm:pcibase=0x7f800000:tom=0x200000000', [(0, 0x7f8*_M), (4*_G, 8*_G + 0x808*_M)]),
-    ('map:intel:sandy:2chan:pcibase=0x7f800000:tom=0x200000000', [(0, 0x7f8*_M), (4*_G, 8*_G + 0x808*_M)]),
-    ('map:intel:ivyhaswell:pcibase=0x7f800000:tom=0x100000000', [(0, 0x7f8*_M), (4*_G, 4*_G + 0x808*_M)]),
-    ('map:intel:ivyhaswell:2rank:pcibase=0x7f800000:tom=0x200000000', [(0, 0x7f8*_M), (4*_G, 8*_G + 0x808*_M)]),
-    ('map:intel:ivyhaswell:2dimm:pcibase=0x7f800000:tom=0x200000000', [(0, 0x7f8*_M), (4*_G, 8*_G + 0x808*_M)]),
-    ('map:intel:ivyhaswell:2chan:pcibase=0x7f800000:tom=0x200000000', [(0, 0x7f8*_M), (4*_G, 8*_G + 0x808*_M)]),
-    ('map:naive:ddr3;remap:rasxor:bit=3:mask=6', [(0, 4*_G)]),
-    ('map:intel:sandy:2chan;remap:rasxor:bit=3:mask=6', [(0, 8*_G)]),
-    ('map:intel:ivyhaswell:2chan;remap:rasxor:bit=3:mask=6', [(0, 8*_G)]),
-    ('map:intel:sandy:2rank;remap:rankmirror:ddr3', [(0, 8*_G)]),
-    ('map:intel:sandy:2chan:2rank;remap:rankmirror:ddr3', [(0, 16*_G)]),
-    ('map:intel:ivyhaswell:2rank;remap:rankmirror:ddr3', [(0, 8*_G)]),
-    ('map:intel:ivyhaswell:2chan:2rank;remap:rankmirror:ddr3', [(0, 16*_G)]),
-]]
+# Caps on the vector extensions used, selectable on the command line
+SIMD_LEVELS = {'scalar': pyramses.SIMD_LEVEL_SCALAR,
+               'avx2': pyramses.SIMD_LEVEL_AVX2,
+               'avx512': pyramses.SIMD_LEVEL_AVX512}
+
+
+def _load_cases(path):
+    """Read the (msys, ranges) cases shared with the benchmarks"""
+    cases = []
+    with open(path) as f:
+        for line in f:
+            if not line.strip() or line.startswith('#'):
+                continue
+            msys, *ranges = line.split()
+            cases.append(CASE(msys, [tuple(int(x, 0) for x in r.split(':'))
+                                     for r in ranges]))
+    return cases
+
+
+CASES = _load_cases(os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                 'msys_cases.txt'))
 
 
 class TestFail(Exception):
@@ -60,28 +52,642 @@ class TestFail(Exception):
         super().__init__(*args, *kwargs)
 
 
+class CompiledFail(TestFail):
+    pass
+
+
+class ScalarFail(TestFail):
+    pass
+
+
+class BufMapFail(Exception):
+    pass
+
+
+class CacheFail(Exception):
+    pass
+
+
+class MsysFail(Exception):
+    pass
+
+
 def test():
     m = pyramses.MemorySystem()
     for tc in CASES:
-        m.load(tc.msys)
-        gran = m.granularity(PAGESIZE)
+        # Compiled forms are checked against the interpreted one as well
+        m.load(tc.msys, pyramses.MSYS_JIT)
         print('@ ' + tc.msys, end=' ', flush=True)
-        for start, stop in tc.ranges:
-            for addr in range(start, stop, gran):
-                da = m.resolve(addr)
-                pa = m.resolve_reverse(da)
-                if pa != addr:
-                    raise TestFail(addr, da, pa)
+        fail = m.verify(tc.ranges, PAGESIZE)
+        if fail is not None:
+            exc = {0: TestFail,
+                   pyramses.MSYS_VERIFY_SCALAR: ScalarFail}.get(fail.form,
+                                                                CompiledFail)
+            raise exc(fail.addr, fail.da, fail.pa)
+        print('OK', flush=True)
+
+
+def test_xor_masks():
+    """map:xor rejects masks that are empty or do not fit in 64 bits"""
+    m = pyramses.MemorySystem()
+    good = next(tc.msys for tc in CASES if tc.msys.startswith('map:xor:bank='))
+    masks = '0x12000,0x24000,0x48000'
+    for bad in ('0x12000,,0x48000', '0x12000,0x10000000000000000,0x48000',
+                '0x12000,x,0x48000'):
+        print('@ xor bank=' + bad, end=' ', flush=True)
+        m.load(good)
+        try:
+            m.load(good.replace(masks, bad))
+        except pyramses.RamsesError:
+            print('OK', flush=True)
+            continue
+        raise MsysFail('map:xor accepted bank masks ' + bad)
+
+
+def test_arrays():
+    """Array resolution agrees with scalar resolution and round-trips"""
+    try:
+        import numpy as np
+    except ImportError:
+        print('@ arrays SKIP (no numpy)', flush=True)
+        return
+    rng = np.random.default_rng(0)
+    m = pyramses.MemorySystem()
+    for tc in CASES:
+        m.load(tc.msys, pyramses.MSYS_JIT)
+        print('@ arrays ' + tc.msys, end=' ', flush=True)
+        gran = m.granularity(PAGESIZE)
+        pas = np.concatenate([
+            rng.integers(lo // gran, hi // gran, 512, dtype=np.uint64) * np.uint64(gran)
+            for lo, hi in tc.ranges
+        ]).reshape(-1, 8)
+        das = m.resolve_array(pas)
+        back = m.resolve_reverse_array(das)
+        for pa, da, pa2 in zip(pas.flat, das.flat, back.flat):
+            pa, da, pa2 = int(pa), pyramses.DRAMAddr(*da), int(pa2)
+            if da != m.resolve(pa) or pa2 != m.resolve_reverse(da) or pa2 != pa:
+                raise TestFail(pa, da, pa2)
         print('OK', flush=True)
 
+
+def test_pagemap_holes():
+    """Pagemap range translation marks exactly the pages not in memory"""
+    if not os.access('/proc/self/pagemap', os.R_OK):
+        print('@ pagemap holes SKIP (no pagemap)', flush=True)
+        return
+    npages = 8192
+    # First hole past the first chunk read; short and long gaps after it
+    holes = [(5000, 5001), (5100, 5300), (5310, 6000), (6001, 6002),
+             (7000, 8192)]
+    buf = mmap.mmap(-1, npages * PAGESIZE)
+    addr = ctypes.addressof(ctypes.c_char.from_buffer(buf))
+    buf.madvise(mmap.MADV_NOHUGEPAGE)
+    for i in range(npages):
+        buf[i * PAGESIZE] = 1
+    for lo, hi in holes:
+        buf.madvise(mmap.MADV_DONTNEED, lo * PAGESIZE, (hi - lo) * PAGESIZE)
+    hole = lambda i: any(lo <= i < hi for lo, hi in holes)
+    print('@ pagemap holes', end=' ', flush=True)
+    with pyramses.Pagemap() as pm:
+        if not pm.translate(addr) >> 12:
+            print('SKIP (no PFNs)', flush=True)
+            return
+        for start, n in ((0, npages), (4500, 1500), (5050, 100)):
+            out = (ctypes.c_uint64 * n)()
+            got = pm.trans.translate_range(addr + start * PAGESIZE, n, out,
+                                           pm.trans.page_shift, pm.trans.arg)
+            fails = sum(hole(start + i) for i in range(n))
+            if got != n - fails:
+                raise TestFail(addr + start * PAGESIZE, None, got)
+            for i in range(n):
+                va = addr + (start + i) * PAGESIZE
+                if (out[i] == pyramses.BADADDR) != hole(start + i) or \
+                   out[i] != pm.translate(va):
+                    raise TestFail(va, None, out[i])
+    print('OK', flush=True)
+
+
+def test_pagemap_huge():
+    """Huge page translation marks exactly the huge pages not in memory"""
+    if not os.access('/proc/self/pagemap', os.R_OK):
+        print('@ pagemap huge SKIP (no pagemap)', flush=True)
+        return
+    hpsz = 2 * _M
+    npages = 16
+    raw = mmap.mmap(-1, (npages + 1) * hpsz, flags=mmap.MAP_PRIVATE)
+    base = ctypes.addressof(ctypes.c_char.from_buffer(raw))
+    off = -base % hpsz
+    addr = base + off
+    raw.madvise(mmap.MADV_HUGEPAGE, off, npages * hpsz)
+    for i in range(0, npages * hpsz, PAGESIZE):
+        raw[off + i] = 1
+    print('@ pagemap huge', end=' ', flush=True)
+    with pyramses.Pagemap(buf=(addr, npages * hpsz)) as pm:
+        if pm.trans.page_shift != hpsz.bit_length() - 1 or \
+           not pm.translate(addr) >> 12:
+            print('SKIP (no huge pages)', flush=True)
+            return
+        holes = (3, 4, 9, 15)
+        for i in holes:
+            raw.madvise(mmap.MADV_DONTNEED, off + i * hpsz, hpsz)
+        out = (ctypes.c_uint64 * npages)()
+        got = pm.trans.translate_range(addr, npages, out, pm.trans.page_shift,
+                                       pm.trans.arg)
+        if got != npages - len(holes):
+            raise TestFail(addr, None, got)
+        for i in range(npages):
+            va = addr + i * hpsz
+            if (out[i] == pyramses.BADADDR) != (i in holes) or \
+               out[i] != pm.translate(va):
+                raise TestFail(va, None, out[i])
+    print('OK', flush=True)
+
+
+class ScrambleMap(pyramses._VMMap):
+    """Translation scattering runs of 2^`run_bits' pages all over the bottom
+    4GiB"""
+    def __init__(self, seed=0, run_bits=2):
+        shift = PAGESIZE.bit_length() - 1
+        runmask = (1 << (32 - shift - run_bits)) - 1
+        pfn = lambda vpn: (((((vpn >> run_bits) * 0x9e3779b1 + seed) & runmask)
+                            << run_bits) | (vpn & ((1 << run_bits) - 1)))
+        def trans(addr, page_shift, arg):
+            return (pfn(addr >> shift) << shift) | (addr & (PAGESIZE - 1))
+        def trans_range(addr, npages, out, page_shift, arg):
+            out = ctypes.cast(out, ctypes.POINTER(ctypes.c_uint64))
+            for i in range(npages):
+                out[i] = pfn((addr >> shift) + i) << shift
+            return npages
+        self._fns = (pyramses._TranslateFunc(trans),
+                     pyramses._TranslateRangeFunc(trans_range))
+        self.trans = pyramses._Translation(*self._fns, shift,
+                                           pyramses._TranslateArg(0))
+
+
+class CachedMapCheck(pyramses.CachedMap):
+    """CachedMap checking results and the counters they left behind"""
+    def check(self, got, want, **counts):
+        stats = self.stats(reset=True)
+        want_stats = dict.fromkeys(stats, 0)
+        want_stats.update(counts)
+        if got != want or stats != want_stats:
+            raise CacheFail('got {} with {}, expected {} with {}'.format(
+                got, stats, want, want_stats))
+
+
+def test_translate_cache():
+    """CachedMap agrees with its backend and counts hits, misses and backend
+    calls, also across invalidation and flushes"""
+    print('@ translate cache', end=' ', flush=True)
+    base = 1 << 30
+    back = ScrambleMap(seed=3)
+    want = back.translate_range(base, 64)
+    with CachedMapCheck(back, entries=256, readahead=8) as c:
+        # A single miss fetches its aligned readahead window
+        c.check(c.translate(base + 5 * PAGESIZE + 7), want[5] + 7,
+                lookups=1, misses=1, backend_calls=1, backend_pages=8)
+        c.check(c.translate(base + PAGESIZE), want[1], lookups=1, hits=1)
+        # Ranges take the cached pages and fetch the rest in one call
+        c.check(c.translate_range(base, 16), want[:16],
+                lookups=16, hits=8, misses=8, backend_calls=1, backend_pages=8)
+        c.check(c.translate_range(base + 4 * PAGESIZE, 8), want[4:12],
+                lookups=8, hits=8)
+        # Uncached runs on both sides of cached pages are fetched separately
+        c.invalidate(base + 2 * PAGESIZE, 2 * PAGESIZE)
+        c.invalidate(base + 12 * PAGESIZE, PAGESIZE)
+        c.check(c.translate_range(base, 24), want[:24],
+                lookups=24, hits=13, misses=11, backend_calls=3,
+                backend_pages=11, invalidations=2)
+        c.flush()
+        c.check(c.translate_range(base, 64), want,
+                lookups=64, misses=64, backend_calls=1, backend_pages=64)
+        # 64 pages fill 16 of the 64 sets only 4 deep: nothing was evicted
+        c.check(c.translate(base + 63 * PAGESIZE), want[63], lookups=1, hits=1)
+    print('OK', flush=True)
+
+
+BUFMAP_MSYS = [
+    'map:intel:ivyhaswell:2chan:2rank;remap:rankmirror:ddr3',
+    CASES[-1].msys,
+]
+
+
+def _bufmap_buffer(size):
+    buf = mmap.mmap(-1, size)
+    return buf, ctypes.addressof(ctypes.c_char.from_buffer(buf))
+
+
+def _positions(bm):
+    """Position of every entry of `bm', in order"""
+    return [(ri, ei) for ri, (_, cnt) in enumerate(bm.ranges())
+            for ei in range(cnt)]
+
+
+def test_bufmap_iter():
+    """Iterating over a BufferMap yields ramses_bufmap_get_entry for each entry"""
+    buf, addr = _bufmap_buffer(2 * _M)
+    m = pyramses.MemorySystem()
+    for i, msys in enumerate(BUFMAP_MSYS):
+        # Fused memory systems step physical addresses instead of resolving
+        for flags in (0, pyramses.MSYS_FUSE):
+            m.load(msys, flags)
+            print('@ bufmap iter {} {}'.format(i, flags), end=' ', flush=True)
+            with pyramses.BufferMap(addr, len(buf), ScrambleMap(), m) as bm:
+                pos = _positions(bm)
+                want = [bm.entry(p) for p in pos]
+                if list(bm.entries()) != want:
+                    raise BufMapFail('iterator differs from get_entry')
+                mid = len(pos) // 3
+                if list(bm.entries(pos[mid], pos[2 * mid])) != want[mid:2 * mid]:
+                    raise BufMapFail('partial iteration differs from get_entry')
+            print('OK', flush=True)
+
+
+def test_bufmap_parallel():
+    """ramses_bufmap_parallel builds the same BufferMap as ramses_bufmap"""
+    # Runs of 4 pages, so that most thread counts split some of them, and
+    # enough of them to sort in parallel
+    buf, addr = _bufmap_buffer(8 * _M)
+    m = pyramses.MemorySystem()
+    for i, msys in enumerate(BUFMAP_MSYS):
+        m.load(msys)
+        print('@ bufmap parallel {}'.format(i), end=' ', flush=True)
+        with pyramses.BufferMap(addr, len(buf), ScrambleMap(), m) as bm:
+            want = (bm.ptes(), bm.ranges(), list(bm.entries()))
+        for nthreads in (2, 3, 5):
+            with pyramses.BufferMap(addr, len(buf), ScrambleMap(), m,
+                                    nthreads=nthreads) as bm:
+                if (bm.ptes(), bm.ranges(), list(bm.entries())) != want:
+                    raise BufMapFail('{} threads differ from serial'.format(nthreads))
+        print('OK', flush=True)
+
+
+def _probe_addrs(bm, count=4096, seed=0):
+    """DRAM addresses in and around those of `bm': entries, points within
+    them, and neighbours in every field"""
+    rng = random.Random(seed)
+    ents = [da for _, da in bm.entries()]
+    out = []
+    for _ in range(count):
+        da = pyramses.DRAMAddr(*rng.choice(ents))
+        f = rng.choice(('chan', 'dimm', 'rank', 'bank', 'row', 'col', None))
+        if f is not None:
+            setattr(da, f, max(0, getattr(da, f) + rng.randint(-2, 2)))
+        out.append(da)
+    return out
+
+
+def test_bufmap_searchidx():
+    """Lookups through BUFMAP_SEARCHIDX agree with plain binary search"""
+    buf, addr = _bufmap_buffer(2 * _M)
+    m = pyramses.MemorySystem()
+    for i, msys in enumerate(BUFMAP_MSYS):
+        m.load(msys)
+        print('@ bufmap searchidx {}'.format(i), end=' ', flush=True)
+        with pyramses.BufferMap(addr, len(buf), ScrambleMap(), m) as plain, \
+             pyramses.BufferMap(addr, len(buf), ScrambleMap(), m,
+                                pyramses.BUFMAP_NOCLOBBER |
+                                pyramses.BUFMAP_SEARCHIDX) as idx:
+            probes = _probe_addrs(plain)
+            # The index is patched rather than rebuilt by edits
+            for edit in (None, 'remove', 'extend'):
+                if edit is not None:
+                    for bm in (plain, idx):
+                        getattr(bm, edit)(addr + 37 * PAGESIZE, 50 * PAGESIZE)
+                for da in probes:
+                    if idx.find(da) != plain.find(da):
+                        raise BufMapFail('find({!r}) differs with SEARCHIDX'.format(da))
+        print('OK', flush=True)
+
+
+def test_bufmap_find_va():
+    """ramses_bufmap_find_va agrees with translating and then finding"""
+    buf, addr = _bufmap_buffer(2 * _M)
+    hole = (addr + 100 * PAGESIZE, 30 * PAGESIZE)
+    rng = random.Random(0)
+    m = pyramses.MemorySystem()
+    m.load(BUFMAP_MSYS[0])
+    # Single pages get a dense VA index, longer runs a sparse one
+    for run_bits in (0, 2):
+        vmmap = ScrambleMap(run_bits=run_bits)
+        print('@ bufmap find_va {}'.format(run_bits), end=' ', flush=True)
+        with pyramses.BufferMap(addr, len(buf), vmmap, m) as bm:
+            bm.remove(*hole)
+            for _ in range(4096):
+                va = addr + rng.randrange(-PAGESIZE, len(buf) + PAGESIZE)
+                if not (addr <= va < addr + len(buf)) or \
+                   hole[0] <= va < hole[0] + hole[1]:
+                    want = None
+                else:
+                    pa = vmmap.translate(va)
+                    pos = bm.find(m.resolve(pa & ~(bm.entry_len - 1)))
+                    want = (pos, m.resolve(pa))
+                if bm.find_va(va) != want:
+                    raise BufMapFail('find_va({:#x}) != {}'.format(va, want))
+        print('OK', flush=True)
+
+
+def test_bufmap_ptes():
+    """PTE extents cover exactly the translated pages, and are maximal"""
+    buf, addr = _bufmap_buffer(2 * _M)
+    hole = (addr + 100 * PAGESIZE, 30 * PAGESIZE)
+    m = pyramses.MemorySystem()
+    m.load(BUFMAP_MSYS[0])
+    for run_bits in (0, 2, 6):
+        vmmap = ScrambleMap(run_bits=run_bits)
+        print('@ bufmap ptes {}'.format(run_bits), end=' ', flush=True)
+        with pyramses.BufferMap(addr, len(buf), vmmap, m) as bm:
+            for edit in (None, 'remove', 'extend'):
+                if edit is not None:
+                    getattr(bm, edit)(*hole)
+                want = {(va, vmmap.translate(va))
+                        for va in range(addr, addr + len(buf), PAGESIZE)
+                        if edit != 'remove' or
+                           not hole[0] <= va < hole[0] + hole[1]}
+                got = set()
+                ptes = bm.ptes()
+                for pa, va, npages in ptes:
+                    got.update((va + i * PAGESIZE, pa + i * PAGESIZE)
+                               for i in range(npages))
+                if got != want or len(got) != sum(p[2] for p in ptes):
+                    raise BufMapFail('PTEs do not cover the buffer pages')
+                for a, b in zip(ptes, ptes[1:]):
+                    if a[0] + a[2] * PAGESIZE == b[0] and \
+                       a[1] + a[2] * PAGESIZE == b[1]:
+                        raise BufMapFail('PTEs {} and {} not merged'.format(a, b))
+        print('OK', flush=True)
+
+
+def _bufmap_fields(bm):
+    return ({f: getattr(bm.bm, f) for f in
+             ('bufbase', 'pte_cnt', 'page_size', 'range_cnt', 'entry_len')},
+            bm.ptes(), bm.ranges(), list(bm.entries()))
+
+
+def test_bufmap_snapshot():
+    """Snapshots load back into the same BufferMap; damaged ones are refused"""
+    buf, addr = _bufmap_buffer(2 * _M)
+    hole = (addr + 100 * PAGESIZE, 30 * PAGESIZE)
+    msys = BUFMAP_MSYS[0]
+    m = pyramses.MemorySystem()
+    m.load(msys)
+    vmmap = ScrambleMap()
+    flags = (pyramses.BUFMAP_NOCLOBBER | pyramses.BUFMAP_SEARCHIDX |
+             pyramses.BUFMAP_ROWIDX)
+    print('@ bufmap snapshot', end=' ', flush=True)
+    with tempfile.TemporaryFile() as f, \
+         pyramses.BufferMap(addr, len(buf), vmmap, m) as bm:
+        bm.save(f.fileno(), msys)
+        with pyramses.BufferMap(addr, len(buf), vmmap, m, flags,
+                                snapshot=f.fileno(), msys_str=msys) as sbm:
+            if _bufmap_fields(sbm) != _bufmap_fields(bm):
+                raise BufMapFail('snapshot differs from the saved map')
+            probes = _probe_addrs(bm)
+            if [sbm.find(da) for da in probes] != [bm.find(da) for da in probes]:
+                raise BufMapFail('find differs on the loaded snapshot')
+            # Edits move the data out of the read-only snapshot
+            for b in (bm, sbm):
+                b.remove(*hole)
+            if _bufmap_fields(sbm) != _bufmap_fields(bm):
+                raise BufMapFail('edited snapshot differs from the edited map')
+
+        f.seek(0)
+        good = f.read()
+        ptes_off = struct.unpack_from('<Q', good, 64)[0]
+        pa = struct.unpack_from('<Q', good, ptes_off)[0]
+        bad = {
+            'magic': (0, b'X'),
+            'version': (8, struct.pack('<I', 2)),
+            'pte count': (48, struct.pack('<Q', 1 << 40)),
+            'range offset': (72, struct.pack('<Q', len(good))),
+            # A page moved since the snapshot was taken
+            'stale PTE': (ptes_off, struct.pack('<Q', pa ^ PAGESIZE)),
+        }
+        variants = [(k, good[:o] + v + good[o + len(v):]) for k, (o, v) in bad.items()]
+        variants.append(('truncated', good[:len(good) // 2]))
+        for what, data in variants + [('other msys', good)]:
+            f.seek(0)
+            f.truncate()
+            f.write(data)
+            f.flush()
+            try:
+                with pyramses.BufferMap(addr, len(buf), vmmap, m, flags,
+                                        snapshot=f.fileno(),
+                                        msys_str=msys if what != 'other msys'
+                                                 else BUFMAP_MSYS[1]):
+                    pass
+            except pyramses.RamsesError:
+                pass
+            else:
+                raise BufMapFail('snapshot with {} accepted'.format(what))
+    print('OK', flush=True)
+
+
+def _bufmap_rows(bm, m):
+    """Entries of `bm' present in each (bank, row), and entries per row"""
+    rows = {}
+    for _, da in bm.entries():
+        k = (da[:4], da.row)
+        rows[k] = rows.get(k, 0) + 1
+    props = m.mapping.props
+    return rows, props.col_cnt * props.cell_size // bm.entry_len
+
+
+def test_bufmap_triples():
+    """ramses_bufmap_triples yields exactly the triples of full rows"""
+    # Physically contiguous runs of 2MiB hold many full rows
+    buf, addr = _bufmap_buffer(8 * _M)
+    m = pyramses.MemorySystem()
+    for i, msys in enumerate(BUFMAP_MSYS):
+        m.load(msys)
+        print('@ bufmap triples {}'.format(i), end=' ', flush=True)
+        with pyramses.BufferMap(addr, len(buf), ScrambleMap(run_bits=9), m) as bm:
+            for edit in (None, 'remove'):
+                if edit is not None:
+                    bm.remove(addr + 3 * _M + 5 * PAGESIZE, 300 * PAGESIZE)
+                rows, epr = _bufmap_rows(bm, m)
+                full = {k for k, n in rows.items() if n == epr}
+                want = []
+                for bank, row in sorted(full):
+                    if (bank, row - 1) in full and (bank, row + 1) in full:
+                        victim = pyramses.DRAMAddr(*bank, row, 0)
+                        pos = [bm.find(pyramses.DRAMAddr(*bank, r, 0))
+                               for r in (row - 1, row, row + 1)]
+                        want.append((victim, *pos))
+                if not want or bm.triples() != want:
+                    raise BufMapFail('triples differ from a row enumeration')
+        print('OK', flush=True)
+
+
+def test_bufmap_rowidx():
+    """Row queries agree with a scan of the entries, with and without
+    BUFMAP_ROWIDX"""
+    buf, addr = _bufmap_buffer(2 * _M)
+    rng = random.Random(0)
+    m = pyramses.MemorySystem()
+    for i, msys in enumerate(BUFMAP_MSYS):
+        m.load(msys)
+        print('@ bufmap rowidx {}'.format(i), end=' ', flush=True)
+        for flags in (0, pyramses.BUFMAP_ROWIDX):
+            with pyramses.BufferMap(addr, len(buf), ScrambleMap(run_bits=4), m,
+                                    pyramses.BUFMAP_NOCLOBBER | flags) as bm:
+                for edit in (None, 'remove', 'extend'):
+                    if edit is not None:
+                        getattr(bm, edit)(addr + 100 * PAGESIZE, 90 * PAGESIZE)
+                    rows, _ = _bufmap_rows(bm, m)
+                    first = {}
+                    for pos, (_, da) in zip(_positions(bm), bm.entries()):
+                        first.setdefault((da[:4], da.row), pos)
+                    banks = {}
+                    for bank, _ in rows:
+                        banks[bank] = banks.get(bank, 0) + 1
+                    probes = [pyramses.DRAMAddr(*b, r + d, rng.randrange(64))
+                              for b, r in rng.sample(sorted(rows), 150)
+                              for d in (-2, -1, 0, 1, 3)]
+                    probes += [pyramses.DRAMAddr(*b[:3], b[3] ^ 7, 5, 0)
+                               for b in banks]
+                    for da in probes:
+                        k = (da[:4], da.row)
+                        if bm.has_row(da) != (k in rows) or \
+                           bm.bank_rows(da) != banks.get(da[:4], 0):
+                            raise BufMapFail('row query of {!r} wrong'.format(da))
+                        for dist in (1, 2):
+                            got = bm.neighbors(da, dist)
+                            for j, r in enumerate((da.row - dist, da.row + dist)):
+                                want = first.get((da[:4], r))
+                                if (got[j] is None) != (want is None):
+                                    raise BufMapFail('neighbors of {!r} wrong'.format(da))
+                                # Any entry of the row will do without the index
+                                if got[j] is not None and (
+                                    got[j] != want if flags else
+                                    bm.entry(got[j])[1][:5] != (*da[:4], r)):
+                                    raise BufMapFail('neighbors of {!r} wrong'.format(da))
+        print('OK', flush=True)
+
+
+def test_bufmap_stats():
+    """ramses_bufmap_stats agrees with counts taken over the PTEs and ranges"""
+    buf, addr = _bufmap_buffer(8 * _M)
+    m = pyramses.MemorySystem()
+    m.load(BUFMAP_MSYS[0])
+    for run_bits in (2, 9):
+        print('@ bufmap stats {}'.format(run_bits), end=' ', flush=True)
+        with pyramses.BufferMap(addr, len(buf), ScrambleMap(run_bits=run_bits),
+                                m) as bm:
+            bm.remove(addr + 3 * _M + 5 * PAGESIZE, 300 * PAGESIZE)
+            ptes = bm.ptes()
+            cnts = [cnt for _, cnt in bm.ranges()]
+            rows, epr = _bufmap_rows(bm, m)
+            banks = {}
+            for bank, _ in rows:
+                banks[bank] = banks.get(bank, 0) + 1
+            hist = [0] * len(bm.stats()['range_hist'])
+            for cnt in cnts:
+                hist[min(cnt.bit_length() - 1, len(hist) - 1)] += 1
+            full = sum(n == epr for n in rows.values())
+            want = {
+                'entries': sum(cnts),
+                'pages': sum(p[2] for p in ptes),
+                'pte_cnt': len(ptes),
+                'pte_max_pages': max(p[2] for p in ptes),
+                'phys_runs': 1 + sum(a[0] + a[2] * PAGESIZE != b[0]
+                                     for a, b in zip(ptes, ptes[1:])),
+                'range_cnt': len(cnts),
+                'range_max': max(cnts),
+                'range_hist': hist,
+                'bank_cnt': len(banks),
+                'bank_rows_min': min(banks.values()),
+                'bank_rows_max': max(banks.values()),
+                'rows': len(rows),
+                'rows_full': full,
+                'rows_partial': len(rows) - full,
+                'triples': len(bm.triples()),
+            }
+            if bm.stats() != want:
+                raise BufMapFail('stats {} != {}'.format(bm.stats(), want))
+        print('OK', flush=True)
+
+
+def test_dramaddr_key():
+    """DRAMAddr.key orders like the C BufferMap ranges; numeric_value keeps
+    its original packing"""
+    print('@ dramaddr key', end=' ', flush=True)
+    a, b = pyramses.DRAMAddr(1, 0, 0, 0, 0, 0), pyramses.DRAMAddr(0, 16, 0, 0, 0, 0)
+    if (a.numeric_value != 1 << 52 or b.numeric_value != 1 << 52 or
+            a.key != 1 << 56 or b.key != 16 << 48 or a == b or not b < a):
+        raise MsysFail('bad DRAMAddr packing: {!r} {!r}'.format(a, b))
+    buf, addr = _bufmap_buffer(2 * _M)
+    m = pyramses.MemorySystem()
+    m.load(BUFMAP_MSYS[1])
+    with pyramses.BufferMap(addr, len(buf), ScrambleMap(), m) as bm:
+        starts = [start for start, _ in bm.ranges()]
+    keys = [da.key for da in starts]
+    if keys != sorted(set(keys)) or starts != sorted(starts):
+        raise MsysFail('DRAMAddr keys do not follow the BufferMap range order')
+    print('OK', flush=True)
+
+
+def test_bufmap_edit():
+    """Edits that would corrupt a BufferMap must be rejected"""
+    shift = 21
+    pgsz = 1 << shift
+    m = pyramses.MemorySystem()
+    m.load('map:naive:ddr3')
+    buf = mmap.mmap(-1, 2 * pgsz)
+    base = ctypes.addressof(ctypes.c_char.from_buffer(buf))
+    addr = (base + pgsz - 1) & ~(pgsz - 1)
+    print('@ bufmap edits', end=' ', flush=True)
+    with pyramses.BufferMap(addr, pgsz, pyramses.Heurmap(shift, 0), m) as bm:
+        before = bm.stats()
+        for op, args in ((bm.extend, (addr, pgsz)), (bm.remove, (addr, pgsz))):
+            try:
+                op(*args)
+            except pyramses.RamsesError:
+                pass
+            else:
+                raise BufMapFail('{} {} accepted'.format(op.__name__, args))
+        bm.extend(addr + 1, 0)
+        bm.remove(addr + 1, 0)
+        if bm.stats() != before:
+            raise BufMapFail('map changed by rejected or empty edits')
+    print('OK', flush=True)
+
 if __name__ == '__main__':
+    if len(sys.argv) > 1:
+        pyramses.simd_cap(SIMD_LEVELS[sys.argv[1]])
     try:
         test()
+        test_xor_masks()
+        test_arrays()
+        test_pagemap_holes()
+        test_pagemap_huge()
+        test_translate_cache()
+        test_dramaddr_key()
+        test_bufmap_edit()
+        test_bufmap_iter()
+        test_bufmap_parallel()
+        test_bufmap_searchidx()
+        test_bufmap_find_va()
+        test_bufmap_ptes()
+        test_bufmap_snapshot()
+        test_bufmap_triples()
+        test_bufmap_rowidx()
+        test_bufmap_stats()
         print('Success')
     except TestFail as e:
         print('\n'.join((
-            'FAIL',
+            {CompiledFail: 'COMPILED FAIL',
+             ScalarFail: 'SCALAR FAIL'}.get(type(e), 'FAIL'),
             '{:#x} != {:#x}'.format(e.addr, e.pa),
             '{:#x} -> {!s} -> {:#x}'.format(e.addr, e.da, e.pa)
         )))
         sys.exit(1)
+    except BufMapFail as e:
+        print('BUFMAP FAIL\n' + str(e))
+        sys.exit(1)
+    except CacheFail as e:
+        print('CACHE FAIL\n' + str(e))
+        sys.exit(1)
+    except MsysFail as e:
+        print('MSYS FAIL\n' + str(e))
+        sys.exit(1)
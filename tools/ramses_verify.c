@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Check that a memory system maps physical ranges to DRAM one-to-one, and
+ * that its compiled forms agree with the interpreted one.
+ * Prints the first failing address and exits with 1 if there is one.
+ *
+ * Usage: ramses_verify [-j THREADS] [-p PAGESIZE] [-s SIMD] MSYS START:END...
+ *   -j  Number of threads to use (default: all online CPUs)
+ *   -p  Page size used to pick the step between checked addresses
+ *   -s  Widest vector extension to use: scalar, avx2 or avx512 (default)
+ */
+#define _XOPEN_SOURCE 700
+
+#include <ramses/map.h>
+#include <ramses/msys.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_PAGESIZE 4096
+
+static int parse_range(const char *s, struct PhysRange *r)
+{
+	char *end;
+	r->start = strtoull(s, &end, 0);
+	if (*end != ':') {
+		return 1;
+	}
+	r->end = strtoull(end + 1, &end, 0);
+	return (*end != '\0' || r->end < r->start);
+}
+
+static int parse_simd(const char *s, enum SIMDLevel *lvl)
+{
+	if (!strcmp(s, "scalar")) {
+		*lvl = SIMD_LEVEL_SCALAR;
+	} else if (!strcmp(s, "avx2")) {
+		*lvl = SIMD_LEVEL_AVX2;
+	} else if (!strcmp(s, "avx512")) {
+		*lvl = SIMD_LEVEL_AVX512;
+	} else {
+		return 1;
+	}
+	return 0;
+}
+
+static const char *fail_kind(int form)
+{
+	switch (form) {
+	case MSYS_VERIFY_SCALAR:
+		return "SCALAR FAIL";
+	case MSYS_FUSE:
+		return "FUSED FAIL";
+	case MSYS_JIT:
+		return "JIT FAIL";
+	default:
+		return "FAIL";
+	}
+}
+
+static void print_dramaddr(struct DRAMAddr a)
+{
+	printf("(%1x %1x %1x %1x %4x %3x)", a.chan, a.dimm, a.rank, a.bank,
+	       a.row, a.col);
+}
+
+int main(int argc, char *argv[])
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int nthreads = (ncpu > 0) ? (int)ncpu : 1;
+	size_t pagesz = DEFAULT_PAGESIZE;
+	struct PhysRange *ranges;
+	size_t nranges;
+	const char *msys;
+	struct MemorySystem m;
+	struct MSYSVerifyFail f;
+	enum SIMDLevel simd;
+	int opt, err, ret = 0;
+
+	while ((opt = getopt(argc, argv, "j:p:s:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'p':
+			pagesz = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			if (parse_simd(optarg, &simd)) {
+				goto usage;
+			}
+			ramses_simd_cap(simd);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (argc - optind < 2 || !pagesz) {
+		goto usage;
+	}
+	msys = argv[optind++];
+	nranges = argc - optind;
+	ranges = malloc(nranges * sizeof(*ranges));
+	if (ranges == NULL) {
+		perror("malloc");
+		return 2;
+	}
+	for (size_t i = 0; i < nranges; i++) {
+		if (parse_range(argv[optind + i], &ranges[i])) {
+			fprintf(stderr, "Bad range: %s\n", argv[optind + i]);
+			free(ranges);
+			return 2;
+		}
+	}
+
+	/* Compile as far as possible, so that every form gets checked */
+	err = ramses_msys_load_flags(msys, &m, NULL, MSYS_JIT);
+	if (err) {
+		fprintf(stderr, "Cannot load memory system: %s\n",
+		        ramses_msys_load_strerr(err));
+		free(ranges);
+		return 2;
+	}
+	printf("@ %s", msys);
+	fflush(stdout);
+	if (ramses_msys_verify(&m, ranges, nranges, pagesz, nthreads, &f)) {
+		printf("\n%s\n%#llx != %#llx\n%#llx -> ", fail_kind(f.form),
+		       (unsigned long long)f.addr, (unsigned long long)f.pa,
+		       (unsigned long long)f.addr);
+		print_dramaddr(f.da);
+		printf(" -> %#llx\n", (unsigned long long)f.pa);
+		ret = 1;
+	} else {
+		printf(" OK\n");
+	}
+	ramses_msys_free(&m);
+	free(ranges);
+	return ret;
+
+usage:
+	fprintf(stderr, "Usage: %s [-j THREADS] [-p PAGESIZE] [-s SIMD] "
+	        "MSYS START:END...\n", argv[0]);
+	return 2;
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2018 Vrije Universiteit Amsterdam
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <ramses/translate/cache.h>
+
+#include "bitops.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t pow2_ceil(size_t n)
+{
+	size_t r = 1;
+	while (r < n) {
+		r <<= 1;
+	}
+	return r;
+}
+
+static struct TransCacheEntry *tc_set(struct TransCache *c, uintptr_t vpage)
+{
+	return &c->entries[(vpage & (c->nsets - 1)) * TRANSCACHE_WAYS];
+}
+
+static struct TransCacheEntry *tc_lookup(struct TransCache *c, uintptr_t vpage)
+{
+	struct TransCacheEntry *set = tc_set(c, vpage);
+	for (int w = 0; w < TRANSCACHE_WAYS; w++) {
+		if (set[w].vpage == vpage) {
+			return &set[w];
+		}
+	}
+	return NULL;
+}
+
+/* Insert or refresh a translation, evicting the least recently used way */
+static void tc_insert(struct TransCache *c, uintptr_t vpage, physaddr_t pa)
+{
+	struct TransCacheEntry *set = tc_set(c, vpage);
+	struct TransCacheEntry *victim = &set[0];
+	for (int w = 0; w < TRANSCACHE_WAYS; w++) {
+		if (set[w].vpage == vpage) {
+			victim = &set[w];
+			break;
+		} else if (set[w].stamp < victim->stamp) {
+			victim = &set[w];
+		}
+	}
+	victim->vpage = vpage;
+	victim->pa = pa;
+	victim->stamp = ++c->clock;
+}
+
+static void tc_drop(struct TransCacheEntry *e)
+{
+	e->vpage = UINTPTR_MAX;
+	e->stamp = 0;
+}
+
+static physaddr_t cache_trans(uintptr_t addr, int page_shift, union TranslateArg arg)
+{
+	struct TransCache *c = (struct TransCache *)arg.p;
+	const uintptr_t vpage = addr >> page_shift;
+	const uintptr_t first = vpage & ~(uintptr_t)(c->readahead - 1);
+	struct TransCacheEntry *e;
+	physaddr_t win[TRANSCACHE_MAX_READAHEAD];
+	int err = errno;
+
+	c->stats.lookups++;
+	if ((e = tc_lookup(c, vpage)) != NULL) {
+		c->stats.hits++;
+		e->stamp = ++c->clock;
+		return e->pa + (addr & LS_BITMASK(page_shift));
+	}
+	c->stats.misses++;
+
+	/* Fetch the whole aligned window around the page in one go */
+	for (size_t i = 0; i < c->readahead; i++) {
+		win[i] = RAMSES_BADADDR;
+	}
+	c->stats.backend_calls++;
+	c->stats.backend_pages += c->readahead;
+	ramses_translate_range(&c->backend, first << page_shift, c->readahead, win);
+	for (size_t i = 0; i < c->readahead; i++) {
+		if (win[i] != RAMSES_BADADDR) {
+			tc_insert(c, first + i, win[i]);
+		}
+	}
+	if (win[vpage - first] == RAMSES_BADADDR) {
+		/* Have the backend itself report what went wrong */
+		c->stats.backend_calls++;
+		c->stats.backend_pages++;
+		return ramses_translate(&c->backend, addr);
+	}
+	/* Misses elsewhere in the window are not this lookup's concern */
+	errno = err;
+	return win[vpage - first] + (addr & LS_BITMASK(page_shift));
+}
+
+/*
+ * Serve cached pages from the cache and fetch each run of uncached pages with
+ * a single backend call, caching what comes back
+ */
+static size_t cache_range(uintptr_t addr, size_t npages, physaddr_t *out,
+                          int page_shift, union TranslateArg arg)
+{
+	struct TransCache *c = (struct TransCache *)arg.p;
+	const uintptr_t first = addr >> page_shift;
+	size_t ok = 0;
+	size_t i = 0;
+
+	while (i < npages) {
+		struct TransCacheEntry *e;
+		size_t run;
+
+		c->stats.lookups++;
+		if ((e = tc_lookup(c, first + i)) != NULL) {
+			c->stats.hits++;
+			e->stamp = ++c->clock;
+			out[i++] = e->pa;
+			ok++;
+			continue;
+		}
+		c->stats.misses++;
+		for (run = 1; i + run < npages && tc_lookup(c, first + i + run) == NULL; run++) {
+			c->stats.lookups++;
+			c->stats.misses++;
+		}
+		for (size_t j = 0; j < run; j++) {
+			out[i + j] = RAMSES_BADADDR;
+		}
+		c->stats.backend_calls++;
+		c->stats.backend_pages += run;
+		ok += ramses_translate_range(&c->backend, (first + i) << page_shift, run, out + i);
+		for (size_t j = 0; j < run; j++) {
+			if (out[i + j] != RAMSES_BADADDR) {
+				tc_insert(c, first + i + j, out[i + j]);
+			}
+		}
+		i += run;
+	}
+	return ok;
+}
+
+
+int ramses_translate_cache_init(struct TransCache *c,
+                                const struct Translation *backend,
+                                size_t entries, size_t readahead)
+{
+	size_t nsets = pow2_ceil((entries + TRANSCACHE_WAYS - 1) / TRANSCACHE_WAYS);
+
+	memset(c, 0, sizeof(*c));
+	c->entries = malloc(nsets * TRANSCACHE_WAYS * sizeof(*c->entries));
+	if (c->entries == NULL) {
+		return 1;
+	}
+	c->backend = *backend;
+	c->nsets = nsets;
+	/* A window maps to distinct sets, so a fill never evicts itself */
+	c->readahead = pow2_ceil(readahead);
+	if (c->readahead > TRANSCACHE_MAX_READAHEAD) {
+		c->readahead = TRANSCACHE_MAX_READAHEAD;
+	}
+	if (c->readahead > nsets) {
+		c->readahead = nsets;
+	}
+	ramses_translate_cache_flush(c);
+	return 0;
+}
+
+void ramses_translate_cache(struct Translation *t, struct TransCache *c)
+{
+	t->translate = cache_trans;
+	t->translate_range = cache_range;
+	t->page_shift = c->backend.page_shift;
+	t->arg.p = c;
+}
+
+void ramses_translate_cache_invalidate(struct TransCache *c,
+                                       uintptr_t addr, size_t len)
+{
+	const int shift = c->backend.page_shift;
+	uintptr_t lo, hi;
+
+	if (!len) {
+		return;
+	}
+	lo = addr >> shift;
+	hi = (addr + len - 1) >> shift;
+	c->stats.invalidations++;
+	if (hi - lo >= c->nsets) {
+		/* Touches every set anyway */
+		for (size_t i = 0; i < c->nsets * TRANSCACHE_WAYS; i++) {
+			if (c->entries[i].vpage >= lo && c->entries[i].vpage <= hi) {
+				tc_drop(&c->entries[i]);
+			}
+		}
+	} else {
+		for (uintptr_t p = lo; p <= hi; p++) {
+			struct TransCacheEntry *e = tc_lookup(c, p);
+			if (e != NULL) {
+				tc_drop(e);
+			}
+		}
+	}
+}
+
+void ramses_translate_cache_flush(struct TransCache *c)
+{
+	for (size_t i = 0; i < c->nsets * TRANSCACHE_WAYS; i++) {
+		tc_drop(&c->entries[i]);
+	}
+	c->clock = 0;
+}
+
+void ramses_translate_cache_stats(struct TransCache *c,
+                                  struct TransCacheStats *out, int reset)
+{
+	if (out != NULL) {
+		*out = c->stats;
+	}
+	if (reset) {
+		memset(&c->stats, 0, sizeof(c->stats));
+	}
+}
+
+void ramses_translate_cache_free(struct TransCache *c)
+{
+	free(c->entries);
+	c->entries = NULL;
+	c->nsets = 0;
+}
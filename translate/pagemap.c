@@ -15,15 +15,59 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  *
  */
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 
 #include <ramses/translate/pagemap.h>
 
 #include "bitops.h"
+#include "par.h"
 
 #include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define PMD_SHIFT 21
+
+/* Pagemap entries read at a time when translating ranges */
+#define PAGEMAP_CHUNK 4096
+/* Regions in memory asked of PAGEMAP_SCAN at a time */
+#define PAGEMAP_SCAN_REGIONS 64
+/* Widest gap between such regions read through rather than skipped */
+#define PAGEMAP_SCAN_GAP 256
+/* Fewest pages worth giving a thread of their own */
+#define PAGEMAP_PAR_MIN (1UL << 16)
+#define PAGEMAP_MAX_THREADS 8
+
+/* PAGEMAP_SCAN ioctl ABI (Linux 6.7), for headers that predate it */
+#ifndef PAGEMAP_SCAN
+struct page_region {
+	uint64_t start;
+	uint64_t end;
+	uint64_t categories;
+};
+
+struct pm_scan_arg {
+	uint64_t size;
+	uint64_t flags;
+	uint64_t start;
+	uint64_t end;
+	uint64_t walk_end;
+	uint64_t vec;
+	uint64_t vec_len;
+	uint64_t max_pages;
+	uint64_t category_inverted;
+	uint64_t category_mask;
+	uint64_t category_anyof_mask;
+	uint64_t return_mask;
+};
+
+#define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+#define PAGE_IS_PRESENT (1 << 3)
+#endif
 
 
 static int size2shift(size_t size)
@@ -34,11 +78,35 @@ static int size2shift(size_t size)
 	return r;
 }
 
+/* Shift of the base page size, looked up once */
+static int base_shift(void)
+{
+	static int shift;
+	if (!shift) {
+		shift = size2shift(sysconf(_SC_PAGESIZE));
+	}
+	return shift;
+}
+
+/*
+ * Pagemap has one entry per base page; pages larger than that are
+ * translated through the entry of their first base page.
+ */
+static int read_entry(int fd, uintptr_t addr, int page_shift, uint64_t *ent)
+{
+	const int bshift = base_shift();
+	off_t pagemap_off = ((addr >> page_shift) << (page_shift - bshift)) *
+	                    sizeof(*ent);
+	if (pread(fd, ent, sizeof(*ent), pagemap_off) != sizeof(*ent)) {
+		return 1;
+	}
+	return 0;
+}
+
 static physaddr_t pagemap_trans(uintptr_t addr, int page_shift, union TranslateArg arg)
 {
 	uint64_t pagemap_entry;
-	off_t pagemap_off = (addr >> page_shift) * sizeof(pagemap_entry);
-	if (pread(arg.val, &pagemap_entry, sizeof(pagemap_entry), pagemap_off) != sizeof(pagemap_entry)) {
+	if (read_entry(arg.val, addr, page_shift, &pagemap_entry)) {
 		return RAMSES_BADADDR;
 	}
 	/* Sanity check that page is in memory */
@@ -46,45 +114,360 @@ static physaddr_t pagemap_trans(uintptr_t addr, int page_shift, union TranslateA
 		errno = ENODATA;
 		return RAMSES_BADADDR;
 	}
-	return ((pagemap_entry & LS_BITMASK(55)) << page_shift) +
+	return ((pagemap_entry & LS_BITMASK(55)) << base_shift()) +
 			(addr & LS_BITMASK(page_shift));
 }
 
-static size_t pagemap_range(uintptr_t addr, size_t npages, physaddr_t *out,
-                            int page_shift, union TranslateArg arg)
+/* Mark the `n' pages at `out' as not in memory; returns `n' */
+static size_t pagemap_absent(physaddr_t *out, size_t n, size_t *fails)
 {
-	uint64_t *pagemap_buf = malloc(npages * sizeof(*pagemap_buf));
-	off_t pagemap_off = (addr >> page_shift) * sizeof(*pagemap_buf);
-	if (pagemap_buf != NULL) {
-		size_t fails = 0;
-		size_t read_ptes = pread(arg.val,
-		                         pagemap_buf,
-		                         npages * sizeof(*pagemap_buf),
-		                         pagemap_off)
-		                   / sizeof(*pagemap_buf);
-		for (size_t i = 0; i < read_ptes; i++) {
-			if (BIT(63, pagemap_buf[i])) {
-				out[i] = ((pagemap_buf[i] & LS_BITMASK(55)) << page_shift);
+	for (size_t i = 0; i < n; i++) {
+		out[i] = RAMSES_BADADDR;
+	}
+	*fails += n;
+	return n;
+}
+
+/*
+ * Translate the base pages [vpage, vpage + n) into `out', reading their
+ * pagemap entries PAGEMAP_CHUNK at a time. Returns how many pages were
+ * translated, adding those not in memory to `*fails'.
+ */
+static size_t pagemap_read_chunks(int fd, uintptr_t vpage, size_t n,
+                                  physaddr_t *out, int page_shift, size_t *fails)
+{
+	uint64_t buf[PAGEMAP_CHUNK];
+	size_t done = 0;
+
+	while (done < n) {
+		size_t want = (n - done < PAGEMAP_CHUNK) ? n - done : PAGEMAP_CHUNK;
+		ssize_t r = pread(fd, buf, want * sizeof(*buf),
+		                  (vpage + done) * sizeof(*buf));
+		size_t got;
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		got = (r > 0) ? r / sizeof(*buf) : 0;
+		if (!got) {
+			break;
+		}
+		for (size_t i = 0; i < got; i++) {
+			if (BIT(63, buf[i])) {
+				out[done + i] = (buf[i] & LS_BITMASK(55)) << page_shift;
+			} else {
+				out[done + i] = RAMSES_BADADDR;
+				(*fails)++;
+			}
+		}
+		done += got;
+	}
+	return done;
+}
+
+/*
+ * Translate the pages of size 1 << `page_shift' from `addr' on through the
+ * entries of their first base pages, reading as many pages' worth of entries
+ * as fit in PAGEMAP_CHUNK at a time.
+ */
+static size_t pagemap_range_huge(uintptr_t addr, size_t npages, physaddr_t *out,
+                                 int page_shift, union TranslateArg arg)
+{
+	const int bshift = base_shift();
+	const size_t sub = (size_t)1 << (page_shift - bshift);
+	const size_t per = (sub < PAGEMAP_CHUNK) ? PAGEMAP_CHUNK / sub : 1;
+	const uintptr_t vpage = (addr >> page_shift) << (page_shift - bshift);
+	uint64_t buf[PAGEMAP_CHUNK];
+	size_t fails = 0;
+	size_t i = 0;
+
+	while (i < npages) {
+		const size_t want = (npages - i < per) ? npages - i : per;
+		ssize_t r = pread(arg.val, buf, ((want - 1) * sub + 1) * sizeof(*buf),
+		                  (vpage + i * sub) * sizeof(*buf));
+		size_t got;
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		got = (r > 0) ? (r / sizeof(*buf) + sub - 1) / sub : 0;
+		if (!got) {
+			break;
+		}
+		for (size_t k = 0; k < got; k++, i++) {
+			if (BIT(63, buf[k * sub])) {
+				out[i] = (buf[k * sub] & LS_BITMASK(55)) << bshift;
 			} else {
 				out[i] = RAMSES_BADADDR;
 				fails++;
 			}
 		}
-		free(pagemap_buf);
-		if (fails) {
-			errno = ENODATA;
+	}
+	if (fails) {
+		errno = ENODATA;
+	}
+	return i - fails;
+}
+
+/*
+ * Translate the base pages [vpage, vpage + n) into `out' like
+ * pagemap_read_chunks, but only reading the stretches PAGEMAP_SCAN reports
+ * in memory; the pages in between are not. Falls back to reading everything
+ * if the kernel does not support the ioctl.
+ */
+static size_t pagemap_read_scan(int fd, uintptr_t vpage, size_t n,
+                                physaddr_t *out, int page_shift, size_t *fails)
+{
+	const uintptr_t end = vpage + n;
+	struct page_region regs[PAGEMAP_SCAN_REGIONS];
+	uintptr_t cur = vpage;
+
+	while (cur < end) {
+		struct pm_scan_arg arg = {
+			.size = sizeof(arg),
+			.start = (uint64_t)cur << page_shift,
+			.end = (uint64_t)end << page_shift,
+			.vec = (uintptr_t)regs,
+			.vec_len = PAGEMAP_SCAN_REGIONS,
+			.category_mask = PAGE_IS_PRESENT,
+			.return_mask = PAGE_IS_PRESENT,
+		};
+		const uintptr_t from = cur;
+		int nregs;
+
+		do {
+			nregs = ioctl(fd, PAGEMAP_SCAN, &arg);
+		} while (nregs < 0 && errno == EINTR);
+		if (nregs < 0 && (errno == ENOTTY || errno == EINVAL)) {
+			return cur - vpage + pagemap_read_chunks(fd, cur, end - cur,
+			                                         &out[cur - vpage],
+			                                         page_shift, fails);
+		} else if (nregs < 0) {
+			break;
+		}
+		for (int i = 0, j; i < nregs; i = j) {
+			const uintptr_t lo = regs[i].start >> page_shift;
+			uintptr_t hi = regs[i].end >> page_shift;
+			size_t got;
+			/* Short gaps cost less to read along than to skip */
+			for (j = i + 1; j < nregs &&
+			                (regs[j].start >> page_shift) - hi < PAGEMAP_SCAN_GAP; j++)
+			{
+				hi = regs[j].end >> page_shift;
+			}
+			cur += pagemap_absent(&out[cur - vpage], lo - cur, fails);
+			got = pagemap_read_chunks(fd, lo, hi - lo, &out[lo - vpage],
+			                          page_shift, fails);
+			cur += got;
+			if (got < hi - lo) {
+				return cur - vpage;
+			}
+		}
+		/* The rest of the stretch walked is not in memory */
+		if ((arg.walk_end >> page_shift) > cur) {
+			cur += pagemap_absent(&out[cur - vpage],
+			                      (arg.walk_end >> page_shift) - cur, fails);
+		}
+		if (cur == from) {
+			break;
+		}
+	}
+	return cur - vpage;
+}
+
+/*
+ * Translate the base pages [vpage, vpage + n) into `out'. Entries are read
+ * as they come until the first page not in memory; from there on only the
+ * stretches PAGEMAP_SCAN reports in memory are, as walking the page tables
+ * for the scan only pays off across holes.
+ * Returns how many pages were translated, adding those not in memory to
+ * `*fails'.
+ */
+static size_t pagemap_read(int fd, uintptr_t vpage, size_t n, physaddr_t *out,
+                           int page_shift, size_t *fails)
+{
+	size_t done = 0;
+
+	while (done < n) {
+		const size_t before = *fails;
+		const size_t want = (n - done < PAGEMAP_CHUNK) ? n - done : PAGEMAP_CHUNK;
+		const size_t got = pagemap_read_chunks(fd, vpage + done, want,
+		                                       &out[done], page_shift, fails);
+		done += got;
+		if (got < want) {
+			return done;
+		} else if (*fails != before) {
+			break;
 		}
-		return read_ptes - fails;
-	} else {
-		return 0;
 	}
+	return done + pagemap_read_scan(fd, vpage + done, n - done, &out[done],
+	                                page_shift, fails);
 }
 
+/* A range translation split over threads */
+struct RangeJob {
+	int fd;
+	uintptr_t vpage;
+	size_t npages;
+	physaddr_t *out;
+	int page_shift;
+	size_t done[PAGEMAP_MAX_THREADS];
+	size_t fails[PAGEMAP_MAX_THREADS];
+};
+
+static void pagemap_range_part(void *arg, int t, int nthreads)
+{
+	struct RangeJob *j = (struct RangeJob *)arg;
+	const size_t lo = par_chunk(j->npages, t, nthreads);
+	const size_t hi = par_chunk(j->npages, t + 1, nthreads);
+
+	j->fails[t] = 0;
+	j->done[t] = pagemap_read(j->fd, j->vpage + lo, hi - lo, j->out + lo,
+	                          j->page_shift, &j->fails[t]);
+}
+
+static size_t pagemap_range(uintptr_t addr, size_t npages, physaddr_t *out,
+                            int page_shift, union TranslateArg arg)
+{
+	struct RangeJob job = {
+		.fd = arg.val,
+		.vpage = addr >> page_shift,
+		.npages = npages,
+		.out = out,
+		.page_shift = page_shift
+	};
+	size_t nthreads = npages / PAGEMAP_PAR_MIN;
+	size_t done = 0, fails = 0;
+
+	if (page_shift != base_shift()) {
+		return pagemap_range_huge(addr, npages, out, page_shift, arg);
+	}
+	/* Callers already running in parallel get no more threads */
+	if (nthreads > 1 && !par_nested()) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads > PAGEMAP_MAX_THREADS) {
+			nthreads = PAGEMAP_MAX_THREADS;
+		}
+		if (ncpu > 0 && nthreads > (size_t)ncpu) {
+			nthreads = ncpu;
+		}
+	} else {
+		nthreads = 1;
+	}
+	par_run(nthreads, pagemap_range_part, &job);
+	/* Only the translated prefix of the range counts */
+	for (size_t t = 0; t < nthreads; t++) {
+		done += job.done[t];
+		fails += job.fails[t];
+		if (job.done[t] < par_chunk(npages, t + 1, nthreads) -
+		                  par_chunk(npages, t, nthreads))
+		{
+			break;
+		}
+	}
+	if (fails) {
+		errno = ENODATA;
+	}
+	return done - fails;
+}
 
 void ramses_translate_pagemap(struct Translation *t, int pagemap_fd)
 {
 	t->translate = pagemap_trans;
 	t->translate_range = pagemap_range;
-	t->page_shift = size2shift(sysconf(_SC_PAGESIZE));
+	t->page_shift = base_shift();
 	t->arg.val = pagemap_fd;
 }
+
+/*
+ * Page shift of the hugetlbfs mappings covering [lo, hi), according to their
+ * KernelPageSize in /proc/self/smaps. Returns the base page shift if any part
+ * is not on hugetlbfs, or 0 if smaps cannot be read.
+ */
+static int smaps_shift(uintptr_t lo, uintptr_t hi)
+{
+	FILE *f = fopen("/proc/self/smaps", "r");
+	char *line = NULL;
+	size_t linesz = 0;
+	uintptr_t vstart = 0, vend = 0;
+	uintptr_t covered = lo;
+	int shift = -1;
+
+	if (f == NULL) {
+		return 0;
+	}
+	while (getline(&line, &linesz, f) > 0) {
+		unsigned long a, b, kb;
+		if (sscanf(line, "%lx-%lx ", &a, &b) == 2) {
+			vstart = a;
+			vend = b;
+		} else if (sscanf(line, "KernelPageSize: %lu kB", &kb) == 1 &&
+		           vstart < hi && vend > lo)
+		{
+			int s = size2shift(kb << 10);
+			/* Mappings must be contiguous and agree on page size */
+			if (vstart > covered || (shift >= 0 && s != shift)) {
+				shift = -1;
+				break;
+			}
+			shift = s;
+			covered = vend;
+		}
+	}
+	free(line);
+	fclose(f);
+	return (shift < 0 || covered < hi) ? base_shift() : shift;
+}
+
+/*
+ * Whether every PMD-sized page in [lo, hi) maps onto one aligned, physically
+ * contiguous PMD-sized frame, judging by the pagemap entries of all its base
+ * pages. Such pages translate exactly at PMD size, whatever backs them.
+ */
+static int thp_backed(int pagemap_fd, uintptr_t lo, uintptr_t hi)
+{
+	const int bshift = base_shift();
+	const size_t pmd_pages = (size_t)1 << (PMD_SHIFT - bshift);
+	physaddr_t pa[PAGEMAP_CHUNK];
+
+	if (pmd_pages > PAGEMAP_CHUNK) {
+		return 0;
+	}
+	for (uintptr_t a = lo; a < hi; a += 1ULL << PMD_SHIFT) {
+		size_t fails = 0;
+		if (pagemap_read_chunks(pagemap_fd, a >> bshift, pmd_pages, pa, bshift,
+		                        &fails) != pmd_pages || fails ||
+		    pa[0] & LS_BITMASK(PMD_SHIFT))
+		{
+			return 0;
+		}
+		for (size_t i = 1; i < pmd_pages; i++) {
+			if (pa[i] != pa[0] + ((physaddr_t)i << bshift)) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+int ramses_translate_pagemap_huge(struct Translation *t, int pagemap_fd,
+                                  void *buf, size_t len)
+{
+	const uintptr_t lo = (uintptr_t)buf;
+	const uintptr_t hi = lo + len;
+	int shift = smaps_shift(lo, hi);
+
+	ramses_translate_pagemap(t, pagemap_fd);
+	if (!shift) {
+		return 1;
+	}
+	if (shift == t->page_shift && PMD_SHIFT > shift &&
+	    thp_backed(pagemap_fd, lo, hi))
+	{
+		shift = PMD_SHIFT;
+	}
+	/* The buffer has to start on a page boundary of the chosen size */
+	if (lo & LS_BITMASK(shift)) {
+		shift = t->page_shift;
+	}
+	t->page_shift = shift;
+	return 0;
+}